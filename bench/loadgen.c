@@ -0,0 +1,493 @@
+// Генератор нагрузки для прокси: замкнутый цикл (каждое соединение шлёт следующий запрос после ответа)
+// или открытый (запросы приходят с заданной частотой, задержка считается от запланированного момента).
+// Популярность URL распределена по Zipf, итог - req/s, p50/p99/p999 и доля попаданий в кэш.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LOADGEN_MAX_EVENTS 256 // Событий за один вызов epoll_wait
+#define LOADGEN_HEADER_SIZE 8192 // Максимальный размер заголовков ответа
+#define LOADGEN_READ_SIZE (64 * 1024) // Буфер чтения тела ответа
+#define LOADGEN_PENDING 65536 // Запланированных, но ещё не отправленных запросов потока (степень двойки)
+#define LOADGEN_URL_SIZE 512
+#define HIST_SUB_BITS 4 // Та же сетка, что у гистограмм прокси: 16 ячеек на степень двойки
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 36
+#define HIST_BUCKETS ((HIST_MAX_SHIFT - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+typedef struct histogram {
+    uint64_t count; // Наблюдений
+    long long max; // Максимум, мкс
+    uint64_t buckets[HIST_BUCKETS]; // Наблюдения по ячейкам
+} histogram;
+
+struct worker;
+
+// Соединение с прокси, в каждый момент несёт не больше одного запроса
+typedef struct client {
+    struct worker *worker; // Поток-владелец
+    int fd; // Сокет, -1 если не подключён
+    int busy; // Запрос отправлен, ждём ответ
+    long long start; // Начало запроса (в открытом цикле - запланированное), мкс
+    char header[LOADGEN_HEADER_SIZE + 1]; // Накопленные заголовки ответа
+    size_t header_len;
+    int in_body; // Заголовки разобраны, читаем тело
+    int until_close; // Длина не указана, тело до закрытия соединения
+    size_t body_left; // Осталось байт тела
+    int status; // Код ответа
+} client;
+
+typedef struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    client *clients; // Соединения потока
+    int nclients;
+    int *idle; // Свободные соединения открытого цикла
+    int nidle;
+    uint64_t rng; // Состояние генератора xorshift64*
+    long long pending[LOADGEN_PENDING]; // Запланированные моменты запросов, ждущих соединения
+    size_t pending_head, pending_tail;
+    long long next_arrival; // Следующий запланированный запрос, мкс
+    double rate; // Запросов в секунду на поток (0 - замкнутый цикл)
+    histogram latency; // Задержка запросов окна измерения
+    uint64_t requests; // Завершённые запросы окна измерения
+    uint64_t errors; // Ошибки соединения и ответы не 200
+    uint64_t dropped; // Запросы, не поместившиеся в очередь открытого цикла
+    uint64_t bytes; // Байт ответов
+    char buffer[LOADGEN_READ_SIZE]; // Буфер чтения
+} worker;
+
+static struct sockaddr_in proxy_addr;
+static const char *url_prefix = "http://127.0.0.1:9000/obj/";
+static const char *url_suffix = "";
+static int connections = 64;
+static int threads = 4;
+static int duration = 10;
+static int warmup = 2;
+static size_t url_count = 10000;
+static double zipf_s = 0.99;
+static double rate = 0;
+static int admin_port = 0;
+static double *zipf_cdf; // Накопленные вероятности URL по убыванию популярности
+static long long measure_start; // Начало окна измерения, мкс
+static long long measure_end; // Конец окна измерения, мкс
+
+static long long now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int hist_bucket(long long value) {
+    if (value < HIST_SUB_BUCKETS) return value < 0 ? 0 : (int)value;
+    int shift = 63 - __builtin_clzll((unsigned long long)value);
+    if (shift > HIST_MAX_SHIFT) return HIST_BUCKETS - 1;
+    return (shift - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((int)(value >> (shift - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Верхняя граница ячейки (не включительно)
+static long long hist_high(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) return bucket + 1;
+    int shift = bucket / HIST_SUB_BUCKETS - 1 + HIST_SUB_BITS;
+    long long low = (long long)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (shift - HIST_SUB_BITS);
+    return low + (1LL << (shift - HIST_SUB_BITS));
+}
+
+static void hist_record(histogram *h, long long value) {
+    h->buckets[hist_bucket(value)]++;
+    h->count++;
+    if (value > h->max) h->max = value;
+}
+
+static long long hist_quantile(const histogram *h, double q) {
+    if (!h->count) return 0;
+    uint64_t rank = (uint64_t)(q * h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t cumulative = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        cumulative += h->buckets[b];
+        if (cumulative > rank) return hist_high(b) < h->max ? hist_high(b) : h->max;
+    }
+    return h->max;
+}
+
+static uint64_t rng_next(worker *w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_uniform(worker *w) {
+    return (rng_next(w) >> 11) * 0x1.0p-53;
+}
+
+// Номер URL по Zipf: двоичный поиск по накопленным вероятностям
+static size_t zipf_pick(worker *w) {
+    double u = rng_uniform(w);
+    size_t low = 0, high = url_count - 1;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static void zipf_setup() {
+    zipf_cdf = (double *)malloc(url_count * sizeof(double));
+    if (!zipf_cdf) {
+        fprintf(stderr, "Failed to allocate URL table\n");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    for (size_t i = 0; i < url_count; i++) {
+        sum += 1.0 / pow((double)(i + 1), zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (size_t i = 0; i < url_count; i++) zipf_cdf[i] /= sum;
+}
+
+static void client_close(client *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(c->worker->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->busy = 0;
+}
+
+static int client_connect(client *c) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) { // На loopback подключение мгновенное
+        close(fd);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = c;
+    if (epoll_ctl(c->worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    return 0;
+}
+
+// Отправка запроса случайного URL, start - момент, от которого считается задержка
+static void client_send(client *c, long long start) {
+    worker *w = c->worker;
+    if (c->fd < 0 && client_connect(c) < 0) {
+        w->errors++;
+        return;
+    }
+    char request[LOADGEN_URL_SIZE + 64];
+    int len = snprintf(request, sizeof(request), "GET %s%zu%s HTTP/1.1\r\nHost: loadgen\r\n\r\n",
+        url_prefix, zipf_pick(w), url_suffix);
+    if (send(c->fd, request, len, MSG_NOSIGNAL) != len) { // Запрос мал и всегда помещается в пустой сокет
+        w->errors++;
+        client_close(c);
+        return;
+    }
+    c->busy = 1;
+    c->start = start;
+    c->header_len = 0;
+    c->in_body = 0;
+    c->until_close = 0;
+}
+
+static void pending_dispatch(worker *w) {
+    while (w->pending_head != w->pending_tail && w->nidle) {
+        client *c = &w->clients[w->idle[--w->nidle]];
+        client_send(c, w->pending[w->pending_head++ & (LOADGEN_PENDING - 1)]);
+        if (!c->busy) { // Не удалось отправить - соединение вернётся в свободные, запрос потерян как ошибка
+            w->idle[w->nidle++] = (int)(c - w->clients);
+            break;
+        }
+    }
+}
+
+// Ответ получен целиком: учёт и следующий запрос
+static void client_complete(client *c) {
+    worker *w = c->worker;
+    long long now = now_us();
+    c->busy = 0;
+    if (c->start >= measure_start && now <= measure_end) {
+        hist_record(&w->latency, now - c->start);
+        w->requests++;
+        if (c->status != 200) w->errors++;
+    }
+    if (c->until_close) client_close(c);
+    if (w->rate == 0) {
+        client_send(c, now);
+    } else {
+        w->idle[w->nidle++] = (int)(c - w->clients);
+        pending_dispatch(w);
+    }
+}
+
+// Разбор заголовков: код ответа и длина тела
+static int client_headers(client *c, char *end) {
+    if (sscanf(c->header, "HTTP/%*d.%*d %d", &c->status) != 1) return -1;
+    const char *length = strcasestr(c->header, "\r\nContent-Length:");
+    if (length && length < end) c->body_left = strtoull(length + 17, NULL, 10);
+    else c->until_close = 1;
+    c->in_body = 1;
+    return 0;
+}
+
+static void client_read(client *c) {
+    worker *w = c->worker;
+    while (c->fd >= 0) {
+        ssize_t received = recv(c->fd, w->buffer, LOADGEN_READ_SIZE, 0);
+        if (received < 0 && errno == EAGAIN) return;
+        if (received <= 0) {
+            if (c->busy && c->in_body && c->until_close) {
+                client_complete(c); // Ответ без длины закончился с соединением
+                return;
+            }
+            if (c->busy) w->errors++;
+            int was_idle = !c->busy && w->rate != 0;
+            client_close(c);
+            if (w->rate == 0) client_send(c, now_us());
+            else if (!was_idle) {
+                w->idle[w->nidle++] = (int)(c - w->clients);
+                pending_dispatch(w);
+            }
+            return;
+        }
+        w->bytes += received;
+        if (!c->busy) continue; // Лишние данные вне запроса игнорируем
+        size_t offset = 0;
+        if (!c->in_body) {
+            size_t room = LOADGEN_HEADER_SIZE - c->header_len;
+            size_t take = (size_t)received < room ? (size_t)received : room;
+            memcpy(c->header + c->header_len, w->buffer, take);
+            size_t old_len = c->header_len;
+            c->header_len += take;
+            c->header[c->header_len] = '\0';
+            char *end = strstr(c->header, "\r\n\r\n");
+            if (!end) {
+                if (c->header_len == LOADGEN_HEADER_SIZE) {
+                    w->errors++;
+                    client_close(c);
+                }
+                continue;
+            }
+            if (client_headers(c, end) < 0) {
+                w->errors++;
+                client_close(c);
+                continue;
+            }
+            offset = (size_t)(end + 4 - c->header) - old_len; // Начало тела в прочитанном блоке
+        }
+        if (c->until_close) continue;
+        size_t body = (size_t)received - offset;
+        if (body >= c->body_left) {
+            c->body_left = 0;
+            client_complete(c);
+        } else {
+            c->body_left -= body;
+        }
+    }
+}
+
+static void *worker_thread(void *arg) {
+    worker *w = (worker *)arg;
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+    long long now = now_us();
+    if (w->rate == 0) { // Замкнутый цикл: все соединения сразу с запросом
+        for (int i = 0; i < w->nclients; i++) client_send(&w->clients[i], now);
+    } else {
+        for (int i = 0; i < w->nclients; i++) w->idle[w->nidle++] = i;
+        w->next_arrival = now;
+    }
+    while ((now = now_us()) < measure_end) {
+        int timeout = 100;
+        if (w->rate != 0) {
+            // Все наступившие запросы ставим в очередь: если соединений не хватает, их ожидание войдёт в задержку
+            while (w->next_arrival <= now) {
+                if (w->pending_tail - w->pending_head < LOADGEN_PENDING) w->pending[w->pending_tail++ & (LOADGEN_PENDING - 1)] = w->next_arrival;
+                else if (w->next_arrival >= measure_start) w->dropped++;
+                w->next_arrival += (long long)(-log(1.0 - rng_uniform(w)) / w->rate * 1e6);
+            }
+            pending_dispatch(w);
+            long long wait = (w->next_arrival - now) / 1000;
+            if (wait < timeout) timeout = (int)wait;
+        }
+        int count = epoll_wait(w->epoll_fd, events, LOADGEN_MAX_EVENTS, timeout);
+        for (int i = 0; i < count; i++) client_read((client *)events[i].data.ptr);
+    }
+    for (int i = 0; i < w->nclients; i++) client_close(&w->clients[i]);
+    return NULL;
+}
+
+// Счётчики попаданий и промахов с порта метрик прокси
+static int scrape_hits(unsigned long long *hits, unsigned long long *misses) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = proxy_addr;
+    addr.sin_port = htons(admin_port);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    const char *request = "GET /metrics HTTP/1.1\r\nHost: loadgen\r\nConnection: close\r\n\r\n";
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+    static char text[256 * 1024];
+    size_t len = 0;
+    ssize_t received;
+    while (len < sizeof(text) - 1 && (received = recv(fd, text + len, sizeof(text) - 1 - len, 0)) > 0) len += received;
+    text[len] = '\0';
+    close(fd);
+    const char *hit = strstr(text, "\nproxy_cache_hits_total ");
+    const char *miss = strstr(text, "\nproxy_cache_misses_total ");
+    if (!hit || !miss) return -1;
+    *hits = strtoull(hit + 24, NULL, 10);
+    *misses = strtoull(miss + 26, NULL, 10);
+    return 0;
+}
+
+static void sleep_until(long long when) {
+    long long now = now_us();
+    if (when > now) usleep((useconds_t)(when - now));
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -x, --proxy HOST:PORT  proxy address (default 127.0.0.1:8080)\n"
+        "  -u, --url PREFIX       URL prefix, the URL number is appended (default %s)\n"
+        "  -S, --suffix STR       appended after the URL number, e.g. ?size=16384\n"
+        "  -c, --connections N    connections in total (default 64)\n"
+        "  -t, --threads N        generator threads (default 4)\n"
+        "  -d, --duration SEC     measured interval (default 10)\n"
+        "  -w, --warmup SEC       unmeasured warm-up before it (default 2)\n"
+        "  -n, --urls N           distinct URLs (default 10000)\n"
+        "  -s, --zipf S           Zipf exponent, 0 for uniform (default 0.99)\n"
+        "  -r, --rate RPS         open loop at this request rate (default: closed loop)\n"
+        "  -a, --admin PORT       proxy admin port to read the hit ratio from\n",
+        program, url_prefix);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "proxy", required_argument, NULL, 'x' },
+        { "url", required_argument, NULL, 'u' },
+        { "suffix", required_argument, NULL, 'S' },
+        { "connections", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "urls", required_argument, NULL, 'n' },
+        { "zipf", required_argument, NULL, 's' },
+        { "rate", required_argument, NULL, 'r' },
+        { "admin", required_argument, NULL, 'a' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    char proxy[128] = "127.0.0.1:8080";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "x:u:S:c:t:d:w:n:s:r:a:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'x': snprintf(proxy, sizeof(proxy), "%s", optarg); break;
+            case 'u': url_prefix = optarg; break;
+            case 'S': url_suffix = optarg; break;
+            case 'c': connections = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'n': url_count = strtoull(optarg, NULL, 10); break;
+            case 's': zipf_s = atof(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'a': admin_port = atoi(optarg); break;
+            case 'h': usage(argv[0]); return EXIT_SUCCESS;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    char *colon = strrchr(proxy, ':');
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    if (colon) *colon = '\0';
+    proxy_addr.sin_port = htons(colon ? atoi(colon + 1) : 8080);
+    if (inet_pton(AF_INET, proxy, &proxy_addr.sin_addr) != 1 || threads <= 0 || connections < threads || url_count == 0 || duration <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    zipf_setup();
+
+    worker *workers = (worker *)calloc(threads, sizeof(worker));
+    if (!workers) return EXIT_FAILURE;
+    long long start = now_us();
+    measure_start = start + (long long)warmup * 1000000;
+    measure_end = measure_start + (long long)duration * 1000000;
+    for (int i = 0; i < threads; i++) {
+        worker *w = &workers[i];
+        w->nclients = connections / threads + (i < connections % threads);
+        w->clients = (client *)calloc(w->nclients, sizeof(client));
+        w->idle = (int *)calloc(w->nclients, sizeof(int));
+        w->epoll_fd = epoll_create1(0);
+        w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        w->rate = rate / threads;
+        if (!w->clients || !w->idle || w->epoll_fd < 0) return EXIT_FAILURE;
+        for (int j = 0; j < w->nclients; j++) {
+            w->clients[j].worker = w;
+            w->clients[j].fd = -1;
+        }
+        pthread_create(&w->thread, NULL, worker_thread, w);
+    }
+
+    unsigned long long hits0 = 0, misses0 = 0, hits1 = 0, misses1 = 0;
+    sleep_until(measure_start);
+    int scraped = admin_port && scrape_hits(&hits0, &misses0) == 0;
+    sleep_until(measure_end);
+    scraped = scraped && scrape_hits(&hits1, &misses1) == 0;
+
+    histogram total;
+    memset(&total, 0, sizeof(total));
+    uint64_t requests = 0, errors = 0, dropped = 0, bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        for (int b = 0; b < HIST_BUCKETS; b++) total.buckets[b] += w->latency.buckets[b];
+        total.count += w->latency.count;
+        if (w->latency.max > total.max) total.max = w->latency.max;
+        requests += w->requests;
+        errors += w->errors;
+        dropped += w->dropped;
+        bytes += w->bytes;
+    }
+
+    printf("mode        %s, %d connections, %d threads, %zu URLs, zipf %.2f\n",
+        rate > 0 ? "open loop" : "closed loop", connections, threads, url_count, zipf_s);
+    printf("requests    %llu in %d s, errors %llu, dropped %llu\n",
+        (unsigned long long)requests, duration, (unsigned long long)errors, (unsigned long long)dropped);
+    printf("throughput  %.1f req/s, %.1f MB/s\n", requests / (double)duration, bytes / (double)duration / (1 << 20));
+    printf("latency     p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+        hist_quantile(&total, 0.5) / 1e3, hist_quantile(&total, 0.99) / 1e3, hist_quantile(&total, 0.999) / 1e3, total.max / 1e3);
+    if (scraped) {
+        unsigned long long hits = hits1 - hits0, misses = misses1 - misses0;
+        printf("hit ratio   %.4f (%llu hits, %llu misses)\n", hits + misses ? (double)hits / (hits + misses) : 0.0, hits, misses);
+    }
+    return errors ? 2 : 0;
+}
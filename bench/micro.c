@@ -0,0 +1,296 @@
+// Микробенчмарки горячих путей прокси: кэш, очередь передачи сокетов, разбор запроса и кольцо узлов
+#include "proxy.h"
+#include <math.h>
+
+#define MICRO_KEYS 100000 // Записей в кэше для поиска
+#define MICRO_OBJECT_SIZE 1024 // Размер тела каждой записи
+#define POLICY_KEYS 100000 // Популярных URL в трассе политик
+#define POLICY_ZIPF 0.9 // Показатель распределения Ципфа
+#define POLICY_BUDGET ((size_t)16 << 20) // Бюджет кэша: около пятой части популярных URL
+#define POLICY_REQUESTS 2000000 // Запросов в трассе
+#define POLICY_PHASE 100000 // Запросов по Ципфу между обходами
+#define POLICY_SCAN 30000 // Уникальных URL в каждом обходе
+#define RING_KEYS 100000 // URL для проверки распределения по кольцу узлов
+#define RING_NODES 8 // Узлов в кольце
+
+typedef struct micro_task {
+    pthread_t thread;
+    int id; // Номер потока
+    long ops; // Операций на поток
+    long done; // Выполнено (для потребителей очереди)
+    cache *cache; // Кэш бенчмарка
+} micro_task;
+
+static long ops = 1000000;
+static int threads = 4;
+static long queue_remaining; // Сколько сокетов ещё должны забрать потребители
+
+static long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void report(const char *name, int workers, long total, long long elapsed) {
+    printf("%-28s %2d threads  %8.1f ns/op  %8.2f Mops/s\n",
+        name, workers, (double)elapsed * workers / total, total * 1e3 / elapsed);
+}
+
+// Запуск body в n потоках и замер общего времени
+static long long run_threads(void *(*body)(void *), micro_task *tasks, int n) {
+    long long start = now_ns();
+    for (int i = 0; i < n; i++) pthread_create(&tasks[i].thread, NULL, body, &tasks[i]);
+    for (int i = 0; i < n; i++) pthread_join(tasks[i].thread, NULL);
+    return now_ns() - start;
+}
+
+static void *find_body(void *arg) {
+    micro_task *task = (micro_task *)arg;
+    uint64_t state = 0x9E3779B97F4A7C15ULL * (task->id + 1);
+    char url[URL_SIZE];
+    for (long i = 0; i < task->ops; i++) {
+        snprintf(url, sizeof(url), "http://bench/obj/%lu", (unsigned long)(next_random(&state) % MICRO_KEYS));
+        cache_object *object = cache_find(task->cache, url, NULL);
+        if (object) cache_object_release(object);
+    }
+    return NULL;
+}
+
+// Сроки объектов бенчмарка: свежие на всё время прогона
+static cache_times bench_times() {
+    time_t expiry = time(NULL) + 3600;
+    cache_times times = { expiry, expiry, expiry };
+    return times;
+}
+
+static void *add_body(void *arg) {
+    micro_task *task = (micro_task *)arg;
+    char url[URL_SIZE];
+    char data[MICRO_OBJECT_SIZE];
+    memset(data, 'x', sizeof(data));
+    cache_times times = bench_times();
+    for (long i = 0; i < task->ops; i++) {
+        snprintf(url, sizeof(url), "http://bench/new/%d/%ld", task->id, i);
+        cache_object *object = cache_object_create(data, sizeof(data));
+        if (!object) continue;
+        cache_add(task->cache, url, object, &times);
+        cache_object_release(object);
+    }
+    return NULL;
+}
+
+static void bench_cache() {
+    char url[URL_SIZE];
+    char data[MICRO_OBJECT_SIZE];
+    memset(data, 'x', sizeof(data));
+    cache *cache_ptr = cache_init((size_t)512 << 20, (size_t)8 << 20, "lru");
+    cache_times times = bench_times();
+    for (long i = 0; i < MICRO_KEYS; i++) {
+        snprintf(url, sizeof(url), "http://bench/obj/%ld", i);
+        cache_object *object = cache_object_create(data, sizeof(data));
+        cache_add(cache_ptr, url, object, &times);
+        cache_object_release(object);
+    }
+    micro_task tasks[threads];
+    for (int n = 1; n <= threads; n *= 2) {
+        for (int i = 0; i < n; i++) tasks[i] = (micro_task){ .id = i, .ops = ops, .cache = cache_ptr };
+        report("cache_find (hit)", n, ops * n, run_threads(find_body, tasks, n));
+    }
+    cache_destroy(cache_ptr);
+
+    // Маленький бюджет: каждая вставка вытесняет старую запись
+    cache_ptr = cache_init((size_t)16 << 20, (size_t)8 << 20, "lru");
+    for (int n = 1; n <= threads; n *= 2) {
+        for (int i = 0; i < n; i++) tasks[i] = (micro_task){ .id = i, .ops = ops / 4, .cache = cache_ptr };
+        report("cache_add (with eviction)", n, ops / 4 * n, run_threads(add_body, tasks, n));
+    }
+    cache_destroy(cache_ptr);
+}
+
+// Номер URL по Ципфу: двоичный поиск в функции распределения
+static long zipf_next(const double *cdf, uint64_t *state) {
+    double u = (double)(next_random(state) >> 11) / (double)(1ULL << 53);
+    long low = 0, high = POLICY_KEYS - 1;
+    while (low < high) {
+        long mid = (low + high) / 2;
+        if (cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Доля попаданий политики на трассе: популярные URL по Ципфу вперемешку с обходами уникальных URL.
+// Промах загружает объект в кэш, как это делает прокси
+static void bench_policy_run(const char *policy, const double *cdf) {
+    cache *cache_ptr = cache_init(POLICY_BUDGET, (size_t)8 << 20, policy);
+    if (!cache_ptr) return;
+    char url[URL_SIZE];
+    char data[MICRO_OBJECT_SIZE];
+    memset(data, 'x', sizeof(data));
+    cache_times times = bench_times();
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    long hits = 0, requests = 0, popular_hits = 0, popular = 0, scanned = 0;
+    long long start = now_ns();
+    while (requests < POLICY_REQUESTS) {
+        int scan = requests % (POLICY_PHASE + POLICY_SCAN) >= POLICY_PHASE;
+        if (scan) snprintf(url, sizeof(url), "http://bench/scan/%ld", scanned++);
+        else snprintf(url, sizeof(url), "http://bench/obj/%ld", zipf_next(cdf, &state));
+        cache_object *object = cache_find(cache_ptr, url, NULL);
+        if (object) {
+            hits++;
+            popular_hits += !scan;
+            cache_object_release(object);
+        } else if ((object = cache_object_create(data, sizeof(data)))) {
+            cache_add(cache_ptr, url, object, &times);
+            cache_object_release(object);
+        }
+        popular += !scan;
+        requests++;
+    }
+    long long elapsed = now_ns() - start;
+    printf("%-28s %-8s  hit ratio %5.1f%%  popular %5.1f%%  %8.1f ns/op\n", "policy (zipf+scan)", policy,
+        hits * 100.0 / requests, popular_hits * 100.0 / popular, (double)elapsed / requests);
+    cache_destroy(cache_ptr);
+}
+
+static void bench_policy() {
+    double *cdf = (double *)malloc(POLICY_KEYS * sizeof(double));
+    if (!cdf) return;
+    double sum = 0;
+    for (long i = 0; i < POLICY_KEYS; i++) cdf[i] = sum += 1.0 / pow((double)(i + 1), POLICY_ZIPF);
+    for (long i = 0; i < POLICY_KEYS; i++) cdf[i] /= sum;
+    bench_policy_run("lru", cdf);
+    bench_policy_run("tinylfu", cdf);
+    free(cdf);
+}
+
+static void *produce_body(void *arg) {
+    micro_task *task = (micro_task *)arg;
+    for (long i = 0; i < task->ops; i++) {
+        while (enqueue((int)i, 0) < 0) sched_yield(); // Очередь полна - ждём потребителей
+    }
+    return NULL;
+}
+
+static void *consume_body(void *arg) {
+    micro_task *task = (micro_task *)arg;
+    while (__atomic_load_n(&queue_remaining, __ATOMIC_RELAXED) > 0) {
+        in_addr_t addr;
+        if (dequeue(&addr) == -1) continue;
+        task->done++;
+        __atomic_sub_fetch(&queue_remaining, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Производители и потребители поровну; enqueue включает пробуждение цикла событий, как в прокси
+static void bench_queue() {
+    config.threads = config.min_threads = 1;
+    init_thread_pool(); // Циклы не запускаются, пробуждения копятся в eventfd
+    for (int n = 1; n * 2 <= threads || n == 1; n *= 2) {
+        micro_task tasks[n * 2];
+        queue_remaining = ops * n;
+        for (int i = 0; i < n * 2; i++) tasks[i] = (micro_task){ .id = i, .ops = i < n ? ops : 0 };
+        long long start = now_ns();
+        for (int i = 0; i < n; i++) pthread_create(&tasks[n + i].thread, NULL, consume_body, &tasks[n + i]);
+        for (int i = 0; i < n; i++) pthread_create(&tasks[i].thread, NULL, produce_body, &tasks[i]);
+        for (int i = 0; i < n * 2; i++) pthread_join(tasks[i].thread, NULL);
+        report("enqueue+dequeue", n * 2, ops * n, now_ns() - start);
+    }
+}
+
+static void *parse_body(void *arg) {
+    micro_task *task = (micro_task *)arg;
+    static const char request[] =
+        "GET http://origin.test/static/app.2f9c1e.js?v=3 HTTP/1.1\r\nHost: origin.test\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: */*\r\nAccept-Encoding: gzip, deflate, br\r\nAccept-Language: en-US,en;q=0.9\r\n"
+        "Referer: http://origin.test/index.html\r\nConnection: keep-alive\r\n\r\n";
+    http_message message;
+    for (long i = 0; i < task->ops; i++) {
+        http_reset(&message);
+        if (http_parse_request(&message, request, sizeof(request) - 1) <= 0 || !http_keep_alive(&message)) abort();
+    }
+    return NULL;
+}
+
+static void bench_parse() {
+    micro_task tasks[threads];
+    for (int n = 1; n <= threads; n *= 2) {
+        for (int i = 0; i < n; i++) tasks[i] = (micro_task){ .id = i, .ops = ops };
+        report("http_parse_request", n, ops * n, run_threads(parse_body, tasks, n));
+    }
+}
+
+// Номер узла-владельца каждого URL (порт узла в кольце)
+static void ring_owners(int *owners) {
+    char url[URL_SIZE];
+    for (int i = 0; i < RING_KEYS; i++) {
+        snprintf(url, sizeof(url), "http://bench/obj/%d", i);
+        const peer_node *owner = peer_owner(cache_hash(url));
+        owners[i] = owner ? owner->port : 0;
+    }
+}
+
+static double ring_moved(const int *before, const int *after) {
+    int moved = 0;
+    for (int i = 0; i < RING_KEYS; i++) moved += before[i] != after[i];
+    return 100.0 * moved / RING_KEYS;
+}
+
+// Стоимость поиска владельца и доля URL, сменивших владельца при уходе и появлении узла
+static void bench_ring() {
+    char list[RING_NODES * 32] = "";
+    for (int i = 0; i < RING_NODES; i++) {
+        snprintf(list + strlen(list), sizeof(list) - strlen(list), "%s127.0.0.1:%d", i ? "," : "", 1001 + i);
+    }
+    if (peer_init(list, "127.0.0.1:1") < 0) return; // Этот процесс в кольцо не входит: владелец всегда другой узел
+    int *before = (int *)malloc(RING_KEYS * sizeof(int));
+    int *after = (int *)malloc(RING_KEYS * sizeof(int));
+    if (!before || !after) abort();
+    long long start = now_ns();
+    ring_owners(before);
+    report("peer_owner", 1, RING_KEYS, now_ns() - start);
+    int share[RING_NODES] = { 0 }, max = 0;
+    for (int i = 0; i < RING_KEYS; i++) share[before[i] - 1001]++;
+    for (int i = 0; i < RING_NODES; i++) if (share[i] > max) max = share[i];
+    printf("ring: largest share %.1f%% (fair %.1f%%)\n", 100.0 * max / RING_KEYS, 100.0 / RING_NODES);
+    peer_failed(peer_owner(cache_hash("http://bench/obj/0")));
+    ring_owners(after);
+    printf("ring: node down moved %.1f%% of URLs\n", ring_moved(before, after));
+    snprintf(list + strlen(list), sizeof(list) - strlen(list), ",127.0.0.1:%d", 1001 + RING_NODES);
+    if (peer_init(list, "127.0.0.1:1") == 0) {
+        ring_owners(after);
+        printf("ring: node joined moved %.1f%% of URLs\n", ring_moved(before, after));
+    }
+    free(before);
+    free(after);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:h")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi(optarg); break;
+            case 'n': ops = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-t MAX_THREADS] [-n OPS_PER_THREAD]\n", argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (threads <= 0 || ops <= 0) return EXIT_FAILURE;
+    log_min_level = ERROR; // Бенчмарк измеряет работу, а не вывод логов
+    bench_cache();
+    bench_policy();
+    bench_queue();
+    bench_parse();
+    bench_ring();
+    return 0;
+}
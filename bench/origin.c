@@ -0,0 +1,177 @@
+// Локальный сервер-источник для нагрузочных тестов прокси.
+// Размер ответа, задержка и Cache-Control задаются флагами и переопределяются в запросе:
+//   GET /obj/42?size=1024&delay=5&max-age=60
+#define _GNU_SOURCE // strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define ORIGIN_REQUEST_SIZE 8192 // Буфер запроса, запросы длиннее отклоняются
+#define ORIGIN_BODY_BLOCK (64 * 1024) // Тело отправляется из общего блока такого размера
+
+static int port = 9000;
+static size_t default_size = 4096; // Размер ответа по умолчанию
+static int default_delay = 0; // Задержка ответа по умолчанию, мс
+static int default_max_age = 3600; // max-age по умолчанию, отрицательное - no-store
+static char body_block[ORIGIN_BODY_BLOCK];
+
+// Значение параметра name из строки запроса, NULL если его нет
+static const char *query_param(const char *query, const char *end, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = query; p && p < end; p = memchr(p, '&', end - p)) {
+        p++; // Пропускаем '?' или '&'
+        if ((size_t)(end - p) > len && strncmp(p, name, len) == 0 && p[len] == '=') return p + len + 1;
+    }
+    return NULL;
+}
+
+static int send_all(int client_socket, const char *data, size_t len) {
+    while (len) {
+        ssize_t sent = send(client_socket, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Ответ на один запрос, -1 если соединение нужно закрыть
+static int respond(int client_socket, const char *request, size_t len) {
+    const char *line_end = memchr(request, '\r', len);
+    const char *path = memchr(request, ' ', len);
+    if (!line_end || !path || path > line_end) return -1;
+    path++;
+    const char *path_end = memchr(path, ' ', line_end - path);
+    if (!path_end) return -1;
+    const char *query = memchr(path, '?', path_end - path);
+
+    size_t size = default_size;
+    int delay = default_delay;
+    int max_age = default_max_age;
+    if (query) {
+        const char *value;
+        if ((value = query_param(query, path_end, "size"))) size = strtoull(value, NULL, 10);
+        if ((value = query_param(query, path_end, "delay"))) delay = atoi(value);
+        if ((value = query_param(query, path_end, "max-age"))) max_age = atoi(value);
+    }
+    if (delay > 0) usleep((useconds_t)delay * 1000);
+
+    char cache_control[64];
+    if (max_age < 0) snprintf(cache_control, sizeof(cache_control), "no-store");
+    else snprintf(cache_control, sizeof(cache_control), "max-age=%d", max_age);
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\nCache-Control: %s\r\n\r\n",
+        size, cache_control);
+    if (send_all(client_socket, header, header_len) < 0) return -1;
+    while (size) {
+        size_t block = size < ORIGIN_BODY_BLOCK ? size : ORIGIN_BODY_BLOCK;
+        if (send_all(client_socket, body_block, block) < 0) return -1;
+        size -= block;
+    }
+    // HTTP/1.0 без keep-alive и явный Connection: close завершают соединение
+    int http10 = line_end - request >= 8 && strncmp(line_end - 8, "HTTP/1.0", 8) == 0;
+    if (strcasestr(request, "\r\nConnection: close")) return -1;
+    if (http10 && !strcasestr(request, "\r\nConnection: keep-alive")) return -1;
+    return 0;
+}
+
+// Поток на соединение: запросы обслуживаются по очереди, конвейерные остаются в буфере
+static void *connection_thread(void *arg) {
+    int client_socket = (int)(intptr_t)arg;
+    char buffer[ORIGIN_REQUEST_SIZE + 1];
+    size_t len = 0;
+    while (1) {
+        char *end;
+        buffer[len] = '\0';
+        while (!(end = strstr(buffer, "\r\n\r\n"))) {
+            if (len == ORIGIN_REQUEST_SIZE) goto done;
+            ssize_t received = recv(client_socket, buffer + len, ORIGIN_REQUEST_SIZE - len, 0);
+            if (received <= 0) goto done;
+            len += received;
+            buffer[len] = '\0';
+        }
+        size_t request_len = (size_t)(end - buffer) + 4;
+        char next = buffer[request_len];
+        buffer[request_len] = '\0'; // Заголовки ищутся только в текущем запросе
+        if (respond(client_socket, buffer, request_len) < 0) break;
+        buffer[request_len] = next;
+        memmove(buffer, buffer + request_len, len - request_len);
+        len -= request_len;
+    }
+done:
+    close(client_socket);
+    return NULL;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p, --port PORT        listening port (default 9000)\n"
+        "  -s, --size BYTES       response body size (default 4096)\n"
+        "  -d, --delay MS         delay before each response (default 0)\n"
+        "  -a, --max-age SEC      Cache-Control max-age, negative for no-store (default 3600)\n"
+        "Query parameters size, delay and max-age override the defaults per request.\n",
+        program);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "size", required_argument, NULL, 's' },
+        { "delay", required_argument, NULL, 'd' },
+        { "max-age", required_argument, NULL, 'a' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:s:d:a:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 's': default_size = strtoull(optarg, NULL, 10); break;
+            case 'd': default_delay = atoi(optarg); break;
+            case 'a': default_max_age = atoi(optarg); break;
+            case 'h': usage(argv[0]); return EXIT_SUCCESS;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t i = 0; i < ORIGIN_BODY_BLOCK; i++) body_block[i] = 'a' + i % 26;
+
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_socket, 1024) < 0) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Origin listening on 127.0.0.1:%d, size %zu, delay %d ms, max-age %d\n",
+        port, default_size, default_delay, default_max_age);
+    while (1) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0) continue;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_thread, (void *)(intptr_t)client_socket) != 0) {
+            close(client_socket);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
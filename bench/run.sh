@@ -0,0 +1,32 @@
+#!/bin/sh
+# Стандартный прогон на loopback: сервер-источник, прокси и несколько сценариев нагрузки.
+# Использование: bench/run.sh [каталог сборки] [дополнительные флаги прокси]
+set -e
+BUILD=${1:-build}
+[ $# -gt 0 ] && shift
+BIN=$BUILD/bin
+ORIGIN_PORT=${ORIGIN_PORT:-19000}
+PROXY_PORT=${PROXY_PORT:-18080}
+ADMIN_PORT=${ADMIN_PORT:-18081}
+DURATION=${DURATION:-10}
+
+$BIN/bench_origin -p $ORIGIN_PORT -s 4096 2>/dev/null &
+ORIGIN=$!
+$BIN/main -p $PROXY_PORT --admin-port $ADMIN_PORT -l error "$@" >/dev/null &
+PROXY=$!
+trap 'kill $ORIGIN $PROXY 2>/dev/null' EXIT
+sleep 1
+
+LOAD="$BIN/bench_loadgen -x 127.0.0.1:$PROXY_PORT -a $ADMIN_PORT -d $DURATION"
+URL=http://127.0.0.1:$ORIGIN_PORT/obj/
+
+echo "== hot set, 4 KB objects, closed loop"
+$LOAD -u $URL -n 1000 -c 64
+echo "== large working set, 4 KB objects, closed loop"
+$LOAD -u ${URL}large/ -n 200000 -c 64
+echo "== 256 KB objects, open loop at 2000 req/s"
+$LOAD -u ${URL}big/ -S '?size=262144' -n 5000 -c 128 -r 2000
+echo "== slow origin (20 ms), open loop at 1000 req/s"
+$LOAD -u ${URL}slow/ -S '?delay=20' -n 50000 -c 256 -r 1000
+echo "== microbenchmarks"
+$BIN/bench_micro
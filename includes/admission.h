@@ -0,0 +1,42 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+
+#define ADMISSION_SHARDS 16 // Шарды таблицы клиентов (степень двойки)
+#define ADMISSION_WAIT_MS 100 // Период перепроверки, пока приём подключений приостановлен
+#define ADMISSION_FD_RESERVE 64 // Дескрипторов на слушающие сокеты, журнал, логи и прочее
+
+// Клиент с живыми соединениями: в очереди передачи и в циклах событий
+typedef struct admission_client {
+    in_addr_t addr; // Адрес клиента
+    int active; // Соединений клиента
+    struct admission_client *next; // Следующий клиент шарда
+} admission_client;
+
+typedef struct admission_shard {
+    pthread_mutex_t lock; // Мьютекс шарда
+    admission_client *head; // Клиенты шарда
+} admission_shard;
+
+void admission_init();
+int admission_acquire(in_addr_t);
+void admission_release(in_addr_t);
+int admission_full();
+void admission_wait();
+void admission_shutdown();
+long long admission_active();
+void admission_reject(int);
+
+#endif
@@ -1,36 +1,145 @@
-#ifndef CACHE_H
-#define CACHE_H
-
-#include <stdlib.h>
-#include <string.h>
-#include <pthread.h>
-#include <time.h>
-#include "logging.h"
-
-#define CACHE_SIZE 100
-#define URL_SIZE 256
-
-typedef struct cache_entry {
-    char url[URL_SIZE]; // URL ключ связанный с данными
-    char *data; // Указатель на данные
-    size_t size; // Размер данных
-    time_t expiry; // Тайм-аут для записи "время жизни"
-    struct cache_entry *prev; // Ссылка на предыдущий элемент
-    struct cache_entry *next; // Ссылка на следующий элемент
-} cache_entry;
-
-typedef struct {
-    cache_entry *head; // Голова списка LRU
-    cache_entry *tail; // Хвост списка LRU
-    cache_entry *entries; // Массив записей
-    pthread_mutex_t lock; // Мьютекс для синхронизации доступа
-} cache;
-
-cache *cache_init();
-void cache_destroy(cache *cache);
-cache_entry *cache_find(cache *cache, const char *url);
-void cache_add(cache *cache, const char *url, const char *data, size_t size, time_t expiry);
-void cache_remove_expired(cache *cache);
-void cache_print(cache *cache);
-
-#endif
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "logging.h"
+#include "slab.h"
+#include "metrics.h"
+
+#define CACHE_SHARDS 16 // Количество независимых шардов (степень двойки)
+#define CACHE_INDEX_INITIAL 64 // Начальный размер хэш-таблицы шарда
+#define CACHE_CHUNK_SIZE SLAB_MAX_SIZE // Размер куска тела ответа
+#define CACHE_LINE_SIZE 64
+#define CACHE_WHEEL_SLOTS 1024 // Ячеек колеса таймеров шарда, по секунде на ячейку (степень двойки)
+#define CACHE_REAP_BATCH 64 // Записей, проверяемых жнецом за один захват мьютекса шарда
+#define CACHE_REAP_INTERVAL 1 // Период жнеца в секундах
+#define CACHE_SKETCH_ROWS 4 // Строк count-min sketch
+#define CACHE_SKETCH_MAX 15 // Насыщение счётчика, как у 4-битных счётчиков W-TinyLFU
+#define CACHE_SKETCH_UNIT 1024 // Байт бюджета шарда на один счётчик строки
+#define CACHE_SKETCH_MIN 256 // Пределы ширины строки (степени двойки)
+#define CACHE_SKETCH_LIMIT (1 << 20)
+#define CACHE_SKETCH_PERIOD 10 // Обращений на счётчик строки до старения частот
+#define CACHE_WINDOW_PERCENT 1 // Окно W-TinyLFU в процентах бюджета шарда
+#define CACHE_PROTECTED_PERCENT 80 // Защищённый сегмент в процентах основной части
+
+// Неизменяемый объект ответа с подсчётом ссылок, тело разбито на куски из слэбов
+typedef struct cache_object {
+    int refcount; // Счётчик ссылок (кэш + все читатели)
+    size_t size; // Размер данных
+    size_t footprint; // Фактически занятая память
+    size_t nchunks; // Количество кусков
+    size_t tail_block; // Размер блока последнего куска
+    int delimited; // Длина ответа указана в заголовках, соединение с клиентом можно не закрывать
+    char *chunks[]; // Куски по CACHE_CHUNK_SIZE, последний может быть меньше
+} cache_object;
+
+// Звено кольцевого двусвязного списка, удаление не требует знать голову
+typedef struct cache_link {
+    struct cache_link *prev;
+    struct cache_link *next;
+} cache_link;
+
+// Сроки записи: свежая отдаётся сразу, устаревшая - с обновлением в фоне или после проверки у сервера
+typedef struct cache_times {
+    time_t expiry; // Запись свежая до этого момента
+    time_t stale_until; // До этого момента устаревшую запись можно отдать, обновляя её в фоне
+    time_t keep_until; // Запись хранится для условной проверки до этого момента
+} cache_times;
+
+// Сегменты записей шарда: LRU использует только окно, W-TinyLFU - все три
+typedef enum {
+    CACHE_WINDOW, // Окно новых записей (у LRU - весь список)
+    CACHE_PROBATION, // Допущенные фильтром, но ещё не востребованные повторно
+    CACHE_PROTECTED, // Востребованные повторно
+    CACHE_SEGMENTS
+} cache_segment;
+
+typedef struct cache_entry {
+    uint64_t hash; // Предвычисленный хэш URL
+    cache_object *object; // Объект ответа, кэш владеет одной ссылкой
+    size_t footprint; // Память записи вместе с объектом
+    cache_times times; // Сроки свежести и хранения
+    cache_segment segment; // Список шарда, в котором лежит запись
+    struct cache_entry *prev; // Ссылка на предыдущий элемент
+    struct cache_entry *next; // Ссылка на следующий элемент
+    cache_link timer; // Место в колесе таймеров шарда
+    char url[]; // URL ключ связанный с данными
+} cache_entry;
+
+// Список записей от недавних к давним
+typedef struct cache_list {
+    cache_entry *head; // Самая недавняя запись
+    cache_entry *tail; // Кандидат на вытеснение
+    size_t bytes; // Память записей списка
+} cache_list;
+
+typedef struct cache_shard {
+    cache_list lists[CACHE_SEGMENTS]; // Списки сегментов политики вытеснения
+    cache_entry **index; // Хэш-таблица с открытой адресацией
+    size_t index_mask; // Маска размера хэш-таблицы
+    size_t count; // Количество записей
+    size_t bytes; // Занятая записями память
+    size_t capacity; // Бюджет шарда в байтах
+    cache_link *wheel; // Колесо таймеров: запись лежит в ячейке секунды своего истечения
+    cache_link reaping; // Записи ячейки, которую сейчас обходит жнец
+    time_t wheel_time; // Секунда, до которой колесо обработано
+    size_t window_capacity; // Бюджет окна W-TinyLFU
+    size_t protected_capacity; // Бюджет защищённого сегмента W-TinyLFU
+    uint8_t *sketch; // Count-min sketch частот обращений: CACHE_SKETCH_ROWS строк подряд
+    size_t sketch_mask; // Маска ширины строки
+    size_t sketch_ops; // Обращений с последнего старения
+    pthread_mutex_t lock; // Мьютекс шарда
+} __attribute__((aligned(CACHE_LINE_SIZE))) cache_shard;
+
+struct cache;
+
+// Политика вытеснения: где живёт новая запись, что меняет попадание и кого вытеснять.
+// Все вызовы идут под мьютексом шарда; необязательные обработчики могут быть NULL
+typedef struct cache_policy {
+    const char *name; // Имя для --cache-policy и статистики
+    int (*init)(cache_shard *); // Данные политики шарда
+    void (*destroy)(cache_shard *);
+    void (*access)(cache_shard *, uint64_t); // Каждый поиск по хэшу URL, включая промахи
+    void (*hit)(cache_shard *, cache_entry *); // Попадание в запись
+    void (*insert)(struct cache *, cache_shard *, cache_entry *); // Новая запись уже учтена в шарде: разместить и уложиться в бюджет
+} cache_policy;
+
+// Приёмник вытесненных по бюджету записей (например, дисковый уровень); вызывается под мьютексом шарда
+typedef void (*cache_demote_fn)(const char *url, cache_object *object, const cache_times *times);
+
+typedef struct cache {
+    cache_shard shards[CACHE_SHARDS]; // Независимо блокируемые шарды
+    const cache_policy *policy; // Политика вытеснения
+    cache_demote_fn demote; // Куда уходят вытесненные записи (NULL - просто освобождаются)
+    size_t max_object; // Максимальный размер кэшируемого объекта
+    pthread_t reaper; // Фоновый поток удаления устаревших записей
+    pthread_mutex_t reaper_lock; // Мьютекс ожидания жнеца
+    pthread_cond_t reaper_cond; // Сигнал остановки жнеца
+    int reaper_stop; // Флаг остановки жнеца
+} cache;
+
+cache *cache_init(size_t capacity, size_t max_object, const char *policy);
+void cache_destroy(cache *cache);
+uint64_t cache_hash(const char *url);
+cache_object *cache_find(cache *cache, const char *url, cache_times *times);
+void cache_add(cache *cache, const char *url, cache_object *object, const cache_times *times);
+void cache_remove_expired(cache *cache);
+void cache_print(cache *cache);
+void cache_stats(cache *cache, size_t *entries, size_t *bytes);
+void cache_set_demote(cache *cache, cache_demote_fn demote);
+size_t cache_max_object(cache *cache);
+const char *cache_policy_name(cache *cache);
+
+cache_object *cache_object_create(const char *data, size_t size);
+cache_object *cache_object_adopt(char *const *chunks, size_t nchunks, size_t size, int compact);
+cache_object *cache_object_retain(cache_object *object);
+void cache_object_release(cache_object *object);
+int cache_object_iov(const cache_object *object, size_t offset, struct iovec *iov, int max);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "logging.h"
+
+#define DEFAULT_PORT 8080
+#define HOST_SIZE 128 // Максимальная длина имени хоста
+#define DEFAULT_CACHE_BYTES ((size_t)256 << 20) // Бюджет кэша по умолчанию 256 МБ
+#define DEFAULT_MAX_OBJECT_BYTES ((size_t)8 << 20) // Максимальный кэшируемый объект 8 МБ
+#define DEFAULT_UPSTREAM_MAX_IDLE 16 // Простаивающих соединений на один сервер
+#define DEFAULT_UPSTREAM_IDLE_TIMEOUT 30 // Секунд простоя соединения с сервером в пуле
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 60 // Секунд ожидания следующего запроса клиента
+#define DEFAULT_DNS_TTL 60 // Секунд хранения разрешённого имени
+#define DEFAULT_DNS_NEGATIVE_TTL 5 // Секунд хранения неудачного разрешения
+#define DEFAULT_TTL 0 // Секунд свежести ответа без явного срока и Last-Modified
+#define DEFAULT_DISK_BYTES ((size_t)1 << 30) // Размер дискового журнала по умолчанию 1 ГБ
+#define DEFAULT_CACHE_POLICY "lru" // Политика вытеснения кэша по умолчанию
+#define DEFAULT_BACKLOG 1024 // Очередь подключений слушающего сокета в ядре
+#define DEFAULT_REQUEST_TIMEOUT 10 // Секунд на получение заголовков начатого запроса
+#define DEFAULT_SEND_TIMEOUT 30 // Секунд без продвижения отправки ответа клиенту
+#define DEFAULT_DRAIN_TIMEOUT 30 // Секунд на завершение начатых ответов при остановке
+
+// Привязка потоков циклов событий к процессорам
+typedef enum {
+    PIN_NONE, // Планировщик ОС решает сам
+    PIN_CPU, // Каждый поток на своём процессоре
+    PIN_NUMA // Каждый поток на процессорах своего узла NUMA
+} pin_mode;
+
+typedef struct proxy_config {
+    int port; // Порт прокси
+    size_t cache_bytes; // Бюджет кэша в байтах
+    size_t max_object_bytes; // Максимальный размер кэшируемого объекта
+    int threads; // Наибольшее количество циклов событий (0 - по числу ядер)
+    int min_threads; // Циклов, работающих всегда (0 - четверть наибольшего)
+    pin_mode pin_threads; // Привязка потоков циклов к процессорам
+    int drain_timeout; // Время на завершение начатых ответов при остановке, секунды
+    int upstream_max_idle; // Предел простаивающих соединений на сервер
+    int upstream_idle_timeout; // Время жизни простаивающего соединения с сервером, секунды
+    int client_idle_timeout; // Время ожидания следующего запроса клиента, секунды
+    int dns_ttl; // Время жизни записи DNS, секунды
+    int dns_negative_ttl; // Время жизни неудачного разрешения, секунды
+    int log_level; // Минимальный выводимый уровень логов
+    const char *log_file; // Файл логов (NULL - стандартный вывод)
+    int reuseport; // Каждый цикл событий принимает подключения со своего сокета SO_REUSEPORT
+    int admin_port; // Порт метрик на 127.0.0.1 (0 - выключен)
+    int default_ttl; // Свежесть ответа без явного срока, секунды
+    const char *disk_path; // Каталог дискового уровня кэша (NULL - выключен)
+    size_t disk_bytes; // Размер дискового журнала
+    const char *cache_policy; // Политика вытеснения кэша: lru или tinylfu
+    int range_fill; // Промах с Range загружает в кэш и весь объект в фоне
+    int backlog; // Бэклог слушающих сокетов
+    int max_connections; // Предел живых клиентских соединений (0 - по лимиту дескрипторов)
+    int max_per_client; // Предел соединений с одного адреса (0 - без предела)
+    int request_timeout; // Время на получение начатого запроса, секунды
+    int send_timeout; // Время ожидания клиента, не принимающего ответ, секунды
+    const char *peers; // Узлы общего кэша HOST:PORT через запятую, включая этот (NULL - выключено)
+    const char *peer_self; // Адрес этого узла в списке узлов (NULL - 127.0.0.1 и порт прокси)
+} proxy_config;
+
+extern proxy_config config;
+
+void config_parse(int, char **);
+
+#endif
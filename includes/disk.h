@@ -0,0 +1,116 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "cache.h"
+#include "logging.h"
+#include "metrics.h"
+
+#define DISK_ALIGN 512 // Записи журнала выровнены по сектору
+#define DISK_MAGIC 0x4B534944 // Метка заголовка записи
+#define DISK_INDEX_MAGIC 0x58444E49 // Метка файла индекса
+#define DISK_INDEX_VERSION 1 // Версия формата индекса
+#define DISK_INDEX_INITIAL 1024 // Начальный размер хэш-таблицы (степень двойки)
+#define DISK_QUEUE 256 // Вытесненных объектов в очереди записи, лишние не сохраняются
+#define DISK_SNAPSHOT_INTERVAL 10 // Секунд между снимками индекса
+#define DISK_SNAPSHOT_SHARE 4 // Снимок и после записи такой доли журнала: хвост после снимка не должен обогнать его на круг
+#define DISK_PROMOTE_HITS 2 // С этого попадания с диска объект поднимается обратно в память
+
+// Заголовок записи журнала, за ним URL и ответ целиком; он же - запись файла индекса
+typedef struct disk_record {
+    uint32_t magic; // DISK_MAGIC
+    uint32_t url_len; // Длина URL без нуля
+    uint64_t position; // Позиция в журнале: отличает живую запись от перезаписанной на следующем круге
+    uint64_t hash; // Хэш URL
+    uint64_t size; // Размер ответа
+    int64_t expiry; // Сроки записи из cache_times
+    int64_t stale_until;
+    int64_t keep_until;
+    uint32_t delimited; // Длина ответа указана в заголовках
+    uint32_t reserved;
+} disk_record;
+
+// Заголовок файла индекса
+typedef struct disk_index_header {
+    uint32_t magic; // DISK_INDEX_MAGIC
+    uint32_t version; // DISK_INDEX_VERSION
+    uint64_t capacity; // Размер журнала, для которого снят индекс
+    uint64_t head; // Позиция следующей записи в момент снимка
+    uint64_t count; // Записей в снимке
+} disk_index_header;
+
+// Запись индекса в памяти
+typedef struct disk_entry {
+    uint64_t hash; // Хэш URL
+    uint64_t position; // Позиция в бесконечном журнале, в файле - по модулю его размера
+    size_t size; // Размер ответа
+    cache_times times; // Сроки свежести и хранения
+    int delimited; // Длина ответа указана в заголовках
+    int hits; // Попадания с диска
+    int pins; // Клиенты, которым ответ сейчас отдаётся через sendfile
+    int removed; // Вычеркнута из индекса, место освободится при перезаписи
+    struct disk_entry *chain; // Следующая запись в цепочке хэш-таблицы
+    struct disk_entry *newer; // Следующая по журналу запись
+    char url[]; // URL ключ
+} disk_entry;
+
+// Вытесненный из памяти объект, ожидающий записи
+typedef struct disk_job {
+    char *url; // Копия URL
+    uint64_t hash; // Хэш URL
+    int cancelled; // URL загружен заново, старую копию писать нельзя
+    cache_object *object; // Закреплённый объект
+    cache_times times; // Сроки записи
+} disk_job;
+
+// Журнал ответов на диске: кольцевой файл, индекс в памяти и поток записи
+typedef struct disk_store {
+    int fd; // Файл журнала
+    char *map; // Журнал, отображённый в память только для чтения
+    size_t capacity; // Размер журнала
+    char *index_path; // Файл снимка индекса
+    char *index_tmp; // Временный файл снимка
+    uint64_t head; // Позиция следующей записи
+    uint64_t snapshot_head; // Позиция следующей записи в последнем снимке
+    disk_entry **index; // Хэш-таблица с цепочками
+    size_t index_mask; // Маска размера хэш-таблицы
+    size_t count; // Записей в индексе
+    size_t bytes; // Байт ответов в индексе
+    disk_entry *oldest; // Журнал в порядке записи: отсюда место освобождается
+    disk_entry *newest; // Сюда добавляются новые записи
+    int dirty; // Индекс менялся после последнего снимка
+    disk_job queue[DISK_QUEUE]; // Очередь записи
+    size_t queue_head; // Первое задание очереди
+    size_t queue_len; // Заданий в очереди
+    const char *writing; // URL записываемого сейчас объекта
+    int writing_cancelled; // Записываемый объект устарел, в индекс он не попадёт
+    int stop; // Флаг остановки потока записи
+    pthread_t writer; // Поток записи
+    pthread_mutex_t lock; // Мьютекс индекса и очереди
+    pthread_cond_t cond; // Сигнал потоку записи
+} disk_store;
+
+int disk_open(const char *dir, size_t capacity);
+void disk_close();
+disk_entry *disk_find(const char *url, cache_times *times, int *hits);
+cache_object *disk_load(disk_entry *entry);
+ssize_t disk_send(int socket, disk_entry *entry, size_t offset);
+void disk_release(disk_entry *entry);
+void disk_demote(const char *url, cache_object *object, const cache_times *times);
+void disk_invalidate(const char *url);
+void disk_stats(size_t *entries, size_t *bytes);
+
+#endif
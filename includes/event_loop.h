@@ -0,0 +1,62 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "logging.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256 // Событий за один вызов epoll_wait
+#define EVENT_LOOP_TICK_MS 1000 // Период служебного таймера цикла
+
+struct event_loop;
+
+// Наблюдатель за дескриптором, указатель на него хранится в epoll_event.data
+typedef struct event_watcher {
+    int fd; // Дескриптор
+    uint32_t events; // Текущая маска интереса
+    int registered; // Добавлен ли дескриптор в epoll
+    void (*callback)(struct event_watcher *, uint32_t); // Обработчик готовности
+    void *data; // Пользовательские данные
+} event_watcher;
+
+// Отложенная задача, выполняется в потоке цикла после обработки пачки событий
+typedef struct event_task {
+    void (*callback)(void *); // Функция задачи
+    void *arg; // Аргумент задачи
+    struct event_task *next; // Следующая задача
+} event_task;
+
+typedef struct event_loop {
+    int id; // Номер цикла
+    int epoll_fd; // Дескриптор epoll
+    event_watcher wake; // eventfd для пробуждения из других потоков
+    pthread_t thread; // Поток цикла
+    pthread_mutex_t lock; // Мьютекс очереди задач
+    event_task *tasks; // Очередь задач (в обратном порядке)
+    int stop; // Флаг завершения цикла
+    void (*on_wake)(struct event_loop *); // Вызывается при пробуждении
+    void (*on_tick)(struct event_loop *); // Вызывается раз в EVENT_LOOP_TICK_MS
+    long long next_tick; // Время следующего вызова on_tick, мс монотонных часов
+    long long busy_us; // Время обработки событий, задач и тиков с запуска, мкс
+} event_loop;
+
+int event_loop_init(event_loop *, int);
+void event_loop_destroy(event_loop *);
+void event_loop_run(event_loop *);
+void event_loop_stop(event_loop *);
+void event_loop_wake(event_loop *);
+int event_loop_post(event_loop *, void (*)(void *), void *);
+void event_watcher_init(event_watcher *, int, void (*)(event_watcher *, uint32_t), void *);
+int event_watcher_set(event_loop *, event_watcher *, uint32_t);
+void event_watcher_close(event_loop *, event_watcher *);
+int event_watcher_detach(event_loop *, event_watcher *);
+int set_nonblocking(int);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "cache.h"
+#include "event_loop.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "logging.h"
+#include "http.h"
+#include "disk.h"
+#include "peer.h"
+
+#define URL_SIZE 2048 // Максимальная длина URL запроса
+#define FETCH_VALIDATOR_SIZE 256 // Максимальная длина ETag или Last-Modified для условного запроса
+#define FETCH_HEADERS_SIZE 512 // Заголовки клиента, которые передаются серверу (Range, If-Range)
+#define FETCH_REQUEST_SIZE (URL_SIZE + HOST_SIZE + 2 * FETCH_VALIDATOR_SIZE + FETCH_HEADERS_SIZE + 128) // Запрос к серверу: путь, Host и служебные заголовки
+#define FETCH_TABLE_SHARDS 16 // Шарды таблицы загрузок в процессе
+#define FETCH_WINDOW_CHUNKS 16 // Окно некэшируемого ответа: не больше 1 МБ впереди самого медленного читателя
+#define FETCH_READS_PER_EVENT 16 // Чтений из сервера за одно событие, чтобы не занимать цикл надолго
+#define FETCH_STALE_KEEP 86400 // Секунд хранения устаревшего ответа с валидаторами для условной проверки
+#define FETCH_PRIVATE 1 // Загрузка только для одного клиента: без объединения и без кэширования
+#define FETCH_ORIGIN 2 // Только у сервера-источника, минуя узла-владельца URL
+#define FETCH_RELAY_MIN (2 * CACHE_CHUNK_SIZE) // Остаток некэшируемого ответа, с которого он передаётся через splice
+#define FETCH_RELAY_UNTIL_CLOSE SIZE_MAX // Остаток ответа, который заканчивается закрытием соединения
+
+typedef enum {
+    FETCH_RESOLVE, // Разрешение имени сервера
+    FETCH_CONNECT, // Неблокирующее подключение к серверу
+    FETCH_WRITE, // Отправка запроса серверу
+    FETCH_READ, // Чтение ответа
+    FETCH_DONE, // Ответ получен целиком
+    FETCH_FAILED // Ошибка загрузки
+} fetch_state;
+
+// Как определяется конец ответа сервера
+typedef enum {
+    FRAME_UNKNOWN, // Заголовки ещё не получены
+    FRAME_LENGTH, // По Content-Length (или ответ без тела)
+    FRAME_CHUNKED, // По последнему куску Transfer-Encoding: chunked
+    FRAME_CLOSE // По закрытию соединения сервером
+} fetch_framing;
+
+// Состояния разбора тела в кодировке chunked
+typedef enum {
+    CHUNK_SIZE, // Шестнадцатеричный размер куска
+    CHUNK_EXT, // Расширения после размера
+    CHUNK_SIZE_LF, // Конец строки размера
+    CHUNK_DATA, // Данные куска
+    CHUNK_DATA_CR, // CRLF после данных
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER, // Начало строки трейлера
+    CHUNK_TRAILER_LINE, // Внутри строки трейлера
+    CHUNK_TRAILER_LF, // Пустая строка - конец ответа
+    CHUNK_DONE // Ответ завершён
+} chunk_state;
+
+// Читатель загрузки: клиент, которому ответ отдаётся по мере поступления
+typedef struct fetch_reader {
+    event_loop *loop; // Цикл читателя, в нём вызывается notify
+    void (*notify)(struct fetch_reader *); // Появились данные или загрузка завершилась
+    size_t offset; // Сколько байт читатель уже забрал
+    int notify_pending; // Уведомление уже поставлено в цикл
+    struct fetch_reader *next; // Следующий читатель
+} fetch_reader;
+
+// Загрузка URL с сервера, общая для всех клиентов, запросивших его одновременно
+typedef struct fetch {
+    char url[URL_SIZE]; // URL загрузки
+    char host[HOST_SIZE]; // Хост сервера или узла-владельца
+    int port; // Порт сервера или узла-владельца
+    const peer_node *peer; // Узел-владелец, у которого берётся ответ (NULL - сервер-источник)
+    uint64_t hash; // Хэш URL
+    int refcount; // Ссылки: сторона сервера и каждый читатель
+    cache *cache; // Кэш, в который попадёт ответ
+    event_loop *loop; // Цикл, в котором идёт обмен с сервером
+    event_watcher upstream; // Сокет сервера
+    resolver_result addresses; // Адреса сервера из разрешения имени
+    int address; // Адрес, к которому идёт подключение
+    fetch_state state; // Состояние обмена с сервером
+    int reused; // Соединение взято из пула и могло устареть
+    int status; // 0 - идёт, 1 - готово, -1 - ошибка
+    char headers[FETCH_HEADERS_SIZE]; // Заголовки клиента для сервера, строки с CRLF
+    char request[FETCH_REQUEST_SIZE]; // Запрос к серверу
+    size_t request_len; // Длина запроса
+    size_t request_sent; // Отправлено байт запроса
+    char **ring; // Кольцо кусков ответа, кусок i лежит в ячейке i % ring_size
+    size_t ring_size; // Размер кольца
+    size_t nchunks; // Выделено кусков с начала ответа
+    size_t first_chunk; // Первый ещё не освобождённый кусок
+    size_t size; // Получено байт
+    size_t visible; // Байт, видимых читателям: публикуются, когда известна судьба ответа
+    size_t limit; // Максимальный размер кэшируемого ответа
+    fetch_framing framing; // Способ определения конца ответа
+    size_t header_len; // Длина заголовков ответа
+    http_message response; // Разбор заголовков ответа, продолжается между чтениями
+    size_t response_len; // Полная длина ответа при FRAME_LENGTH
+    chunk_state chunk; // Состояние разбора chunked
+    size_t chunk_left; // Осталось байт текущего куска chunked
+    int keep_alive; // Сервер разрешил переиспользовать соединение
+    int caching; // Ответ ещё помещается в кэш
+    int joinable; // Загрузка есть в таблице и к ней можно присоединиться
+    int adopted; // Куски переданы объекту кэша
+    int paused; // Чтение остановлено до продвижения читателей
+    long long stage_start; // Начало разрешения имени или подключения, мкс
+    cache_times times; // Сроки ответа в кэше по его заголовкам
+    cache_object *object; // Готовый объект кэша
+    cache_object *stale; // Устаревший объект, который проверяется условным запросом
+    int not_modified; // Сервер подтвердил устаревший объект ответом 304
+    int relay_fd; // Сокет сервера, который забирает читатель, чтобы передать остаток ответа через splice
+    size_t relay_left; // Байт ответа после переданных через кольцо (FETCH_RELAY_UNTIL_CLOSE - до закрытия)
+    pthread_mutex_t lock; // Мьютекс списка читателей
+    fetch_reader *readers; // Читатели
+    struct fetch *next; // Следующая загрузка в шарде таблицы
+} fetch;
+
+fetch *fetch_start(cache *, event_loop *, const char *, fetch_reader *, cache_object *, int, const char *);
+void fetch_detach(fetch *, fetch_reader *);
+int fetch_status(fetch *);
+int fetch_delimited(fetch *);
+size_t fetch_head_len(fetch *);
+cache_object *fetch_stale(fetch *);
+int fetch_iov(fetch *, size_t, struct iovec *, int);
+void fetch_consumed(fetch *, fetch_reader *, size_t);
+int fetch_relay(fetch *, size_t *);
+void fetch_relay_done(fetch *, int, int);
+
+#endif
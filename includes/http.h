@@ -0,0 +1,82 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define HTTP_MAX_HEADERS 64 // Заголовков в одном сообщении, больше - ошибка разбора
+#define HTTP_MAX_HEAD_SIZE (16 * 1024) // Максимальная длина заголовков запроса клиента
+#define HTTP_HEURISTIC_MAX 86400 // Предел эвристической свежести по Last-Modified, секунды
+
+// Представление части буфера без копирования, строка не завершена нулём
+typedef struct http_slice {
+    const char *data; // Начало в буфере сообщения
+    size_t len; // Длина
+} http_slice;
+
+typedef struct http_header {
+    http_slice name; // Имя заголовка
+    http_slice value; // Значение без пробелов по краям
+} http_header;
+
+typedef enum {
+    HTTP_START_LINE, // Ждём строку запроса или статуса
+    HTTP_HEADERS, // Разбираем заголовки
+    HTTP_DONE // Заголовки закончились пустой строкой
+} http_state;
+
+// Состояние разбора между чтениями: уже просмотренные байты повторно не сканируются
+typedef struct http_message {
+    http_state state; // Этап разбора
+    size_t scanned; // До какого смещения буфер просмотрен
+    size_t line; // Начало текущей строки
+    size_t head_len; // Длина заголовков вместе с пустой строкой
+    http_slice method; // Метод запроса
+    http_slice target; // Цель запроса
+    int version; // Версия протокола: 10 или 11
+    int status; // Код ответа
+    http_slice reason; // Пояснение к коду ответа
+    int nheaders; // Количество заголовков
+    http_header headers[HTTP_MAX_HEADERS]; // Заголовки в порядке появления
+} http_message;
+
+// Диапазон байт тела, границы включительно
+typedef struct http_range {
+    size_t first; // Первый байт
+    size_t last; // Последний байт
+} http_range;
+
+// Политика кэширования ответа по его заголовкам
+typedef struct http_freshness {
+    int storable; // Ответ можно хранить в общем кэше
+    int explicit_ttl; // Срок задан заголовками, а не эвристикой
+    long lifetime; // Сколько ещё секунд ответ свежий, с учётом его возраста
+    long stale_while_revalidate; // Секунд после устаревания, когда ответ отдаётся, пока идёт обновление
+    int validators; // Есть ETag или Last-Modified для условного запроса
+} http_freshness;
+
+void http_reset(http_message *);
+int http_parse_request(http_message *, const char *, size_t);
+int http_parse_response(http_message *, const char *, size_t);
+int http_slice_is(const http_slice *, const char *);
+const http_slice *http_header_find(const http_message *, const char *);
+int http_header_token(const http_message *, const char *, const char *);
+int http_content_length(const http_message *, size_t *);
+int http_keep_alive(const http_message *);
+int http_cache_directive(const http_message *, const char *, long *);
+time_t http_date(const http_slice *);
+void http_response_freshness(const http_message *, time_t, long, http_freshness *);
+int http_parse_ranges(const http_slice *, size_t, http_range *, int);
+
+#endif
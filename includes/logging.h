@@ -1,23 +1,62 @@
-#ifndef LOGGING_H
-#define LOGGING_H
-
-#include <pthread.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <time.h>
-#include <unistd.h>
-
-// Цветовые коды ANSI
-#define COLOR_RESET   "\033[0m"
-#define COLOR_INFO    "\033[32m"  // Зеленый
-#define COLOR_DEBUG   "\033[34m"  // Синий
-#define COLOR_WARNING "\033[33m"  // Желтый
-#define COLOR_ERROR   "\033[31m"  // Красный
-
-// Уровни логов
-typedef enum { INFO, DEBUG, WARNING, ERROR, RESET } log_level_t;
-
-// Функция логирования
-void logger(log_level_t, const char *, ...);
-
-#endif
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+// Цветовые коды ANSI
+#define COLOR_RESET   "\033[0m"
+#define COLOR_INFO    "\033[32m"  // Зеленый
+#define COLOR_DEBUG   "\033[34m"  // Синий
+#define COLOR_WARNING "\033[33m"  // Желтый
+#define COLOR_ERROR   "\033[31m"  // Красный
+
+#define LOG_RING_RECORDS 1024 // Записей в кольце одного потока (степень двойки)
+#define LOG_MESSAGE_SIZE 232 // Длина сообщения, длиннее обрезаются
+#define LOG_OUTPUT_BUFFER (64 * 1024) // Буфер писателя между вызовами fwrite
+#define LOG_IDLE_SLEEP_US 10000 // Пауза писателя, когда все кольца пусты
+
+// Уровни логов по возрастанию важности
+typedef enum { DEBUG, INFO, WARNING, ERROR, RESET } log_level_t;
+
+// Минимальный уровень при компиляции: вызовы ниже него вырезаются целиком
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG
+#endif
+
+// Запись лога, форматируется вызывающим потоком
+typedef struct log_record {
+    log_level_t level; // Уровень
+    time_t time; // Закэшированное время записи
+    unsigned long thread; // Идентификатор потока
+    char text[LOG_MESSAGE_SIZE]; // Сообщение
+} log_record;
+
+// Кольцо одного потока: пишет только владелец, читает только писатель
+typedef struct log_ring {
+    size_t tail; // Следующая свободная запись, двигает владелец
+    char pad[64 - sizeof(size_t)]; // head и tail на разных кэш-линиях
+    size_t head; // Следующая непрочитанная запись, двигает писатель
+    size_t dropped; // Потеряно записей из-за переполнения
+    struct log_ring *next; // Следующее кольцо в списке писателя
+    log_record records[LOG_RING_RECORDS]; // Записи
+} log_ring;
+
+extern log_level_t log_min_level; // Минимальный уровень, задаётся при запуске
+
+#define log_enabled(level) ((level) >= LOG_MIN_LEVEL && (level) >= log_min_level)
+
+// Функция логирования: отфильтрованный вызов стоит одного сравнения
+#define logger(level, ...) do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+
+void log_write(log_level_t, const char *, ...) __attribute__((format(printf, 2, 3)));
+int log_level_parse(const char *);
+int log_set_file(const char *);
+
+#endif
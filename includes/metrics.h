@@ -0,0 +1,94 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "logging.h"
+
+#define METRICS_SUB_BITS 4 // Бит мантиссы: 16 ячеек на каждую степень двойки, погрешность до 6%
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_SHIFT 36 // Старший учитываемый бит значения в микросекундах (~19 часов)
+#define METRICS_BUCKETS ((METRICS_MAX_SHIFT - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_GAUGES 16 // Показателей, вычисляемых при каждом запросе метрик
+#define METRICS_RENDER_SIZE (64 * 1024) // Буфер текста метрик
+#define METRICS_REQUEST_SIZE 1024 // Читаемое начало запроса к порту администрирования
+
+// Счётчики, каждый поток увеличивает только свою копию
+typedef enum {
+    METRIC_CONNECTIONS, // Принятые клиентские соединения
+    METRIC_REQUESTS, // Разобранные запросы
+    METRIC_HITS, // Попадания в кэш
+    METRIC_MISSES, // Промахи кэша
+    METRIC_COALESCED, // Промахи, присоединившиеся к уже идущей загрузке
+    METRIC_EVICTIONS, // Вытеснения ради бюджета кэша
+    METRIC_EXPIRED, // Записи, удалённые по истечении срока
+    METRIC_BYTES_SERVED, // Байт отправлено клиентам
+    METRIC_BYTES_FETCHED, // Байт получено от серверов
+    METRIC_UPSTREAM_REUSED, // Загрузки через соединение из пула
+    METRIC_QUEUE_FULL, // Клиенты, отвергнутые из-за переполненной очереди
+    METRIC_REVALIDATED, // Устаревшие объекты, подтверждённые ответом 304
+    METRIC_STALE_SERVED, // Устаревшие объекты, отданные во время фонового обновления
+    METRIC_DISK_HITS, // Ответы, отданные с диска
+    METRIC_DISK_WRITES, // Вытесненные объекты, записанные на диск
+    METRIC_DISK_PROMOTED, // Объекты, поднятые с диска обратно в память
+    METRIC_ADMISSION_REJECTED, // Новые записи, не допущенные политикой вытеснения в основную часть кэша
+    METRIC_RELAYED, // Байт ответов, переданных от сервера клиенту через splice
+    METRIC_RANGES, // Частичные ответы 206 и 416, собранные из кэша
+    METRIC_CLIENT_LIMITED, // Подключения, отвергнутые пределом соединений с одного адреса
+    METRIC_ACCEPT_PAUSED, // Приостановки приёма подключений на пределе живых соединений
+    METRIC_CLIENT_TIMEOUTS, // Клиенты, закрытые по тайм-ауту чтения запроса или отправки ответа
+    METRIC_PEER_FETCHES, // Промахи, отправленные узлу-владельцу URL
+    METRIC_PEER_FAILURES, // Загрузки у узла, не удавшиеся и повторенные у сервера
+    METRIC_COUNTERS
+} metric_counter;
+
+// Этапы обработки запроса с гистограммой длительности
+typedef enum {
+    STAGE_QUEUE_WAIT, // От приёма соединения до его извлечения циклом
+    STAGE_CACHE_LOOKUP, // Поиск в кэше
+    STAGE_DNS, // Разрешение имени сервера
+    STAGE_CONNECT, // Подключение к серверу
+    STAGE_FIRST_BYTE, // От разбора запроса до первого байта ответа клиенту
+    STAGE_TOTAL, // От разбора запроса до отправки всего ответа
+    METRIC_STAGES
+} metric_stage;
+
+// Гистограмма с логарифмически-линейными ячейками в микросекундах
+typedef struct metrics_histogram {
+    uint64_t count; // Количество наблюдений
+    uint64_t sum; // Сумма наблюдений
+    uint64_t buckets[METRICS_BUCKETS]; // Наблюдения по ячейкам
+} metrics_histogram;
+
+// Метрики одного потока: пишет только владелец, читатель суммирует все блоки без блокировок
+typedef struct metrics_block {
+    uint64_t counters[METRIC_COUNTERS];
+    metrics_histogram stages[METRIC_STAGES];
+    struct metrics_block *next; // Следующий блок в списке
+} __attribute__((aligned(64))) metrics_block;
+
+// Показатель, значение которого вычисляется при запросе метрик
+typedef struct metrics_gauge {
+    const char *name; // Имя метрики
+    const char *help; // Описание
+    long long (*read)(); // Текущее значение
+} metrics_gauge;
+
+long long metrics_now();
+void metrics_add(metric_counter, uint64_t);
+void metrics_observe(metric_stage, long long);
+void metrics_gauge_register(const char *, const char *, long long (*)());
+size_t metrics_render(char *, size_t);
+void metrics_serve(int);
+
+#endif
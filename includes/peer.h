@@ -0,0 +1,40 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "config.h"
+#include "logging.h"
+
+#define PEER_MAX 64 // Узлов в кольце
+#define PEER_VNODES 160 // Точек кольца на узел: чем больше, тем ровнее доли узлов
+#define PEER_RETRY 5 // Секунд, на которые недоступный узел выпадает из кольца
+#define PEER_HEADER "X-Proxy-Peer" // Запрос от другого узла: отвечаем сами, дальше по кольцу не передаём; от чужих адресов не действует
+
+// Узел кэша; ключи, которыми он владеет, остальные узлы берут у него
+typedef struct peer_node {
+    char host[HOST_SIZE]; // Хост узла
+    int port; // Порт узла
+    in_addr_t addr; // IPv4 адрес узла, с которого он присылает запросы (INADDR_NONE - не разрешился)
+    int self; // Этот процесс
+    time_t down_until; // До этого момента узел считается недоступным
+} peer_node;
+
+// Точка кольца согласованного хэширования
+typedef struct peer_point {
+    uint64_t hash; // Положение на кольце
+    int node; // Узел, которому принадлежит дуга до этой точки
+} peer_point;
+
+int peer_init(const char *, const char *);
+const peer_node *peer_owner(uint64_t);
+void peer_failed(const peer_node *);
+int peer_trusted(in_addr_t);
+
+#endif
@@ -1,24 +1,115 @@
-#ifndef PROXY_H
-#define PROXY_H
-
-#include "cache.h"
-#include "thread_pool.h"
-#include "logging.h"
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <pthread.h>
-
-#define BUFFER_SIZE 1024
-#define PORT 8080
-
-int proxy_init(int);
-void proxy_start(int, int);
-char *extract_url(char *);
-void handle_client(int);
-
-#endif
+#ifndef PROXY_H
+#define PROXY_H
+
+#define _GNU_SOURCE // splice, pipe2, F_SETPIPE_SZ
+#include "cache.h"
+#include "config.h"
+#include "event_loop.h"
+#include "fetch.h"
+#include "disk.h"
+#include "upstream.h"
+#include "thread_pool.h"
+#include "admission.h"
+#include "logging.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#define BUFFER_SIZE 1024 // Начальный буфер запроса, растёт до HTTP_MAX_HEAD_SIZE
+#define RELAY_PIPE_SIZE (256 * 1024) // Размер канала splice между сервером и клиентом
+#define RANGE_MAX 8 // Диапазонов в запросе, при большем числе отдаётся весь ответ
+#define REPLY_PIECES (2 * RANGE_MAX + 1) // Заголовок и данные каждой части и завершающий разделитель
+#define RANGE_HEADERS_SIZE 512 // Заголовки Range и If-Range, передаваемые серверу при промахе
+#define DRAIN_POLL_MS 100 // Период проверки оставшихся соединений при остановке
+#define SHED_SLACK 4 // Цикл отдаёт соединения, когда их больше доли на четверть (1/SHED_SLACK)
+// Состояния соединения: чтение запроса -> поиск в кэше -> ответ из кэша или из загрузки с сервера
+typedef enum {
+    CONN_READ_REQUEST, // Чтение запроса клиента, в том числе следующего на том же соединении
+    CONN_SEND_CACHED, // Отправка объекта из кэша
+    CONN_SEND_DISK, // Отправка ответа из дискового журнала через sendfile
+    CONN_SEND_FETCHED, // Отправка ответа по мере его загрузки с сервера
+    CONN_RELAY, // Передача остатка некэшируемого ответа от сервера клиенту через splice
+    CONN_CLOSED // Соединение закрыто, память освободится после пачки событий
+} connection_state;
+
+// Сроки, которые соединение может пропустить: у каждого свой список на цикл событий
+typedef enum {
+    WAIT_IDLE, // Ждём следующий запрос (--keepalive-timeout)
+    WAIT_REQUEST, // Запрос начат, но заголовки пришли не целиком (--request-timeout)
+    WAIT_SEND, // Клиент не принимает ответ (--send-timeout)
+    WAIT_KINDS // Соединение ничего не ждёт от клиента
+} connection_wait;
+
+// Часть ответа, собранного из объекта кэша: сформированный текст или отрезок объекта
+typedef struct reply_piece {
+    const char *text; // Текст или NULL - отрезок объекта
+    size_t offset; // Начало отрезка в объекте
+    size_t len; // Длина
+} reply_piece;
+
+typedef struct connection {
+    event_loop *loop; // Цикл, которому принадлежит соединение
+    event_watcher client; // Сокет клиента
+    in_addr_t addr; // Адрес клиента для учёта соединений
+    connection_state state; // Текущее состояние
+    char *buffer; // Запрос клиента и, возможно, следующие за ним
+    size_t buffer_size; // Размер буфера
+    size_t buffer_len; // Заполнено байт в буфере
+    http_message request; // Разбор текущего запроса, ссылается на буфер
+    size_t request_len; // Длина текущего запроса, дальше может лежать следующий
+    int keep_alive; // Клиент готов отправить следующий запрос в это же соединение
+    cache_object *object; // Закреплённый объект при попадании в кэш
+    int head_only; // Запрос HEAD: от ответа отправляются только заголовки
+    reply_piece pieces[REPLY_PIECES]; // Ответ по частям для HEAD и Range (0 частей - объект целиком)
+    int npieces; // Количество частей
+    size_t reply_size; // Длина ответа из частей
+    char *reply_text; // Память сформированных заголовков и разделителей
+    disk_entry *disk; // Закреплённая запись при попадании на диск
+    fetch *fetch; // Загрузка, из которой клиент получает ответ при промахе
+    fetch_reader reader; // Позиция клиента в загрузке
+    event_watcher upstream; // Сокет сервера, забранный у загрузки для splice
+    int relay_pipe[2]; // Канал splice, создаётся при первой передаче и живёт до закрытия соединения
+    size_t relay_left; // Осталось принять от сервера (FETCH_RELAY_UNTIL_CLOSE - до закрытия)
+    size_t relay_buffered; // Байт в канале, ещё не отправленных клиенту
+    size_t sent; // Отправлено клиенту байт ответа
+    long long request_start; // Время разбора текущего запроса, мкс
+    int first_byte; // Первый байт ответа уже отправлен
+    connection_wait waiting; // Список ожидания, в котором лежит соединение
+    time_t wait_since; // С какого момента ждём клиента
+    struct connection *wait_prev; // Соседи в списке ожидания
+    struct connection *wait_next;
+} connection;
+
+// Соединения цикла, ждущие клиента, от самых давних к новым
+typedef struct connection_list {
+    connection *head;
+    connection *tail;
+} connection_list;
+
+// Соединения одного цикла событий, меняются только его потоком
+typedef struct loop_connections {
+    connection_list waits[WAIT_KINDS]; // Ждущие клиента, по списку на каждый срок
+    int count; // Живых соединений цикла
+    int shed; // Сколько соединений передать другим циклам, когда они дождутся следующего запроса
+} loop_connections;
+
+void proxy_block_signals();
+int proxy_init(int);
+void proxy_start(int, int);
+void handle_client(event_loop *, int, in_addr_t);
+void proxy_tick(event_loop *);
+void proxy_drain(event_loop *);
+
+#endif
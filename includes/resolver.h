@@ -0,0 +1,73 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "event_loop.h"
+#include "logging.h"
+
+#define RESOLVER_THREADS 2 // Потоки, выполняющие блокирующий getaddrinfo
+#define RESOLVER_SHARDS 16 // Шарды кэша имён
+#define RESOLVER_MAX_ENTRIES 4096 // Записей в шарде, после которых удаляются протухшие
+#define RESOLVER_ADDRESSES 8 // Адресов имени, которые перебираются при подключении
+
+// Адрес сервера, готовый для connect
+typedef struct resolver_address {
+    struct sockaddr_storage addr; // IPv4 или IPv6 адрес с портом
+    socklen_t len; // Длина адреса
+} resolver_address;
+
+// Адреса имени в порядке предпочтения getaddrinfo
+typedef struct resolver_result {
+    resolver_address addresses[RESOLVER_ADDRESSES]; // Адреса с портом
+    int count; // Количество адресов
+} resolver_result;
+
+// Вызывается в цикле запросившего, result == NULL при ошибке разрешения
+typedef void (*resolve_callback)(void *, const resolver_result *);
+
+// Ожидающий результата разрешения
+typedef struct resolver_waiter {
+    event_loop *loop; // Цикл, в котором вызывается callback
+    resolve_callback callback; // Обработчик результата
+    void *arg; // Аргумент обработчика
+    int port; // Порт, подставляемый в адрес
+    int ok; // Имя разрешено
+    resolver_result result; // Результат
+    struct resolver_waiter *next; // Следующий ожидающий того же имени
+} resolver_waiter;
+
+typedef enum {
+    RESOLVER_PENDING, // Запрос в очереди или выполняется
+    RESOLVER_READY // Результат в кэше до expiry
+} resolver_state;
+
+// Запись кэша имён: положительная или отрицательная
+typedef struct resolver_entry {
+    char host[HOST_SIZE]; // Имя хоста
+    resolver_state state; // Состояние записи
+    int ok; // 1 - адрес получен, 0 - имя не разрешилось
+    resolver_address addresses[RESOLVER_ADDRESSES]; // Адреса из ответа getaddrinfo без порта
+    int count; // Количество адресов
+    time_t expiry; // Время жизни записи
+    resolver_waiter *waiters; // Ждущие результата
+    struct resolver_entry *next; // Следующая запись шарда
+    struct resolver_entry *job_next; // Следующая запись в очереди разрешения
+} resolver_entry;
+
+typedef struct resolver_shard {
+    pthread_mutex_t lock; // Мьютекс шарда
+    resolver_entry *head; // Записи шарда
+    size_t count; // Количество записей
+} resolver_shard;
+
+void resolve_async(event_loop *, const char *, int, resolve_callback, void *);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "logging.h"
+
+#define SLAB_PAGE_SIZE (1 << 20) // Размер страницы слэба (1 МБ, выровнена по размеру)
+#define SLAB_MIN_SHIFT 6 // Минимальный класс 64 байта
+#define SLAB_MAX_SHIFT 16 // Максимальный класс 64 КБ
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MAX_SIZE (1 << SLAB_MAX_SHIFT)
+
+typedef struct slab_page {
+    struct slab_page *prev; // Предыдущая страница в списке частично занятых
+    struct slab_page *next; // Следующая страница в списке частично занятых
+    void *free_list; // Освобождённые блоки страницы
+    char *bump; // Начало ещё не размеченной части страницы
+    unsigned used; // Количество выданных блоков
+    unsigned total; // Общее количество блоков
+    int cls; // Класс размера
+} slab_page;
+
+typedef struct slab_class {
+    pthread_mutex_t lock; // Мьютекс класса
+    slab_page *partial; // Страницы со свободными блоками
+    size_t partial_count; // Длина списка частично занятых страниц
+    size_t block_size; // Размер блока класса
+} slab_class;
+
+void slab_init();
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+size_t slab_block_size(size_t size);
+size_t slab_mapped_bytes();
+
+#endif
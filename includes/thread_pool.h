@@ -1,33 +1,67 @@
-#ifndef THREAD_POOL_H
-#define THREAD_POOL_H
-
-#include <pthread.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <time.h>
-#include "logging.h"
-#include "proxy.h"
-
-#define THREAD_POOL_SIZE 8
-#define QUEUE_INITIAL_CAPACITY 16
-
-typedef struct thread_pool {
-    pthread_t threads[THREAD_POOL_SIZE]; // Массив идендификаторов потоков
-    pthread_mutex_t lock; // Мьютекс для синхронизации доступа к очереди
-    pthread_cond_t cond; // Условная переменная для уведомления потоков
-    int* queue; // Очередь из клиенских сокетов
-    size_t size; // Текущий размер очереди
-    int front, rear; // Указатели на начало и конец очереди
-    int stop; // Флаг для завершения работы пула
-    size_t capacity; // Вместимость очереди
-} thread_pool;
-
-void init_thread_pool();
-void enqueue(int);
-void resize_queue();
-int dequeue();
-void *thread_function(void *);
-void start_thread_pool();
-void stop_thread_pool();
-
-#endif
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#define _GNU_SOURCE // cpu_set_t, pthread_setaffinity_np
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include "logging.h"
+#include "config.h"
+#include "event_loop.h"
+#include "proxy.h"
+#include "metrics.h"
+#include "admission.h"
+
+#define QUEUE_CAPACITY 4096 // Вместимость очереди передачи сокетов (степень двойки)
+#define ACCEPT_BATCH 64 // Подключений, принимаемых циклом за одно событие слушающего сокета
+#define POOL_GROW_LOAD 0.75 // Доля времени, занятого обработкой, при которой циклов становится вдвое больше
+#define POOL_GROW_DEPTH 64 // Или сокетов в очереди на один работающий цикл
+#define POOL_SHRINK_LOAD 0.25 // Доля занятости, ниже которой цикл лишний
+#define POOL_SHRINK_TICKS 10 // Тиков подряд с низкой занятостью до отключения одного цикла
+#define POOL_NUMA_NODES 64 // Перебираемых узлов NUMA
+
+// Ячейка очереди: номер хода показывает, чья сейчас очередь - писателя или читателя
+typedef struct handoff_cell {
+    size_t sequence; // Номер хода ячейки
+    int client_socket; // Переданный сокет
+    in_addr_t addr; // Адрес клиента, под которым соединение учтено при приёме
+    long long enqueued; // Время постановки в очередь, мкс
+} handoff_cell;
+
+typedef struct thread_pool {
+    event_loop *loops; // Циклы событий, по одному на поток
+    event_watcher *acceptors; // Собственные слушающие сокеты циклов в режиме SO_REUSEPORT
+    int *paused; // Приём цикла приостановлен на пределе соединений
+    int threads; // Количество потоков
+    int active; // Циклов, получающих новые соединения; остальные отдают свои другим
+    int started; // Циклов с запущенным потоком, всегда первые по номеру
+    long long *busy_seen; // Занятость циклов на прошлой подстройке, мкс
+    long long adjusted_at; // Время прошлой подстройки, мкс
+    int calm_ticks; // Тиков подряд с низкой занятостью
+    int draining; // Пул останавливается: число циклов больше не меняется
+    unsigned next; // Следующий цикл для пробуждения
+    handoff_cell *queue; // Ограниченная очередь клиентских сокетов без блокировок
+    size_t mask; // Маска размера очереди
+    int stop; // Флаг для завершения работы пула
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE))); // Позиция записи, на своей линии кэша
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE))); // Позиция чтения, на своей линии кэша
+} thread_pool;
+
+void init_thread_pool();
+int enqueue(int, in_addr_t);
+int dequeue(in_addr_t *);
+long long thread_pool_depth();
+void add_acceptor(int, int);
+void resume_acceptor(event_loop *);
+int thread_pool_active();
+long long thread_pool_loops();
+void drain_thread_pool();
+void *thread_function(void *);
+void start_thread_pool();
+void stop_thread_pool();
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "logging.h"
+
+#define UPSTREAM_POOL_SHARDS 16 // Шарды пула соединений с серверами
+
+// Простаивающее соединение с сервером, готовое к следующему запросу
+typedef struct upstream_idle {
+    int fd; // Сокет сервера
+    int port; // Порт сервера
+    time_t since; // Когда соединение вернулось в пул
+    struct upstream_idle *next; // Следующее соединение шарда
+    char host[HOST_SIZE]; // Хост сервера
+} upstream_idle;
+
+typedef struct upstream_shard {
+    pthread_mutex_t lock; // Мьютекс шарда
+    upstream_idle *head; // Соединения шарда, недавно возвращённые впереди
+} upstream_shard;
+
+int upstream_acquire(const char *, int);
+void upstream_release(const char *, int, int);
+void upstream_sweep();
+
+#endif
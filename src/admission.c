@@ -0,0 +1,140 @@
+#include "admission.h"
+
+static admission_shard clients[ADMISSION_SHARDS];
+static long long active; // Живых клиентских соединений, включая ждущие в очереди
+static long long limit; // Предел живых соединений
+static int waiting; // Поток приёма ждёт освобождения места
+static int stopping; // Приём подключений завершён, ждать места больше незачем
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait_cond = PTHREAD_COND_INITIALIZER;
+
+// Ответ при перегрузке: короткий и без тела, клиенту сразу ясно, что повторить стоит позже
+static const char busy_reply[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+void admission_init() {
+    for (int i = 0; i < ADMISSION_SHARDS; i++) {
+        pthread_mutex_init(&clients[i].lock, NULL); // Инициализация мьютекса
+        clients[i].head = NULL;
+    }
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) < 0) {
+        files.rlim_cur = files.rlim_max = 1024; // Обычный предел по умолчанию
+    } else if (files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max; // Мягкий предел дескрипторов поднимаем до жёсткого
+        if (setrlimit(RLIMIT_NOFILE, &files) < 0) getrlimit(RLIMIT_NOFILE, &files);
+    }
+    limit = config.max_connections;
+    if (!limit) { // По умолчанию - сколько позволяют дескрипторы: клиент и его сервер на соединение
+        long long fds = files.rlim_cur == RLIM_INFINITY ? 1 << 20 : (long long)files.rlim_cur;
+        limit = fds > 2 * ADMISSION_FD_RESERVE ? (fds - ADMISSION_FD_RESERVE) / 2 : ADMISSION_FD_RESERVE;
+    }
+    logger(INFO, "Admission limits: %lld connections, %d per client", limit, config.max_per_client);
+}
+
+static admission_shard *shard_for(in_addr_t addr) {
+    uint32_t hash = (uint32_t)addr * 2654435761u;
+    return &clients[(hash >> 16) & (ADMISSION_SHARDS - 1)];
+}
+
+// Учёт нового соединения, -1 если у клиента уже предельное число соединений
+int admission_acquire(in_addr_t addr) {
+    if (config.max_per_client) {
+        admission_shard *shard = shard_for(addr);
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        admission_client *client = shard->head;
+        while (client && client->addr != addr) client = client->next;
+        if (client && client->active >= config.max_per_client) {
+            pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+            metrics_add(METRIC_CLIENT_LIMITED, 1);
+            return -1;
+        }
+        if (!client) {
+            client = (admission_client *)malloc(sizeof(admission_client));
+            if (!client) {
+                pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+                logger(ERROR, "Failed to allocate client entry");
+                return -1;
+            }
+            client->addr = addr;
+            client->active = 0;
+            client->next = shard->head;
+            shard->head = client;
+        }
+        client->active++;
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    }
+    __atomic_add_fetch(&active, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Соединение закрыто: место освобождается для ждущего приёма
+void admission_release(in_addr_t addr) {
+    if (config.max_per_client) {
+        admission_shard *shard = shard_for(addr);
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        for (admission_client **link = &shard->head; *link; link = &(*link)->next) {
+            admission_client *client = *link;
+            if (client->addr != addr) continue;
+            if (--client->active == 0) { // Клиент без соединений таблице больше не нужен
+                *link = client->next;
+                free(client);
+            }
+            break;
+        }
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    }
+    long long now_active = __atomic_sub_fetch(&active, 1, __ATOMIC_RELAXED);
+    if (now_active < limit && __atomic_load_n(&waiting, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&wait_lock); // Залочить мьютекс ожидания
+        pthread_cond_signal(&wait_cond);
+        pthread_mutex_unlock(&wait_lock); // Разлочить мьютекс
+    }
+}
+
+int admission_full() {
+    return __atomic_load_n(&active, __ATOMIC_RELAXED) >= limit;
+}
+
+// Приём подключений приостанавливается, пока живых соединений не станет меньше предела;
+// новые клиенты тем временем ждут в бэклоге ядра, а не занимают память и дескрипторы прокси
+void admission_wait() {
+    if (!admission_full()) return;
+    metrics_add(METRIC_ACCEPT_PAUSED, 1);
+    logger(WARNING, "Connection limit %lld reached, pausing accept", limit);
+    pthread_mutex_lock(&wait_lock); // Залочить мьютекс ожидания
+    __atomic_store_n(&waiting, 1, __ATOMIC_RELEASE);
+    while (admission_full() && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        struct timespec deadline; // Сигнал может проскочить между проверкой и ожиданием, поэтому ждём с тайм-аутом
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ADMISSION_WAIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wait_cond, &wait_lock, &deadline);
+    }
+    __atomic_store_n(&waiting, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&wait_lock); // Разлочить мьютекс
+}
+
+// Остановка прокси: ожидающий места поток приёма возвращается сразу
+void admission_shutdown() {
+    pthread_mutex_lock(&wait_lock); // Залочить мьютекс ожидания
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wait_cond);
+    pthread_mutex_unlock(&wait_lock); // Разлочить мьютекс
+}
+
+long long admission_active() {
+    return __atomic_load_n(&active, __ATOMIC_RELAXED);
+}
+
+// Быстрый отказ: ответ целиком помещается в пустой буфер нового сокета, поэтому не блокируемся
+void admission_reject(int client_socket) {
+    send(client_socket, busy_reply, sizeof(busy_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_socket);
+}
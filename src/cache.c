@@ -1,142 +1,630 @@
-#include "cache.h"
-
-cache *cache_init() {
-    cache *cache_ptr = (cache *)malloc(sizeof(cache)); // Выделяем память
-    if (!cache_ptr ) {
-        logger(ERROR, "Failed to initialize cache");
-        return NULL;
-    }
-    // Выделение памяти под массив записей
-    cache_ptr->entries = (cache_entry *)calloc(CACHE_SIZE, sizeof(cache_entry));
-    if (!cache_ptr->entries) {
-        logger(ERROR, "Failed to allocate cache entries");
-        free(cache_ptr);
-        return NULL;
-    }
-
-    cache_ptr->head = cache_ptr->tail = NULL; // Инициализируем указатели
-    pthread_mutex_init(&cache_ptr->lock, NULL); // Инициализация мьютекса
-    logger(INFO, "Cache initialized");
-    return cache_ptr;
-}
-
-void cache_destroy(cache *cache_ptr) {
-    pthread_mutex_lock(&cache_ptr->lock); // Залочить мьютекс
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        free(cache_ptr->entries[i].data); // Освобождение памяти, выделенной под данные
-    }
-    free(cache_ptr->entries); // Освобождение массива записей
-    pthread_mutex_unlock(&cache_ptr->lock); // Разлочить мьютекс
-    pthread_mutex_destroy(&cache_ptr->lock); // Дестрой мютекса
-    free(cache_ptr); // Очистка кэша
-    logger(INFO, "Cache was destroyed");
-}
-
-cache_entry *cache_find(cache *cache_ptr, const char *url) {
-    pthread_mutex_lock(&cache_ptr->lock); // Залочить мьютекс
-    for (cache_entry *entry = cache_ptr->head; entry; entry = entry->next) {
-        if (strcmp(entry->url, url) == 0 && entry->expiry > time(NULL)) {
-            logger(DEBUG, "Cache hit: URL=%s found", url);
-
-            // Перемещаем найденную запись в начало списка для LRU обновления
-            if (entry != cache_ptr->head) {
-                // Перемещаем запись в начало списка
-                if (entry->prev) entry->prev->next = entry->next;
-                if (entry->next) entry->next->prev = entry->prev;
-                if (entry == cache_ptr->tail) cache_ptr->tail = entry->prev;
-
-                entry->prev = NULL;
-                entry->next = cache_ptr->head;
-                if (cache_ptr->head) cache_ptr->head->prev = entry;
-                cache_ptr->head = entry;
-            }
-
-            pthread_mutex_unlock(&cache_ptr->lock); // Разлочить мьютекс
-            return entry; // Возвращаем найденную запись
-        }
-    }
-    logger(DEBUG, "Cache miss: URL=%s not found", url);
-    pthread_mutex_unlock(&cache_ptr->lock); // Разлочить мьютекс
-    return NULL; // Не найдено
-}
-
-void cache_add(cache *cache_ptr, const char *url, const char *data, size_t size, time_t expiry) {
-    pthread_mutex_lock(&cache_ptr->lock); // Залочить мьютекс
-    logger(INFO, "Adding to cache: URL=%s, SIZE=%zu", url, size);
-    cache_remove_expired(cache_ptr); // Удаляем устаревшие записи
-    cache_entry *entry = NULL;
-    // Ищем свободное место
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (!cache_ptr->entries[i].data) { // Если найдена пустая запись
-            entry = &cache_ptr->entries[i];
-            break;
-        }
-    }
-
-    // Если свободного места нет, используем LRU хвост
-    if (!entry) {
-        entry = cache_ptr->tail;
-        if (entry->data) free(entry->data); // Если данные в элементе есть, освобождаем память
-    }
-    // Заполняем новую запись
-    strncpy(entry->url, url, URL_SIZE - 1); // Копируем URL
-    entry->url[URL_SIZE - 1] = '\0'; // Вставляем нулевой сивол для предотвращения попадания мусора
-    // Копируем данные
-    entry->data = malloc(size); // Выделяем память под данные
-    if (!entry->data) {
-        logger(ERROR, "Failed to allocate memory for cache data");
-        pthread_mutex_unlock(&cache_ptr->lock); // Разлочиваем мьютекс
-        return;
-    }
-    memcpy(entry->data, data, size); // Копируем данные в запись
-    entry->size = size; // Устанавливаем размер данных
-    entry->expiry = expiry; // Устанавливаем время истечения записи
-
-    // Перемещаем запись в начало списка
-    if (entry != cache_ptr->head) {
-        if (entry->prev) entry->prev->next = entry->next;
-        if (entry->next) entry->next->prev = entry->prev;
-        if (entry == cache_ptr->tail) cache_ptr->tail = entry->prev;
-
-        entry->prev = NULL;
-        entry->next = cache_ptr->head;
-        if (cache_ptr->head) cache_ptr->head->prev = entry;
-        cache_ptr->head = entry;
-    }
-
-    pthread_mutex_unlock(&cache_ptr->lock); // Разлочить мьютекс
-    logger(INFO, "Cache entry added: URL=%s", url);
-}
-
-void cache_remove_expired(cache *cache_ptr) {
-    time_t now = time(NULL); // Получение текущего времени
-    cache_entry *entry = cache_ptr->head;
-    logger(INFO, "Removing expired cache entries...");
-    while (entry) {
-        cache_entry *next = entry->next;
-        if (entry->expiry <= now) { // Если запись устарела
-            logger(DEBUG, "Removing expired entry: URL=%s, Expiry=%ld", entry->url, entry->expiry);
-            // Удаляем устаревший элемент
-            if (entry->prev) entry->prev->next = entry->next;
-            if (entry->next) entry->next->prev = entry->prev;
-            if (entry == cache_ptr->head) cache_ptr->head = entry->next;
-            if (entry == cache_ptr->tail) cache_ptr->tail = entry->prev;
-
-            free(entry->data); // Освобождаем память
-            entry->data = NULL;
-        }
-        entry = next; // Переход к следующей записи
-    }
-    logger(INFO, "Expired entries removed");
-}
-
-void cache_print(cache *cache_ptr) {
-    pthread_mutex_lock(&cache_ptr->lock); // Залочить мьютекс
-    logger(RESET, "#########CACHE CONTENT#########\n");
-    // Вывод данных
-    for (cache_entry *entry = cache_ptr->head; entry; entry = entry->next) {
-        logger(DEBUG, "URL=%s, SIZE=%zu, EXPIRY=%ld\n", entry->url, entry->size, entry->expiry);
-    }
-    logger(RESET, "###############################\n");
-    pthread_mutex_unlock(&cache_ptr->lock); // Разлочить мьютекс
-}
+#include "cache.h"
+
+// Хэш FNV-1a по строке URL
+uint64_t cache_hash(const char *url) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)url; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Размер последнего куска объекта из size байт
+static size_t tail_chunk_size(size_t size, size_t nchunks) {
+    return size - (nchunks - 1) * CACHE_CHUNK_SIZE;
+}
+
+static size_t object_header_size(size_t nchunks) {
+    return sizeof(cache_object) + nchunks * sizeof(char *);
+}
+
+// Заголовок объекта без кусков: массив chunks заполняет вызывающий
+static cache_object *object_alloc(size_t nchunks, size_t size) {
+    cache_object *object = (cache_object *)slab_alloc(object_header_size(nchunks));
+    if (!object) {
+        logger(ERROR, "Failed to allocate memory for cache data");
+        return NULL;
+    }
+    object->refcount = 1; // Ссылка создателя
+    object->size = size;
+    object->nchunks = nchunks;
+    object->footprint = slab_block_size(object_header_size(nchunks)) + nchunks * CACHE_CHUNK_SIZE;
+    object->tail_block = CACHE_CHUNK_SIZE;
+    object->delimited = 0;
+    return object;
+}
+
+// Хвост переносим в блок подходящего класса, чтобы мелкие ответы не занимали целый кусок
+static void object_compact(cache_object *object) {
+    size_t nchunks = object->nchunks;
+    if (!nchunks) return;
+    size_t tail = tail_chunk_size(object->size, nchunks);
+    if (slab_block_size(tail) >= CACHE_CHUNK_SIZE) return;
+    char *small = slab_alloc(tail);
+    if (!small) return;
+    memcpy(small, object->chunks[nchunks - 1], tail);
+    slab_free(object->chunks[nchunks - 1], CACHE_CHUNK_SIZE);
+    object->chunks[nchunks - 1] = small;
+    object->tail_block = slab_block_size(tail);
+    object->footprint -= CACHE_CHUNK_SIZE - slab_block_size(tail);
+}
+
+// Создание объекта из готовых кусков, объект становится их владельцем
+cache_object *cache_object_adopt(char *const *chunks, size_t nchunks, size_t size, int compact) {
+    cache_object *object = object_alloc(nchunks, size);
+    if (!object) return NULL;
+    memcpy(object->chunks, chunks, nchunks * sizeof(char *));
+    if (compact) object_compact(object);
+    return object;
+}
+
+// Копирование ответа в новый объект: куски пишутся сразу в заголовок, без массива на стеке
+cache_object *cache_object_create(const char *data, size_t size) {
+    size_t nchunks = (size + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+    cache_object *object = object_alloc(nchunks, size);
+    if (!object) return NULL;
+    for (size_t i = 0; i < nchunks; i++) { // Копируем данные в куски объекта
+        object->chunks[i] = slab_alloc(CACHE_CHUNK_SIZE);
+        if (!object->chunks[i]) {
+            logger(ERROR, "Failed to allocate memory for cache data");
+            while (i--) slab_free(object->chunks[i], CACHE_CHUNK_SIZE);
+            slab_free(object, object_header_size(nchunks));
+            return NULL;
+        }
+        size_t offset = i * CACHE_CHUNK_SIZE;
+        memcpy(object->chunks[i], data + offset, size - offset < CACHE_CHUNK_SIZE ? size - offset : CACHE_CHUNK_SIZE);
+    }
+    object_compact(object);
+    return object;
+}
+
+cache_object *cache_object_retain(cache_object *object) {
+    __atomic_fetch_add(&object->refcount, 1, __ATOMIC_RELAXED); // Закрепляем объект
+    return object;
+}
+
+void cache_object_release(cache_object *object) {
+    if (!object) return;
+    if (__atomic_sub_fetch(&object->refcount, 1, __ATOMIC_ACQ_REL) == 0) { // Последняя ссылка - освобождаем память
+        for (size_t i = 0; i + 1 < object->nchunks; i++) {
+            slab_free(object->chunks[i], CACHE_CHUNK_SIZE);
+        }
+        if (object->nchunks) slab_free(object->chunks[object->nchunks - 1], object->tail_block);
+        slab_free(object, object_header_size(object->nchunks));
+    }
+}
+
+// Заполнение iovec кусками начиная со смещения, возвращает число элементов
+static int chunks_iov(char *const *chunks, size_t size, size_t offset, struct iovec *iov, int max) {
+    int count = 0;
+    size_t chunk = offset / CACHE_CHUNK_SIZE;
+    size_t skip = offset % CACHE_CHUNK_SIZE;
+    while (count < max && offset < size) {
+        size_t len = CACHE_CHUNK_SIZE - skip;
+        if (len > size - offset) len = size - offset;
+        iov[count].iov_base = chunks[chunk] + skip;
+        iov[count].iov_len = len;
+        offset += len;
+        chunk++;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+int cache_object_iov(const cache_object *object, size_t offset, struct iovec *iov, int max) {
+    return chunks_iov(object->chunks, object->size, offset, iov, max);
+}
+
+static cache_shard *cache_shard_for(cache *cache_ptr, uint64_t hash) {
+    return &cache_ptr->shards[hash & (CACHE_SHARDS - 1)]; // Младшие биты выбирают шард
+}
+
+static size_t index_slot(cache_shard *shard, uint64_t hash) {
+    return (size_t)(hash >> 32) & shard->index_mask; // Старшие биты выбирают ячейку в таблице
+}
+
+// Поиск записи в хэш-таблице шарда, возвращает номер ячейки или -1
+static long index_lookup(cache_shard *shard, const char *url, uint64_t hash) {
+    for (size_t slot = index_slot(shard, hash);; slot = (slot + 1) & shard->index_mask) {
+        cache_entry *entry = shard->index[slot];
+        if (!entry) return -1; // Пустая ячейка - записи нет
+        if (entry->hash == hash && strcmp(entry->url, url) == 0) return (long)slot;
+    }
+}
+
+static void index_insert(cache_entry **index, size_t mask, cache_entry *entry) {
+    size_t slot = (size_t)(entry->hash >> 32) & mask;
+    while (index[slot]) slot = (slot + 1) & mask; // Линейное пробирование
+    index[slot] = entry;
+}
+
+// Удвоение хэш-таблицы при заполненности выше 50%
+static int index_grow(cache_shard *shard) {
+    size_t size = (shard->index_mask + 1) * 2;
+    cache_entry **index = (cache_entry **)calloc(size, sizeof(cache_entry *));
+    if (!index) return -1;
+    for (size_t i = 0; i <= shard->index_mask; i++) {
+        if (shard->index[i]) index_insert(index, size - 1, shard->index[i]);
+    }
+    free(shard->index);
+    shard->index = index;
+    shard->index_mask = size - 1;
+    return 0;
+}
+
+// Удаление из таблицы со сдвигом назад, чтобы не оставлять надгробий
+static void index_remove(cache_shard *shard, size_t slot) {
+    size_t hole = slot;
+    shard->index[hole] = NULL;
+    for (size_t next = (hole + 1) & shard->index_mask; shard->index[next]; next = (next + 1) & shard->index_mask) {
+        size_t home = index_slot(shard, shard->index[next]->hash);
+        // Переносим запись в дыру, если её домашняя ячейка не лежит между дырой и текущей позицией
+        if (((next - home) & shard->index_mask) >= ((next - hole) & shard->index_mask)) {
+            shard->index[hole] = shard->index[next];
+            shard->index[next] = NULL;
+            hole = next;
+        }
+    }
+}
+
+static void link_init(cache_link *link) {
+    link->prev = link->next = link;
+}
+
+static void link_remove(cache_link *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link_init(link);
+}
+
+static void link_push(cache_link *head, cache_link *link) {
+    link->prev = head;
+    link->next = head->next;
+    head->next->prev = link;
+    head->next = link;
+}
+
+static cache_entry *timer_entry(cache_link *link) {
+    return (cache_entry *)((char *)link - offsetof(cache_entry, timer));
+}
+
+// Постановка записи в колесо за O(1); уже обработанные секунды попадают в ближайшую ячейку
+static void timer_schedule(cache_shard *shard, cache_entry *entry) {
+    time_t keep = entry->times.keep_until;
+    time_t when = keep > shard->wheel_time ? keep : shard->wheel_time + 1;
+    link_push(&shard->wheel[when & (CACHE_WHEEL_SLOTS - 1)], &entry->timer);
+}
+
+static void list_unlink(cache_list *list, cache_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    if (entry == list->head) list->head = entry->next;
+    if (entry == list->tail) list->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    list->bytes -= entry->footprint;
+}
+
+static void list_push_front(cache_list *list, cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head) list->head->prev = entry;
+    list->head = entry;
+    if (!list->tail) list->tail = entry;
+    list->bytes += entry->footprint;
+}
+
+// Перенос записи в начало списка сегмента, в том числе своего
+static void segment_move(cache_shard *shard, cache_entry *entry, cache_segment segment) {
+    list_unlink(&shard->lists[entry->segment], entry);
+    entry->segment = segment;
+    list_push_front(&shard->lists[segment], entry);
+}
+
+static size_t entry_alloc_size(const char *url) {
+    return sizeof(cache_entry) + strlen(url) + 1;
+}
+
+static void entry_free(cache_entry *entry) {
+    cache_object_release(entry->object); // Отпускаем ссылку кэша, читатели держат свои
+    slab_free(entry, entry_alloc_size(entry->url));
+}
+
+// Полное удаление записи из шарда: индекс, LRU, учёт памяти и ссылка на объект
+static void shard_evict(cache_shard *shard, cache_entry *entry) {
+    long slot = index_lookup(shard, entry->url, entry->hash);
+    if (slot >= 0) index_remove(shard, (size_t)slot);
+    list_unlink(&shard->lists[entry->segment], entry);
+    link_remove(&entry->timer);
+    shard->count--;
+    shard->bytes -= entry->footprint;
+    entry_free(entry);
+}
+
+// Вытеснение ради места: запись уходит приёмнику вытесненных, если он задан
+static void shard_drop(cache *cache_ptr, cache_shard *shard, cache_entry *entry) {
+    logger(DEBUG, "Evicting entry: URL=%s, SIZE=%zu", entry->url, entry->object->size);
+    if (cache_ptr->demote) cache_ptr->demote(entry->url, entry->object, &entry->times);
+    shard_evict(shard, entry);
+    metrics_add(METRIC_EVICTIONS, 1);
+}
+
+// LRU: один список, попадание переносит запись в начало, вытесняется хвост
+static void lru_hit(cache_shard *shard, cache_entry *entry) {
+    if (entry != shard->lists[CACHE_WINDOW].head) segment_move(shard, entry, CACHE_WINDOW);
+}
+
+static void lru_insert(cache *cache_ptr, cache_shard *shard, cache_entry *entry) {
+    entry->segment = CACHE_WINDOW;
+    list_push_front(&shard->lists[CACHE_WINDOW], entry);
+    // Новая запись в начале списка и сама в бюджет помещается, поэтому до неё очередь не дойдёт
+    while (shard->bytes > shard->capacity) shard_drop(cache_ptr, shard, shard->lists[CACHE_WINDOW].tail);
+}
+
+// W-TinyLFU: маленькое LRU окно, за ним SLRU, куда кандидата из окна допускает фильтр частот.
+// Частоты считает count-min sketch, поэтому однократный обход не вытесняет популярные записи
+static int tinylfu_init(cache_shard *shard) {
+    size_t width = CACHE_SKETCH_MIN;
+    while (width < CACHE_SKETCH_LIMIT && width * CACHE_SKETCH_UNIT < shard->capacity) width *= 2;
+    shard->sketch = (uint8_t *)calloc(width * CACHE_SKETCH_ROWS, 1);
+    if (!shard->sketch) return -1;
+    shard->sketch_mask = width - 1;
+    shard->sketch_ops = 0;
+    shard->window_capacity = shard->capacity * CACHE_WINDOW_PERCENT / 100;
+    shard->protected_capacity = (shard->capacity - shard->window_capacity) * CACHE_PROTECTED_PERCENT / 100;
+    return 0;
+}
+
+static void tinylfu_destroy(cache_shard *shard) {
+    free(shard->sketch);
+    shard->sketch = NULL;
+}
+
+// Счётчик строки row: строки берут старшие биты хэша, перемешанного своим нечётным множителем
+static uint8_t *sketch_counter(cache_shard *shard, uint64_t hash, int row) {
+    uint64_t mixed = (hash ^ (hash >> 31)) * (0x9E3779B97F4A7C15ULL + 2 * (uint64_t)row);
+    return &shard->sketch[row * (shard->sketch_mask + 1) + ((mixed >> 40) & shard->sketch_mask)];
+}
+
+static unsigned sketch_estimate(cache_shard *shard, uint64_t hash) {
+    unsigned min = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        unsigned count = *sketch_counter(shard, hash, row);
+        if (count < min) min = count;
+    }
+    return min;
+}
+
+static void tinylfu_access(cache_shard *shard, uint64_t hash) {
+    unsigned min = sketch_estimate(shard, hash);
+    if (min < CACHE_SKETCH_MAX) { // Консервативное обновление: растут только минимальные счётчики
+        for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+            uint8_t *counter = sketch_counter(shard, hash, row);
+            if (*counter == min) (*counter)++;
+        }
+    }
+    if (++shard->sketch_ops >= (shard->sketch_mask + 1) * CACHE_SKETCH_PERIOD) { // Старение: старая популярность затухает
+        for (size_t i = 0; i < (shard->sketch_mask + 1) * CACHE_SKETCH_ROWS; i++) shard->sketch[i] >>= 1;
+        shard->sketch_ops = 0;
+    }
+}
+
+static void tinylfu_hit(cache_shard *shard, cache_entry *entry) {
+    if (entry->segment != CACHE_PROBATION) {
+        segment_move(shard, entry, entry->segment);
+        return;
+    }
+    // Повторное обращение переводит запись в защищённый сегмент, его хвост возвращается на испытание
+    segment_move(shard, entry, CACHE_PROTECTED);
+    cache_list *protected = &shard->lists[CACHE_PROTECTED];
+    while (protected->bytes > shard->protected_capacity && protected->tail != entry) {
+        segment_move(shard, protected->tail, CACHE_PROBATION);
+    }
+}
+
+// Кандидат из окна против первой жертвы основной части: решение принимается один раз,
+// и только принятый кандидат вытесняет столько жертв, сколько нужно для его места
+static void tinylfu_admit(cache *cache_ptr, cache_shard *shard, cache_entry *candidate) {
+    size_t main_capacity = shard->capacity - shard->window_capacity;
+    cache_list *probation = &shard->lists[CACHE_PROBATION];
+    cache_list *protected = &shard->lists[CACHE_PROTECTED];
+    if (probation->bytes + protected->bytes + candidate->footprint > main_capacity) {
+        cache_entry *victim = probation->tail ? probation->tail : protected->tail;
+        if (candidate->footprint > main_capacity || !victim ||
+            sketch_estimate(shard, candidate->hash) <= sketch_estimate(shard, victim->hash)) {
+            logger(DEBUG, "Admission rejected: URL=%s", candidate->url);
+            shard_evict(shard, candidate); // Непроверенная запись не стоит места и на диске
+            metrics_add(METRIC_ADMISSION_REJECTED, 1);
+            return;
+        }
+        while (probation->bytes + protected->bytes + candidate->footprint > main_capacity) {
+            shard_drop(cache_ptr, shard, probation->tail ? probation->tail : protected->tail);
+        }
+    }
+    segment_move(shard, candidate, CACHE_PROBATION);
+}
+
+static void tinylfu_insert(cache *cache_ptr, cache_shard *shard, cache_entry *entry) {
+    entry->segment = CACHE_WINDOW;
+    list_push_front(&shard->lists[CACHE_WINDOW], entry);
+    cache_list *window = &shard->lists[CACHE_WINDOW];
+    while (window->bytes > shard->window_capacity) tinylfu_admit(cache_ptr, shard, window->tail);
+}
+
+static const cache_policy policies[] = {
+    { "lru", NULL, NULL, NULL, lru_hit, lru_insert },
+    { "tinylfu", tinylfu_init, tinylfu_destroy, tinylfu_access, tinylfu_hit, tinylfu_insert },
+};
+
+// Проход колеса до секунды now; мьютекс отпускается каждые CACHE_REAP_BATCH записей
+static size_t shard_reap(cache_shard *shard, time_t now) {
+    size_t expired = 0;
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    if (now - shard->wheel_time > CACHE_WHEEL_SLOTS) shard->wheel_time = now - CACHE_WHEEL_SLOTS; // Полный оборот покрывает все ячейки
+    int batch = 0;
+    while (shard->wheel_time < now) {
+        time_t second = ++shard->wheel_time;
+        cache_link *slot = &shard->wheel[second & (CACHE_WHEEL_SLOTS - 1)];
+        if (slot->next == slot) continue;
+        // Ячейку целиком переносим в список обхода, записи с дальним сроком вернутся в колесо
+        shard->reaping.next = slot->next;
+        shard->reaping.prev = slot->prev;
+        slot->next->prev = &shard->reaping;
+        slot->prev->next = &shard->reaping;
+        link_init(slot);
+        while (shard->reaping.next != &shard->reaping) {
+            if (++batch > CACHE_REAP_BATCH) { // Даём потокам циклов дорваться до шарда
+                pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+                pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+                batch = 1;
+            }
+            cache_entry *entry = timer_entry(shard->reaping.next);
+            link_remove(&entry->timer);
+            if (entry->times.keep_until <= now) { // Если запись больше не нужна даже для проверки
+                logger(DEBUG, "Removing expired entry: URL=%s, Expiry=%ld", entry->url, entry->times.keep_until);
+                shard_evict(shard, entry);
+                metrics_add(METRIC_EXPIRED, 1);
+                expired++;
+            } else {
+                timer_schedule(shard, entry); // Срок на одном из следующих оборотов колеса
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    return expired;
+}
+
+static void *cache_reaper(void *arg) {
+    cache *cache_ptr = (cache *)arg;
+    pthread_mutex_lock(&cache_ptr->reaper_lock); // Залочить мьютекс жнеца
+    while (!cache_ptr->reaper_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CACHE_REAP_INTERVAL;
+        pthread_cond_timedwait(&cache_ptr->reaper_cond, &cache_ptr->reaper_lock, &deadline);
+        if (cache_ptr->reaper_stop) break;
+        pthread_mutex_unlock(&cache_ptr->reaper_lock); // Разлочить мьютекс
+        cache_remove_expired(cache_ptr);
+        pthread_mutex_lock(&cache_ptr->reaper_lock); // Залочить мьютекс жнеца
+    }
+    pthread_mutex_unlock(&cache_ptr->reaper_lock); // Разлочить мьютекс
+    return NULL;
+}
+
+static int shard_init(cache_shard *shard, size_t capacity) {
+    shard->index = (cache_entry **)calloc(CACHE_INDEX_INITIAL, sizeof(cache_entry *));
+    shard->wheel = (cache_link *)malloc(CACHE_WHEEL_SLOTS * sizeof(cache_link));
+    if (!shard->index || !shard->wheel) {
+        free(shard->index);
+        free(shard->wheel);
+        return -1;
+    }
+    for (int i = 0; i < CACHE_WHEEL_SLOTS; i++) link_init(&shard->wheel[i]);
+    link_init(&shard->reaping);
+    shard->wheel_time = time(NULL);
+    shard->index_mask = CACHE_INDEX_INITIAL - 1;
+    memset(shard->lists, 0, sizeof(shard->lists)); // Инициализируем списки
+    shard->sketch = NULL;
+    shard->count = 0;
+    shard->bytes = 0;
+    shard->capacity = capacity;
+    shard->window_capacity = 0; // Окно есть только у W-TinyLFU
+    pthread_mutex_init(&shard->lock, NULL); // Инициализация мьютекса
+    return 0;
+}
+
+cache *cache_init(size_t capacity, size_t max_object, const char *policy) {
+    const cache_policy *chosen = NULL;
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i].name, policy) == 0) chosen = &policies[i];
+    }
+    if (!chosen) {
+        logger(ERROR, "Unknown cache policy: %s", policy);
+        return NULL;
+    }
+    cache *cache_ptr = NULL;
+    if (posix_memalign((void **)&cache_ptr, CACHE_LINE_SIZE, sizeof(cache)) != 0) { // Выделяем выровненную память
+        logger(ERROR, "Failed to initialize cache");
+        return NULL;
+    }
+    slab_init();
+    size_t shard_capacity = capacity / CACHE_SHARDS; // Бюджет делится поровну между шардами
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        if (shard_init(&cache_ptr->shards[i], shard_capacity) < 0 ||
+            (chosen->init && chosen->init(&cache_ptr->shards[i]) < 0)) {
+            logger(ERROR, "Failed to allocate cache index");
+            while (--i >= 0) {
+                free(cache_ptr->shards[i].index);
+                free(cache_ptr->shards[i].wheel);
+                if (chosen->destroy && cache_ptr->shards[i].sketch) chosen->destroy(&cache_ptr->shards[i]);
+                pthread_mutex_destroy(&cache_ptr->shards[i].lock);
+            }
+            free(cache_ptr);
+            return NULL;
+        }
+    }
+    // Объект должен помещаться в бюджет своего шарда, у W-TinyLFU - в основную часть без окна
+    size_t room = shard_capacity - cache_ptr->shards[0].window_capacity;
+    cache_ptr->max_object = max_object < room ? max_object : room;
+    pthread_mutex_init(&cache_ptr->reaper_lock, NULL); // Инициализация мьютекса
+    pthread_cond_init(&cache_ptr->reaper_cond, NULL); // Инициализация условной переменной
+    cache_ptr->reaper_stop = 0;
+    cache_ptr->demote = NULL;
+    cache_ptr->policy = chosen;
+    if (pthread_create(&cache_ptr->reaper, NULL, cache_reaper, cache_ptr) != 0) { // Жнец освобождает устаревшие записи без вставок
+        logger(ERROR, "Failed to start cache reaper");
+        exit(EXIT_FAILURE);
+    }
+    logger(INFO, "Cache initialized: %d shards, %zu bytes budget, %zu bytes max object, %s eviction",
+        CACHE_SHARDS, capacity, cache_ptr->max_object, chosen->name);
+    return cache_ptr;
+}
+
+void cache_destroy(cache *cache_ptr) {
+    pthread_mutex_lock(&cache_ptr->reaper_lock); // Залочить мьютекс жнеца
+    cache_ptr->reaper_stop = 1;
+    pthread_cond_signal(&cache_ptr->reaper_cond); // Будим жнеца для выхода
+    pthread_mutex_unlock(&cache_ptr->reaper_lock); // Разлочить мьютекс
+    pthread_join(cache_ptr->reaper, NULL);
+    pthread_cond_destroy(&cache_ptr->reaper_cond);
+    pthread_mutex_destroy(&cache_ptr->reaper_lock); // Дестрой мютекса
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *shard = &cache_ptr->shards[i];
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс
+        for (int segment = 0; segment < CACHE_SEGMENTS; segment++) {
+            cache_entry *entry = shard->lists[segment].head;
+            while (entry) {
+                cache_entry *next = entry->next;
+                entry_free(entry); // Освобождение записи и ссылки на данные
+                entry = next;
+            }
+        }
+        if (cache_ptr->policy->destroy) cache_ptr->policy->destroy(shard);
+        free(shard->index); // Освобождение хэш-таблицы
+        free(shard->wheel); // Освобождение колеса таймеров
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        pthread_mutex_destroy(&shard->lock); // Дестрой мютекса
+    }
+    free(cache_ptr); // Очистка кэша
+    logger(INFO, "Cache was destroyed");
+}
+
+void cache_set_demote(cache *cache_ptr, cache_demote_fn demote) {
+    cache_ptr->demote = demote;
+}
+
+size_t cache_max_object(cache *cache_ptr) {
+    return cache_ptr->max_object;
+}
+
+const char *cache_policy_name(cache *cache_ptr) {
+    return cache_ptr->policy->name;
+}
+
+cache_object *cache_find(cache *cache_ptr, const char *url, cache_times *times) {
+    uint64_t hash = cache_hash(url);
+    cache_shard *shard = cache_shard_for(cache_ptr, hash);
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    if (cache_ptr->policy->access) cache_ptr->policy->access(shard, hash);
+    long slot = index_lookup(shard, url, hash);
+    if (slot >= 0) {
+        cache_entry *entry = shard->index[slot];
+        if (entry->times.keep_until > time(NULL)) { // Устаревшую, но хранимую запись решает вызывающий
+            logger(DEBUG, "Cache hit: URL=%s found", url);
+            cache_ptr->policy->hit(shard, entry); // Политика обновляет положение записи
+            cache_object *object = cache_object_retain(entry->object); // Закрепляем объект до разлочки
+            if (times) *times = entry->times;
+            pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+            return object; // Возвращаем закреплённый объект, вызывающий обязан его отпустить
+        }
+    }
+    logger(DEBUG, "Cache miss: URL=%s not found", url);
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    return NULL; // Не найдено
+}
+
+void cache_add(cache *cache_ptr, const char *url, cache_object *object, const cache_times *times) {
+    if (object->size > cache_ptr->max_object) { // Слишком крупные объекты не кэшируем
+        logger(DEBUG, "Object too large for cache: URL=%s, SIZE=%zu", url, object->size);
+        return;
+    }
+    uint64_t hash = cache_hash(url);
+    cache_shard *shard = cache_shard_for(cache_ptr, hash);
+    cache_entry *entry = (cache_entry *)slab_alloc(entry_alloc_size(url)); // Выделяем запись до захвата мьютекса
+    if (!entry) {
+        logger(ERROR, "Failed to allocate cache entry");
+        return;
+    }
+    strcpy(entry->url, url); // Копируем URL
+    entry->hash = hash;
+    entry->object = cache_object_retain(object); // Кэш берёт собственную ссылку
+    entry->footprint = slab_block_size(entry_alloc_size(url)) + object->footprint;
+    entry->times = *times; // Устанавливаем сроки записи
+    entry->prev = entry->next = NULL;
+    link_init(&entry->timer);
+    if (entry->footprint > shard->capacity) { // С учётом служебных данных запись не влезает в шард
+        logger(DEBUG, "Object exceeds shard budget: URL=%s", url);
+        entry_free(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    logger(INFO, "Adding to cache: URL=%s, SIZE=%zu", url, object->size);
+
+    long slot = index_lookup(shard, url, hash);
+    if (slot >= 0) shard_evict(shard, shard->index[slot]); // URL уже в кэше - заменяем запись
+    if ((shard->count + 1) * 2 > shard->index_mask + 1 && index_grow(shard) < 0) {
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        logger(ERROR, "Failed to grow cache index");
+        entry_free(entry);
+        return;
+    }
+    index_insert(shard->index, shard->index_mask, entry);
+    timer_schedule(shard, entry); // Истечение отслеживает колесо таймеров
+    shard->count++;
+    shard->bytes += entry->footprint;
+    cache_ptr->policy->insert(cache_ptr, shard, entry); // Политика размещает запись и вытесняет лишнее, возможно и её саму
+
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    logger(INFO, "Cache entry added: URL=%s", url);
+}
+
+// Удаление устаревших записей всех шардов, вызывается жнецом
+void cache_remove_expired(cache *cache_ptr) {
+    time_t now = time(NULL); // Получение текущего времени
+    size_t expired = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        expired += shard_reap(&cache_ptr->shards[i], now);
+    }
+    if (expired) logger(DEBUG, "Expired entries removed: %zu", expired);
+}
+
+void cache_print(cache *cache_ptr) {
+    if (!log_enabled(DEBUG)) return; // Обход всего кэша нужен только для отладки
+    logger(RESET, "#########CACHE CONTENT (%s)#########\n", cache_ptr->policy->name);
+    // Вывод данных по шардам
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *shard = &cache_ptr->shards[i];
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        for (int segment = 0; segment < CACHE_SEGMENTS; segment++) {
+            for (cache_entry *entry = shard->lists[segment].head; entry; entry = entry->next) {
+                logger(DEBUG, "URL=%s, SIZE=%zu, EXPIRY=%ld, SEGMENT=%d\n", entry->url, entry->object->size, entry->times.expiry, segment);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    }
+    logger(RESET, "###############################\n");
+}
+
+// Количество записей и занятая память по всем шардам
+void cache_stats(cache *cache_ptr, size_t *entries, size_t *bytes) {
+    *entries = *bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *shard = &cache_ptr->shards[i];
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        *entries += shard->count;
+        *bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    }
+}
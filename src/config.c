@@ -0,0 +1,244 @@
+#include "config.h"
+
+proxy_config config = {
+    .port = DEFAULT_PORT,
+    .cache_bytes = DEFAULT_CACHE_BYTES,
+    .max_object_bytes = DEFAULT_MAX_OBJECT_BYTES,
+    .threads = 0,
+    .min_threads = 0,
+    .pin_threads = PIN_NONE,
+    .drain_timeout = DEFAULT_DRAIN_TIMEOUT,
+    .upstream_max_idle = DEFAULT_UPSTREAM_MAX_IDLE,
+    .upstream_idle_timeout = DEFAULT_UPSTREAM_IDLE_TIMEOUT,
+    .client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT,
+    .dns_ttl = DEFAULT_DNS_TTL,
+    .dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL,
+    .log_level = INFO,
+    .log_file = NULL,
+    .reuseport = 0,
+    .admin_port = 0,
+    .default_ttl = DEFAULT_TTL,
+    .disk_path = NULL,
+    .disk_bytes = DEFAULT_DISK_BYTES,
+    .cache_policy = DEFAULT_CACHE_POLICY,
+    .range_fill = 1,
+    .backlog = DEFAULT_BACKLOG,
+    .max_connections = 0,
+    .max_per_client = 0,
+    .request_timeout = DEFAULT_REQUEST_TIMEOUT,
+    .send_timeout = DEFAULT_SEND_TIMEOUT,
+    .peers = NULL,
+    .peer_self = NULL,
+};
+
+// Длинные опции без короткого аналога
+enum {
+    OPT_UPSTREAM_MAX_IDLE = 256,
+    OPT_UPSTREAM_IDLE_TIMEOUT,
+    OPT_KEEPALIVE_TIMEOUT,
+    OPT_DNS_TTL,
+    OPT_DNS_NEGATIVE_TTL,
+    OPT_LOG_FILE,
+    OPT_REUSEPORT,
+    OPT_ADMIN_PORT,
+    OPT_DEFAULT_TTL,
+    OPT_DISK_PATH,
+    OPT_DISK_SIZE,
+    OPT_CACHE_POLICY,
+    OPT_NO_RANGE_FILL,
+    OPT_BACKLOG,
+    OPT_MAX_CONNECTIONS,
+    OPT_MAX_PER_CLIENT,
+    OPT_REQUEST_TIMEOUT,
+    OPT_SEND_TIMEOUT,
+    OPT_PEERS,
+    OPT_PEER_SELF,
+    OPT_MIN_THREADS,
+    OPT_MAX_THREADS,
+    OPT_PIN_THREADS,
+    OPT_DRAIN_TIMEOUT,
+};
+
+// Разбор размера с необязательным суффиксом K, M или G
+static size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (end == arg || *end != '\0') {
+        logger(ERROR, "Invalid size: %s", arg);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)value;
+}
+
+static pin_mode parse_pin(const char *arg) {
+    if (strcmp(arg, "none") == 0) return PIN_NONE;
+    if (strcmp(arg, "cpu") == 0) return PIN_CPU;
+    if (strcmp(arg, "numa") == 0) return PIN_NUMA;
+    logger(ERROR, "Invalid thread pinning: %s", arg);
+    exit(EXIT_FAILURE);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p, --port PORT             listening port (default %d)\n"
+        "  -c, --cache-size SIZE       cache budget in bytes, K/M/G suffixes allowed\n"
+        "  -m, --max-object-size SIZE  largest cacheable response\n"
+        "  -t, --threads N             fixed number of event loop threads\n"
+        "      --min-threads N         event loops that always take connections (default: a quarter\n"
+        "                              of --max-threads); more start when the loops are busy\n"
+        "      --max-threads N         most event loops (default: one per core)\n"
+        "      --pin-threads MODE      pin event loop threads: none, cpu or numa (default none)\n"
+        "      --drain-timeout SEC     on SIGTERM or SIGINT, finish responses this long (default %d)\n"
+        "      --upstream-max-idle N   idle connections kept per origin (default %d)\n"
+        "      --upstream-idle-timeout SEC\n"
+        "                              close pooled origin connections idle this long (default %d)\n"
+        "      --keepalive-timeout SEC close client connections idle this long (default %d)\n"
+        "      --request-timeout SEC   close clients that take longer to send request headers (default %d)\n"
+        "      --send-timeout SEC      close clients that accept no response bytes this long (default %d)\n"
+        "      --backlog N             listen backlog (default %d)\n"
+        "      --max-connections N     pause accepting at this many live client connections\n"
+        "                              (default: half the file descriptor limit)\n"
+        "      --max-per-client N      answer 503 to a client address with this many connections\n"
+        "                              (default unlimited)\n"
+        "      --dns-ttl SEC           cache resolved host names this long (default %d)\n"
+        "      --dns-negative-ttl SEC  cache failed lookups this long (default %d)\n"
+        "  -l, --log-level LEVEL       debug, info, warning or error (default info)\n"
+        "      --log-file PATH         write logs to a file without colors\n"
+        "      --reuseport             accept on a SO_REUSEPORT socket per event loop\n"
+        "      --admin-port PORT       serve metrics on 127.0.0.1:PORT/metrics (default off)\n"
+        "      --default-ttl SEC       freshness of responses without Cache-Control, Expires\n"
+        "                              or Last-Modified (default %d)\n"
+        "      --disk-path DIR         keep evicted responses in a journal under DIR (default off)\n"
+        "      --disk-size SIZE        disk journal size, K/M/G suffixes allowed (default 1G)\n"
+        "      --cache-policy NAME     eviction policy: lru, or tinylfu for scan resistance\n"
+        "                              (default %s)\n"
+        "      --no-range-fill         do not fetch the whole object in the background on a Range miss\n"
+        "      --peers LIST            share one cache across proxies: comma-separated HOST:PORT\n"
+        "                              of every node, this one included (default off); the internal\n"
+        "                              X-Proxy-Peer header is honoured only from these addresses\n"
+        "      --peer-self HOST:PORT   this node in the peer list (default 127.0.0.1 and --port)\n"
+        "  -h, --help                  show this help\n",
+        program, DEFAULT_PORT, DEFAULT_DRAIN_TIMEOUT, DEFAULT_UPSTREAM_MAX_IDLE, DEFAULT_UPSTREAM_IDLE_TIMEOUT, DEFAULT_CLIENT_IDLE_TIMEOUT,
+        DEFAULT_REQUEST_TIMEOUT, DEFAULT_SEND_TIMEOUT, DEFAULT_BACKLOG,
+        DEFAULT_DNS_TTL, DEFAULT_DNS_NEGATIVE_TTL, DEFAULT_TTL, DEFAULT_CACHE_POLICY);
+}
+
+void config_parse(int argc, char **argv) {
+    static const struct option options[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "cache-size", required_argument, NULL, 'c' },
+        { "max-object-size", required_argument, NULL, 'm' },
+        { "threads", required_argument, NULL, 't' },
+        { "min-threads", required_argument, NULL, OPT_MIN_THREADS },
+        { "max-threads", required_argument, NULL, OPT_MAX_THREADS },
+        { "pin-threads", required_argument, NULL, OPT_PIN_THREADS },
+        { "drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT },
+        { "upstream-max-idle", required_argument, NULL, OPT_UPSTREAM_MAX_IDLE },
+        { "upstream-idle-timeout", required_argument, NULL, OPT_UPSTREAM_IDLE_TIMEOUT },
+        { "keepalive-timeout", required_argument, NULL, OPT_KEEPALIVE_TIMEOUT },
+        { "dns-ttl", required_argument, NULL, OPT_DNS_TTL },
+        { "dns-negative-ttl", required_argument, NULL, OPT_DNS_NEGATIVE_TTL },
+        { "log-level", required_argument, NULL, 'l' },
+        { "log-file", required_argument, NULL, OPT_LOG_FILE },
+        { "reuseport", no_argument, NULL, OPT_REUSEPORT },
+        { "admin-port", required_argument, NULL, OPT_ADMIN_PORT },
+        { "default-ttl", required_argument, NULL, OPT_DEFAULT_TTL },
+        { "disk-path", required_argument, NULL, OPT_DISK_PATH },
+        { "disk-size", required_argument, NULL, OPT_DISK_SIZE },
+        { "cache-policy", required_argument, NULL, OPT_CACHE_POLICY },
+        { "no-range-fill", no_argument, NULL, OPT_NO_RANGE_FILL },
+        { "backlog", required_argument, NULL, OPT_BACKLOG },
+        { "max-connections", required_argument, NULL, OPT_MAX_CONNECTIONS },
+        { "max-per-client", required_argument, NULL, OPT_MAX_PER_CLIENT },
+        { "request-timeout", required_argument, NULL, OPT_REQUEST_TIMEOUT },
+        { "send-timeout", required_argument, NULL, OPT_SEND_TIMEOUT },
+        { "peers", required_argument, NULL, OPT_PEERS },
+        { "peer-self", required_argument, NULL, OPT_PEER_SELF },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:c:m:t:l:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.cache_bytes = parse_size(optarg); break;
+            case 'm': config.max_object_bytes = parse_size(optarg); break;
+            case 't': config.threads = config.min_threads = atoi(optarg); break;
+            case OPT_MIN_THREADS: config.min_threads = atoi(optarg); break;
+            case OPT_MAX_THREADS: config.threads = atoi(optarg); break;
+            case OPT_PIN_THREADS: config.pin_threads = parse_pin(optarg); break;
+            case OPT_DRAIN_TIMEOUT: config.drain_timeout = atoi(optarg); break;
+            case OPT_UPSTREAM_MAX_IDLE: config.upstream_max_idle = atoi(optarg); break;
+            case OPT_UPSTREAM_IDLE_TIMEOUT: config.upstream_idle_timeout = atoi(optarg); break;
+            case OPT_KEEPALIVE_TIMEOUT: config.client_idle_timeout = atoi(optarg); break;
+            case OPT_DNS_TTL: config.dns_ttl = atoi(optarg); break;
+            case OPT_DNS_NEGATIVE_TTL: config.dns_negative_ttl = atoi(optarg); break;
+            case 'l': config.log_level = log_level_parse(optarg); break;
+            case OPT_LOG_FILE: config.log_file = optarg; break;
+            case OPT_REUSEPORT: config.reuseport = 1; break;
+            case OPT_ADMIN_PORT: config.admin_port = atoi(optarg); break;
+            case OPT_DEFAULT_TTL: config.default_ttl = atoi(optarg); break;
+            case OPT_DISK_PATH: config.disk_path = optarg; break;
+            case OPT_DISK_SIZE: config.disk_bytes = parse_size(optarg); break;
+            case OPT_CACHE_POLICY: config.cache_policy = optarg; break;
+            case OPT_NO_RANGE_FILL: config.range_fill = 0; break;
+            case OPT_BACKLOG: config.backlog = atoi(optarg); break;
+            case OPT_MAX_CONNECTIONS: config.max_connections = atoi(optarg); break;
+            case OPT_MAX_PER_CLIENT: config.max_per_client = atoi(optarg); break;
+            case OPT_REQUEST_TIMEOUT: config.request_timeout = atoi(optarg); break;
+            case OPT_SEND_TIMEOUT: config.send_timeout = atoi(optarg); break;
+            case OPT_PEERS: config.peers = optarg; break;
+            case OPT_PEER_SELF: config.peer_self = optarg; break;
+            case 'h': usage(argv[0]); exit(EXIT_SUCCESS);
+            default: usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+    if (config.port <= 0 || config.port > 65535) {
+        logger(ERROR, "Invalid port: %d", config.port);
+        exit(EXIT_FAILURE);
+    }
+    if (config.admin_port < 0 || config.admin_port > 65535 || config.admin_port == config.port) {
+        logger(ERROR, "Invalid admin port: %d", config.admin_port);
+        exit(EXIT_FAILURE);
+    }
+    if (config.upstream_max_idle < 0 || config.upstream_idle_timeout <= 0 || config.client_idle_timeout <= 0) {
+        logger(ERROR, "Invalid keep-alive settings");
+        exit(EXIT_FAILURE);
+    }
+    if (config.request_timeout <= 0 || config.send_timeout <= 0) {
+        logger(ERROR, "Invalid client timeouts");
+        exit(EXIT_FAILURE);
+    }
+    if (config.backlog <= 0 || config.max_connections < 0 || config.max_per_client < 0) {
+        logger(ERROR, "Invalid connection limits");
+        exit(EXIT_FAILURE);
+    }
+    if (config.default_ttl < 0) {
+        logger(ERROR, "Invalid default TTL: %d", config.default_ttl);
+        exit(EXIT_FAILURE);
+    }
+    if (config.dns_ttl < 0 || config.dns_negative_ttl < 0) {
+        logger(ERROR, "Invalid DNS cache settings");
+        exit(EXIT_FAILURE);
+    }
+    if (config.log_level < 0) {
+        logger(ERROR, "Invalid log level");
+        exit(EXIT_FAILURE);
+    }
+    if (config.threads <= 0) { // По умолчанию один цикл событий на ядро
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads = cores > 0 ? (int)cores : 1;
+    }
+    if (config.min_threads <= 0) config.min_threads = config.threads >= 4 ? config.threads / 4 : 1;
+    if (config.min_threads > config.threads || config.drain_timeout < 0) {
+        logger(ERROR, "Invalid thread settings");
+        exit(EXIT_FAILURE);
+    }
+    if (config.reuseport) config.min_threads = config.threads; // Ядро раздаёт подключения всем сокетам группы сразу
+}
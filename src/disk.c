@@ -0,0 +1,528 @@
+#include "disk.h"
+
+static disk_store *store; // NULL - дисковый уровень выключен
+
+// Длина записи журнала: заголовок, URL и ответ, выровненные по сектору
+static size_t record_length(size_t url_len, size_t size) {
+    return (sizeof(disk_record) + url_len + size + DISK_ALIGN - 1) / DISK_ALIGN * DISK_ALIGN;
+}
+
+// Запись не переходит через конец файла: не влезающая переносится в начало следующего круга
+static uint64_t record_place(uint64_t position, size_t length) {
+    size_t offset = position % store->capacity;
+    if (offset + length > store->capacity) position += store->capacity - offset;
+    return position;
+}
+
+static size_t body_offset(const disk_entry *entry) {
+    return entry->position % store->capacity + sizeof(disk_record) + strlen(entry->url);
+}
+
+static disk_entry **index_slot(const char *url, uint64_t hash) {
+    disk_entry **link = &store->index[hash & store->index_mask];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->url, url) != 0)) link = &(*link)->chain;
+    return link;
+}
+
+// Удвоение хэш-таблицы, при нехватке памяти остаёмся с длинными цепочками
+static void index_grow() {
+    size_t size = (store->index_mask + 1) * 2;
+    disk_entry **index = (disk_entry **)calloc(size, sizeof(disk_entry *));
+    if (!index) return;
+    for (size_t i = 0; i <= store->index_mask; i++) {
+        disk_entry *entry = store->index[i];
+        while (entry) {
+            disk_entry *next = entry->chain;
+            disk_entry **bucket = &index[entry->hash & (size - 1)];
+            entry->chain = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(store->index);
+    store->index = index;
+    store->index_mask = size - 1;
+}
+
+// Вычёркиваем запись из индекса; память освободится, когда журнал дойдёт до её места
+static void index_unlink(disk_entry *entry) {
+    if (entry->removed) return;
+    disk_entry **link = index_slot(entry->url, entry->hash);
+    if (*link == entry) *link = entry->chain;
+    entry->removed = 1;
+    store->count--;
+    store->bytes -= entry->size;
+    store->dirty = 1;
+}
+
+static void index_insert(disk_entry *entry) {
+    disk_entry **link = index_slot(entry->url, entry->hash);
+    if (*link) index_unlink(*link); // Более старая копия того же URL
+    if (store->count > store->index_mask) index_grow();
+    disk_entry **bucket = &store->index[entry->hash & store->index_mask];
+    entry->chain = *bucket;
+    *bucket = entry;
+    entry->removed = 0;
+    store->count++;
+    store->bytes += entry->size;
+    store->dirty = 1;
+}
+
+static void journal_append(disk_entry *entry) {
+    entry->newer = NULL;
+    if (store->newest) store->newest->newer = entry;
+    else store->oldest = entry;
+    store->newest = entry;
+}
+
+// Освобождение места до позиции end: записи, которые она перезапишет, уходят из индекса.
+// -1 - самая старая запись ещё отдаётся клиенту и перезаписывать её нельзя
+static int journal_reclaim(uint64_t end) {
+    while (store->oldest && store->oldest->position + store->capacity < end) {
+        disk_entry *entry = store->oldest;
+        if (entry->pins) return -1;
+        store->oldest = entry->newer;
+        if (!store->oldest) store->newest = NULL;
+        index_unlink(entry);
+        free(entry);
+    }
+    return 0;
+}
+
+static disk_entry *entry_create(const disk_record *record, const char *url) {
+    disk_entry *entry = (disk_entry *)malloc(sizeof(disk_entry) + record->url_len + 1);
+    if (!entry) {
+        logger(ERROR, "Failed to allocate disk cache entry");
+        return NULL;
+    }
+    entry->hash = record->hash;
+    entry->position = record->position;
+    entry->size = record->size;
+    entry->times.expiry = record->expiry;
+    entry->times.stale_until = record->stale_until;
+    entry->times.keep_until = record->keep_until;
+    entry->delimited = record->delimited;
+    entry->hits = 0;
+    entry->pins = 0;
+    entry->removed = 1; // В индекс попадает только через index_insert
+    entry->chain = entry->newer = NULL;
+    memcpy(entry->url, url, record->url_len);
+    entry->url[record->url_len] = '\0';
+    return entry;
+}
+
+// Восстановленная при запуске запись: занимает место в журнале, в индексе - пока не истекла
+static void journal_restore(const disk_record *record, const char *url) {
+    journal_reclaim(record->position + record_length(record->url_len, record->size));
+    disk_entry *entry = entry_create(record, url);
+    if (!entry) return;
+    journal_append(entry);
+    if (entry->times.keep_until > time(NULL)) index_insert(entry);
+}
+
+// Запись индекса совпадает с заголовком в журнале, то есть её место ещё не перезаписано
+static int record_valid(const disk_record *record, const char *url) {
+    size_t offset = record->position % store->capacity;
+    if (record->url_len == 0 || offset + record_length(record->url_len, record->size) > store->capacity) return 0;
+    const disk_record *stored = (const disk_record *)(store->map + offset);
+    return stored->magic == DISK_MAGIC && stored->position == record->position && stored->hash == record->hash &&
+           stored->size == record->size && stored->url_len == record->url_len &&
+           memcmp(store->map + offset + sizeof(disk_record), url, record->url_len) == 0;
+}
+
+// Дочитываем журнал после снимка: записи идут подряд, пока позиция в заголовке совпадает с ожидаемой
+static void journal_recover(uint64_t position) {
+    size_t scanned = 0;
+    while (scanned < store->capacity) {
+        size_t offset = position % store->capacity;
+        const disk_record *record = (const disk_record *)(store->map + offset);
+        if (offset + sizeof(disk_record) > store->capacity || record->magic != DISK_MAGIC || record->position != position) {
+            if (offset == 0) break;
+            // Запись могла не влезть в конец файла и начаться со следующего круга
+            record = (const disk_record *)store->map;
+            if (record->magic != DISK_MAGIC || record->position != position + store->capacity - offset) break;
+            scanned += store->capacity - offset;
+            position += store->capacity - offset;
+            continue;
+        }
+        const char *url = store->map + offset + sizeof(disk_record);
+        if (!record_valid(record, url)) break;
+        journal_restore(record, url);
+        size_t length = record_length(record->url_len, record->size);
+        position += length;
+        scanned += length;
+    }
+    store->head = position;
+}
+
+// Загрузка снимка индекса: 0 - журнал восстановлен, -1 - снимка нет или он от другого журнала
+static int index_load() {
+    int fd = open(store->index_path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    char *buffer = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(disk_index_header)) {
+        len = st.st_size;
+        buffer = (char *)malloc(len);
+        if (buffer && read(fd, buffer, len) != (ssize_t)len) {
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+    close(fd);
+    if (!buffer) return -1;
+    disk_index_header header;
+    memcpy(&header, buffer, sizeof(header));
+    if (header.magic != DISK_INDEX_MAGIC || header.version != DISK_INDEX_VERSION || header.capacity != store->capacity) {
+        logger(WARNING, "Disk cache index does not match the journal, starting empty");
+        free(buffer);
+        return -1;
+    }
+    const char *p = buffer + sizeof(header);
+    const char *end = buffer + len;
+    while ((size_t)(end - p) >= sizeof(disk_record)) {
+        disk_record record;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+        if (record.url_len > (size_t)(end - p)) break;
+        if (record_valid(&record, p)) journal_restore(&record, p);
+        p += record.url_len;
+    }
+    free(buffer);
+    journal_recover(header.head);
+    store->snapshot_head = header.head;
+    return 0;
+}
+
+// Снимок индекса во временный файл с атомарной заменой; вызывается только потоком записи
+static void index_snapshot() {
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    if (!store->dirty && store->head == store->snapshot_head) {
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+        return;
+    }
+    time_t now = time(NULL);
+    size_t len = sizeof(disk_index_header);
+    for (disk_entry *entry = store->oldest; entry; entry = entry->newer) {
+        if (!entry->removed && entry->times.keep_until > now) len += sizeof(disk_record) + strlen(entry->url);
+    }
+    char *buffer = (char *)malloc(len);
+    if (!buffer) {
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+        logger(ERROR, "Failed to allocate disk cache index snapshot");
+        return;
+    }
+    disk_index_header header = { DISK_INDEX_MAGIC, DISK_INDEX_VERSION, store->capacity, store->head, 0 };
+    char *p = buffer + sizeof(header);
+    for (disk_entry *entry = store->oldest; entry; entry = entry->newer) {
+        if (entry->removed || entry->times.keep_until <= now) continue;
+        size_t url_len = strlen(entry->url);
+        disk_record record = { DISK_MAGIC, (uint32_t)url_len, entry->position, entry->hash, entry->size,
+                               entry->times.expiry, entry->times.stale_until, entry->times.keep_until, (uint32_t)entry->delimited, 0 };
+        memcpy(p, &record, sizeof(record));
+        memcpy(p + sizeof(record), entry->url, url_len);
+        p += sizeof(record) + url_len;
+        header.count++;
+    }
+    memcpy(buffer, &header, sizeof(header));
+    store->dirty = 0;
+    store->snapshot_head = store->head;
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+
+    int fd = open(store->index_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write(fd, buffer, len) == (ssize_t)len;
+    if (fd >= 0) close(fd);
+    if (!ok || rename(store->index_tmp, store->index_path) < 0) {
+        logger(WARNING, "Failed to write disk cache index: %s", strerror(errno));
+        pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+        store->dirty = 1;
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+    }
+    free(buffer);
+}
+
+static int write_all(const struct iovec *iov, int count, off_t offset) {
+    ssize_t written = pwritev(store->fd, iov, count, offset);
+    size_t want = 0;
+    for (int i = 0; i < count; i++) want += iov[i].iov_len;
+    return written == (ssize_t)want ? 0 : -1;
+}
+
+// Запись ответа в журнал: тело до заголовка, чтобы оборванная запись не выглядела целой
+static int write_record(const disk_record *record, const char *url, const cache_object *object) {
+    off_t offset = record->position % store->capacity;
+    struct iovec iov[16];
+    iov[0].iov_base = (void *)url;
+    iov[0].iov_len = record->url_len;
+    if (write_all(iov, 1, offset + sizeof(disk_record)) < 0) return -1;
+    size_t done = 0;
+    while (done < object->size) {
+        int count = cache_object_iov(object, done, iov, 16);
+        size_t len = 0;
+        for (int i = 0; i < count; i++) len += iov[i].iov_len;
+        if (write_all(iov, count, offset + sizeof(disk_record) + record->url_len + done) < 0) return -1;
+        done += len;
+    }
+    iov[0].iov_base = (void *)record;
+    iov[0].iov_len = sizeof(disk_record);
+    return write_all(iov, 1, offset);
+}
+
+static void write_job(disk_job *job) {
+    size_t url_len = strlen(job->url);
+    size_t length = record_length(url_len, job->object->size);
+    if (length > store->capacity) return;
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    uint64_t position = record_place(store->head, length);
+    if (journal_reclaim(position + length) < 0) {
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+        logger(DEBUG, "Disk cache journal is pinned by a reader, dropping %s", job->url);
+        return;
+    }
+    store->head = position + length;
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+
+    disk_record record = { DISK_MAGIC, (uint32_t)url_len, position, job->hash, job->object->size,
+                           job->times.expiry, job->times.stale_until, job->times.keep_until, (uint32_t)job->object->delimited, 0 };
+    if (write_record(&record, job->url, job->object) < 0) {
+        logger(ERROR, "Failed to write disk cache record: %s", strerror(errno));
+        return;
+    }
+    disk_entry *entry = entry_create(&record, job->url);
+    if (!entry) return;
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    journal_append(entry);
+    if (!store->writing_cancelled) index_insert(entry); // Пока писали, URL мог загрузиться заново
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+    metrics_add(METRIC_DISK_WRITES, 1);
+}
+
+// Поток записи: вытесненные объекты пишутся последовательно, индекс периодически сохраняется
+static void *disk_writer(void *arg) {
+    (void)arg;
+    time_t next_snapshot = time(NULL) + DISK_SNAPSHOT_INTERVAL;
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    while (!store->stop) {
+        if (!store->queue_len) {
+            struct timespec deadline = { next_snapshot, 0 };
+            pthread_cond_timedwait(&store->cond, &store->lock, &deadline);
+        }
+        if (store->stop) break;
+        if (store->queue_len) {
+            disk_job job = store->queue[store->queue_head];
+            store->queue_head = (store->queue_head + 1) % DISK_QUEUE;
+            store->queue_len--;
+            store->writing = job.url;
+            store->writing_cancelled = job.cancelled;
+            pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+            if (!job.cancelled) write_job(&job);
+            cache_object_release(job.object);
+            pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+            store->writing = NULL;
+            free(job.url);
+        }
+        if (time(NULL) >= next_snapshot || store->head - store->snapshot_head >= store->capacity / DISK_SNAPSHOT_SHARE) {
+            pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+            index_snapshot();
+            next_snapshot = time(NULL) + DISK_SNAPSHOT_INTERVAL;
+            pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+        }
+    }
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+    return NULL;
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = (char *)malloc(len);
+    if (path) snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+// Открытие журнала в каталоге dir; индекс восстанавливается из снимка и хвоста журнала
+int disk_open(const char *dir, size_t capacity) {
+    long long start = metrics_now();
+    capacity = capacity / DISK_ALIGN * DISK_ALIGN;
+    if (capacity < DISK_ALIGN * 16) {
+        logger(ERROR, "Disk cache size too small: %zu", capacity);
+        return -1;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        logger(ERROR, "Failed to create disk cache directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    store = (disk_store *)calloc(1, sizeof(disk_store));
+    char *data_path = path_join(dir, "data");
+    if (store) {
+        store->capacity = capacity;
+        store->index_path = path_join(dir, "index");
+        store->index_tmp = path_join(dir, "index.tmp");
+        store->index = (disk_entry **)calloc(DISK_INDEX_INITIAL, sizeof(disk_entry *));
+        store->index_mask = DISK_INDEX_INITIAL - 1;
+    }
+    if (!store || !data_path || !store->index_path || !store->index_tmp || !store->index) {
+        logger(ERROR, "Failed to allocate disk cache");
+        exit(EXIT_FAILURE);
+    }
+    store->fd = open(data_path, O_RDWR | O_CREAT, 0644);
+    free(data_path);
+    struct stat st;
+    if (store->fd < 0 || fstat(store->fd, &st) < 0) {
+        logger(ERROR, "Failed to open disk cache journal in %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    int reuse = (size_t)st.st_size == capacity;
+    if (reuse) {
+        store->map = (char *)mmap(NULL, capacity, PROT_READ, MAP_SHARED, store->fd, 0);
+        if (store->map == MAP_FAILED || index_load() < 0) reuse = 0;
+    }
+    if (!reuse) { // Журнал от другого размера или без индекса: обнуляем, чтобы старые записи не ожили
+        if (store->map && store->map != MAP_FAILED) munmap(store->map, capacity);
+        store->map = NULL;
+        if (ftruncate(store->fd, 0) < 0 || ftruncate(store->fd, capacity) < 0) {
+            logger(ERROR, "Failed to size disk cache journal: %s", strerror(errno));
+            return -1;
+        }
+        store->map = (char *)mmap(NULL, capacity, PROT_READ, MAP_SHARED, store->fd, 0);
+        if (store->map == MAP_FAILED) {
+            logger(ERROR, "Failed to map disk cache journal: %s", strerror(errno));
+            return -1;
+        }
+    }
+    pthread_mutex_init(&store->lock, NULL); // Инициализация мьютекса
+    pthread_cond_init(&store->cond, NULL);
+    if (pthread_create(&store->writer, NULL, disk_writer, NULL) != 0) {
+        logger(ERROR, "Failed to start disk cache writer");
+        return -1;
+    }
+    logger(INFO, "Disk cache %s: %zu entries, %zu bytes restored in %lld ms", dir, store->count, store->bytes,
+           (metrics_now() - start) / 1000);
+    return 0;
+}
+
+// Остановка потока записи и последний снимок индекса
+void disk_close() {
+    if (!store) return;
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    store->stop = 1;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+    pthread_join(store->writer, NULL);
+    for (size_t i = 0; i < store->queue_len; i++) {
+        disk_job *job = &store->queue[(store->queue_head + i) % DISK_QUEUE];
+        cache_object_release(job->object);
+        free(job->url);
+    }
+    index_snapshot();
+    while (store->oldest) {
+        disk_entry *entry = store->oldest;
+        store->oldest = entry->newer;
+        free(entry);
+    }
+    munmap(store->map, store->capacity);
+    close(store->fd);
+    pthread_mutex_destroy(&store->lock); // Дестрой мютекса
+    pthread_cond_destroy(&store->cond);
+    free(store->index);
+    free(store->index_path);
+    free(store->index_tmp);
+    free(store);
+    store = NULL;
+}
+
+// Поиск на диске: запись закрепляется до disk_release, hits - номер этого попадания
+disk_entry *disk_find(const char *url, cache_times *times, int *hits) {
+    if (!store) return NULL;
+    uint64_t hash = cache_hash(url);
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    disk_entry *entry = *index_slot(url, hash);
+    if (entry && entry->times.keep_until <= time(NULL)) {
+        index_unlink(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        entry->pins++;
+        if (hits) *hits = ++entry->hits;
+        if (times) *times = entry->times;
+    }
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+    return entry;
+}
+
+// Копия ответа из отображённого журнала в новый объект памяти
+cache_object *disk_load(disk_entry *entry) {
+    cache_object *object = cache_object_create(store->map + body_offset(entry), entry->size);
+    if (object) object->delimited = entry->delimited;
+    return object;
+}
+
+// Отправка ответа клиенту из файла журнала без копирования в пространство процесса
+ssize_t disk_send(int socket, disk_entry *entry, size_t offset) {
+    off_t position = body_offset(entry) + offset;
+    return sendfile(socket, store->fd, &position, entry->size - offset);
+}
+
+void disk_release(disk_entry *entry) {
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    entry->pins--;
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+}
+
+// Вытесненный из памяти объект ставится в очередь записи; при заполненной очереди он теряется
+void disk_demote(const char *url, cache_object *object, const cache_times *times) {
+    if (!store || times->keep_until <= time(NULL)) return;
+    if (record_length(strlen(url), object->size) > store->capacity) return;
+    uint64_t hash = cache_hash(url);
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    disk_entry *entry = *index_slot(url, hash);
+    if (entry && entry->size == object->size && entry->times.expiry == times->expiry &&
+        entry->times.stale_until == times->stale_until && entry->times.keep_until == times->keep_until) {
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+        return; // Объект был поднят с диска и не менялся: его запись в журнале ещё жива
+    }
+    char *copy = strdup(url);
+    if (!copy) {
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+        return;
+    }
+    if (store->queue_len == DISK_QUEUE) {
+        pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+        logger(DEBUG, "Disk cache queue is full, dropping %s", url);
+        free(copy);
+        return;
+    }
+    disk_job *job = &store->queue[(store->queue_head + store->queue_len) % DISK_QUEUE];
+    job->url = copy;
+    job->hash = hash;
+    job->cancelled = 0;
+    job->object = cache_object_retain(object);
+    job->times = *times;
+    store->queue_len++;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+}
+
+// URL загружен заново: копия на диске и ожидающие записи устарели
+void disk_invalidate(const char *url) {
+    if (!store) return;
+    uint64_t hash = cache_hash(url);
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    disk_entry *entry = *index_slot(url, hash);
+    if (entry) index_unlink(entry);
+    for (size_t i = 0; i < store->queue_len; i++) {
+        disk_job *job = &store->queue[(store->queue_head + i) % DISK_QUEUE];
+        if (job->hash == hash && strcmp(job->url, url) == 0) job->cancelled = 1;
+    }
+    if (store->writing && strcmp(store->writing, url) == 0) store->writing_cancelled = 1;
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+}
+
+void disk_stats(size_t *entries, size_t *bytes) {
+    *entries = *bytes = 0;
+    if (!store) return;
+    pthread_mutex_lock(&store->lock); // Залочить мьютекс журнала
+    *entries = store->count;
+    *bytes = store->bytes;
+    pthread_mutex_unlock(&store->lock); // Разлочить мьютекс
+}
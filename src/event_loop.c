@@ -0,0 +1,193 @@
+#include "event_loop.h"
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static long long monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static long long monotonic_ms() {
+    return monotonic_us() / 1000;
+}
+
+// Выполнение накопленных задач в порядке добавления
+static void run_tasks(event_loop *loop) {
+    pthread_mutex_lock(&loop->lock); // Залочить мьютекс
+    event_task *tasks = loop->tasks;
+    loop->tasks = NULL;
+    pthread_mutex_unlock(&loop->lock); // Разлочить мьютекс
+
+    event_task *ordered = NULL; // Разворачиваем список, задачи добавлялись в голову
+    while (tasks) {
+        event_task *next = tasks->next;
+        tasks->next = ordered;
+        ordered = tasks;
+        tasks = next;
+    }
+    while (ordered) {
+        event_task *next = ordered->next;
+        ordered->callback(ordered->arg);
+        free(ordered);
+        ordered = next;
+    }
+}
+
+static void on_wake_event(event_watcher *watcher, uint32_t events) {
+    (void)events;
+    event_loop *loop = (event_loop *)watcher->data;
+    uint64_t value;
+    while (read(watcher->fd, &value, sizeof(value)) > 0); // Сбрасываем счётчик eventfd
+    if (loop->on_wake) loop->on_wake(loop);
+}
+
+void event_watcher_init(event_watcher *watcher, int fd, void (*callback)(event_watcher *, uint32_t), void *data) {
+    watcher->fd = fd;
+    watcher->events = 0;
+    watcher->registered = 0;
+    watcher->callback = callback;
+    watcher->data = data;
+}
+
+// Установка маски интереса: добавление, изменение или удаление дескриптора из epoll
+int event_watcher_set(event_loop *loop, event_watcher *watcher, uint32_t events) {
+    if (watcher->registered && watcher->events == events) return 0;
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = watcher;
+    int op = watcher->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(loop->epoll_fd, op, watcher->fd, &event) < 0) {
+        logger(ERROR, "epoll_ctl failed for fd %d", watcher->fd);
+        return -1;
+    }
+    watcher->registered = 1;
+    watcher->events = events;
+    return 0;
+}
+
+void event_watcher_close(event_loop *loop, event_watcher *watcher) {
+    if (watcher->fd < 0) return;
+    if (watcher->registered) epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+    close(watcher->fd);
+    watcher->fd = -1;
+    watcher->registered = 0;
+    watcher->events = 0;
+}
+
+// Убираем дескриптор из epoll, не закрывая его: владение переходит вызывающему
+int event_watcher_detach(event_loop *loop, event_watcher *watcher) {
+    int fd = watcher->fd;
+    if (fd < 0) return -1;
+    if (watcher->registered) epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    watcher->fd = -1;
+    watcher->registered = 0;
+    watcher->events = 0;
+    return fd;
+}
+
+int event_loop_init(event_loop *loop, int id) {
+    loop->id = id;
+    loop->tasks = NULL;
+    loop->stop = 0;
+    loop->on_wake = NULL;
+    loop->on_tick = NULL;
+    loop->next_tick = 0;
+    loop->busy_us = 0;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        logger(ERROR, "Failed to create epoll instance");
+        return -1;
+    }
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        logger(ERROR, "Failed to create eventfd");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    event_watcher_init(&loop->wake, wake_fd, on_wake_event, loop);
+    if (event_watcher_set(loop, &loop->wake, EPOLLIN) < 0) {
+        close(wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+    pthread_mutex_init(&loop->lock, NULL); // Инициализация мьютекса
+    return 0;
+}
+
+void event_loop_destroy(event_loop *loop) {
+    run_tasks(loop); // Доводим отложенные освобождения
+    event_watcher_close(loop, &loop->wake);
+    close(loop->epoll_fd);
+    pthread_mutex_destroy(&loop->lock); // Дестрой мютекса
+}
+
+void event_loop_wake(event_loop *loop) {
+    uint64_t value = 1;
+    if (write(loop->wake.fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        logger(WARNING, "Failed to wake event loop %d", loop->id);
+    }
+}
+
+// Постановка задачи в цикл, безопасна из любого потока
+int event_loop_post(event_loop *loop, void (*callback)(void *), void *arg) {
+    event_task *task = (event_task *)malloc(sizeof(event_task));
+    if (!task) {
+        logger(ERROR, "Failed to allocate event loop task");
+        return -1;
+    }
+    task->callback = callback;
+    task->arg = arg;
+    pthread_mutex_lock(&loop->lock); // Залочить мьютекс
+    task->next = loop->tasks;
+    loop->tasks = task;
+    pthread_mutex_unlock(&loop->lock); // Разлочить мьютекс
+    // Свой поток выполнит задачу после текущей пачки событий, чужой нужно разбудить
+    if (!pthread_equal(pthread_self(), loop->thread)) event_loop_wake(loop);
+    return 0;
+}
+
+void event_loop_stop(event_loop *loop) {
+    __atomic_store_n(&loop->stop, 1, __ATOMIC_RELEASE);
+    event_loop_wake(loop);
+}
+
+void event_loop_run(event_loop *loop) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    loop->thread = pthread_self();
+    loop->next_tick = monotonic_ms() + EVENT_LOOP_TICK_MS;
+    logger(INFO, "Event loop %d started", loop->id);
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE)) {
+        int timeout = -1;
+        if (loop->on_tick) { // Ждём событий не дольше, чем до следующего тика
+            long long left = loop->next_tick - monotonic_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        // Задачи, добавленные из задач этого же потока, не будят цикл - тогда не ждём событий
+        if (__atomic_load_n(&loop->tasks, __ATOMIC_ACQUIRE)) timeout = 0;
+        int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            logger(ERROR, "epoll_wait failed in loop %d", loop->id);
+            break;
+        }
+        long long busy_start = monotonic_us();
+        for (int i = 0; i < count; i++) {
+            event_watcher *watcher = (event_watcher *)events[i].data.ptr;
+            if (watcher->fd < 0) continue; // Закрыт обработчиком раньше в этой же пачке
+            watcher->callback(watcher, events[i].events);
+        }
+        run_tasks(loop); // Задачи выполняются после пачки, поэтому освобождать объекты в них безопасно
+        if (loop->on_tick && monotonic_ms() >= loop->next_tick) {
+            loop->next_tick = monotonic_ms() + EVENT_LOOP_TICK_MS;
+            loop->on_tick(loop);
+        }
+        // Всё время вне epoll_wait цикл занят: считает или стоит на блокировках и диске
+        __atomic_store_n(&loop->busy_us, loop->busy_us + monotonic_us() - busy_start, __ATOMIC_RELAXED);
+    }
+    logger(INFO, "Event loop %d stopped", loop->id);
+}
@@ -0,0 +1,847 @@
+#include "fetch.h"
+
+// Шард таблицы загрузок в процессе, ключ - URL
+typedef struct fetch_table_shard {
+    pthread_mutex_t lock; // Мьютекс шарда
+    fetch *head; // Загрузки шарда
+} fetch_table_shard;
+
+static fetch_table_shard table[FETCH_TABLE_SHARDS];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void on_upstream_event(event_watcher *, uint32_t);
+static void fetch_connect(fetch *);
+static void fetch_begin(fetch *);
+
+static void table_setup() {
+    for (int i = 0; i < FETCH_TABLE_SHARDS; i++) {
+        pthread_mutex_init(&table[i].lock, NULL); // Инициализация мьютекса
+        table[i].head = NULL;
+    }
+}
+
+static fetch_table_shard *table_shard_for(uint64_t hash) {
+    return &table[hash & (FETCH_TABLE_SHARDS - 1)];
+}
+
+// Убираем загрузку из таблицы, после этого к ней никто не присоединится
+static void table_remove(fetch *f) {
+    fetch_table_shard *shard = table_shard_for(f->hash);
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    if (f->joinable) {
+        for (fetch **link = &shard->head; *link; link = &(*link)->next) {
+            if (*link == f) {
+                *link = f->next;
+                break;
+            }
+        }
+        f->joinable = 0;
+    }
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+}
+
+static void fetch_free(void *arg) {
+    fetch *f = (fetch *)arg;
+    if (!f->adopted) { // Куски не достались кэшу - освобождаем сами
+        for (size_t i = f->first_chunk; i < f->nchunks; i++) {
+            slab_free(f->ring[i % f->ring_size], CACHE_CHUNK_SIZE);
+        }
+    }
+    cache_object_release(f->object);
+    cache_object_release(f->stale);
+    if (f->relay_fd >= 0) close(f->relay_fd); // Читатель ушёл, не забрав сокет
+    free(f->ring);
+    pthread_mutex_destroy(&f->lock); // Дестрой мютекса
+    free(f);
+}
+
+static void fetch_release(fetch *f) {
+    if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    // Освобождаем после пачки событий цикла загрузки, где ещё может встретиться её сокет
+    if (event_loop_post(f->loop, fetch_free, f) < 0) fetch_free(f);
+}
+
+static void reader_notify_task(void *arg) {
+    fetch_reader *reader = (fetch_reader *)arg;
+    __atomic_store_n(&reader->notify_pending, 0, __ATOMIC_RELEASE); // Новые данные после этого вызовут новое уведомление
+    reader->notify(reader);
+}
+
+// Уведомление читателей в их циклах, не более одного ожидающего уведомления на читателя
+static void notify_readers(fetch *f) {
+    pthread_mutex_lock(&f->lock); // Залочить мьютекс загрузки
+    for (fetch_reader *reader = f->readers; reader; reader = reader->next) {
+        if (__atomic_exchange_n(&reader->notify_pending, 1, __ATOMIC_ACQ_REL)) continue;
+        if (event_loop_post(reader->loop, reader_notify_task, reader) < 0) {
+            __atomic_store_n(&reader->notify_pending, 0, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&f->lock); // Разлочить мьютекс
+}
+
+// После полного ответа соединение возвращается в пул, иначе закрывается
+static void upstream_done(fetch *f, int complete) {
+    if (complete && f->keep_alive && f->upstream.fd >= 0) {
+        int fd = event_watcher_detach(f->loop, &f->upstream);
+        upstream_release(f->host, f->port, fd);
+        return;
+    }
+    event_watcher_close(f->loop, &f->upstream); // Закрываем сокет сервера
+}
+
+static void fetch_finish(fetch *f, int status) {
+    table_remove(f);
+    upstream_done(f, status > 0);
+    if (status > 0 && f->not_modified) { // Объект подтверждён: продлеваем его сроки без новой загрузки тела
+        logger(INFO, "Revalidated cached response for URL: %s", f->url);
+        metrics_add(METRIC_REVALIDATED, 1);
+        disk_invalidate(f->url); // Копия на диске хранит прежние сроки
+        cache_add(f->cache, f->url, f->stale, &f->times);
+    } else if (status > 0 && f->caching) {
+        size_t used = (f->size + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+        while (f->nchunks > used) { // Последний выделенный кусок остался пустым
+            f->nchunks--;
+            slab_free(f->ring[f->nchunks % f->ring_size], CACHE_CHUNK_SIZE);
+        }
+        // Хвост можно ужать, только если из кусков больше никто не читает
+        pthread_mutex_lock(&f->lock); // Залочить мьютекс загрузки
+        int compact = f->readers == NULL;
+        pthread_mutex_unlock(&f->lock); // Разлочить мьютекс
+        logger(INFO, "Received %zu bytes from server, caching response", f->size);
+        f->object = cache_object_adopt(f->ring, f->nchunks, f->size, compact); // Куски становятся объектом без копирования
+        if (f->object) {
+            f->adopted = 1;
+            f->object->delimited = f->framing != FRAME_CLOSE; // Клиенту можно не закрывать соединение после ответа
+            disk_invalidate(f->url); // Прежняя версия на диске больше не нужна
+            cache_add(f->cache, f->url, f->object, &f->times); // Добавляем ответ в кэш
+        }
+    }
+    f->state = status > 0 ? FETCH_DONE : FETCH_FAILED;
+    __atomic_store_n(&f->status, status, __ATOMIC_RELEASE);
+    notify_readers(f);
+    fetch_release(f); // Сторона сервера отпускает свою ссылку
+}
+
+static void stop_caching(fetch *f) {
+    logger(INFO, "Response exceeds max object size, not caching");
+    f->caching = 0;
+    table_remove(f); // Начало ответа будет освобождаться, новым читателям его не отдать
+}
+
+// Освобождение кусков, которые забрали все читатели: 1 - есть место, 0 - окно заполнено, -1 - читателей нет
+static int fetch_trim(fetch *f) {
+    size_t window = f->ring_size - 1 < FETCH_WINDOW_CHUNKS ? f->ring_size - 1 : FETCH_WINDOW_CHUNKS;
+    pthread_mutex_lock(&f->lock); // Залочить мьютекс загрузки
+    int room = -1;
+    for (int attempt = 0; f->readers && attempt < 2; attempt++) {
+        size_t min = (size_t)-1;
+        for (fetch_reader *reader = f->readers; reader; reader = reader->next) {
+            size_t offset = __atomic_load_n(&reader->offset, __ATOMIC_SEQ_CST);
+            if (offset < min) min = offset;
+        }
+        while (f->first_chunk < min / CACHE_CHUNK_SIZE) {
+            slab_free(f->ring[f->first_chunk % f->ring_size], CACHE_CHUNK_SIZE);
+            f->first_chunk++;
+        }
+        room = f->nchunks - f->first_chunk < window;
+        if (room) break;
+        // Ставим паузу и перепроверяем: читатель мог продвинуться, не увидев флага
+        __atomic_store_n(&f->paused, 1, __ATOMIC_SEQ_CST);
+        if (attempt == 1) break;
+    }
+    if (room > 0) __atomic_store_n(&f->paused, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&f->lock); // Разлочить мьютекс
+    return room;
+}
+
+// Сроки записи по свежести ответа: устаревшую запись с валидаторами храним дольше для условной проверки
+static void fetch_set_times(fetch *f, const http_freshness *freshness) {
+    time_t now = time(NULL);
+    f->times.expiry = now + freshness->lifetime;
+    f->times.stale_until = f->times.expiry + freshness->stale_while_revalidate;
+    f->times.keep_until = f->times.stale_until;
+    if (freshness->validators) {
+        long keep = freshness->stale_while_revalidate > FETCH_STALE_KEEP ? freshness->stale_while_revalidate : FETCH_STALE_KEEP;
+        f->times.keep_until = f->times.expiry + keep;
+    }
+}
+
+// Заголовки устаревшего объекта: ответ хранится целиком, его начало лежит в первом куске
+static int stale_headers(fetch *f, http_message *stored) {
+    http_reset(stored);
+    size_t len = f->stale->size < CACHE_CHUNK_SIZE ? f->stale->size : CACHE_CHUNK_SIZE;
+    return http_parse_response(stored, f->stale->chunks[0], len) > 0 ? 0 : -1;
+}
+
+// 304 обновляет сроки; без явного срока в нём берём политику сохранённого ответа, отсчитывая от момента проверки
+static void revalidated_times(fetch *f) {
+    http_freshness freshness;
+    http_response_freshness(&f->response, time(NULL), config.default_ttl, &freshness);
+    http_message stored;
+    if (!freshness.explicit_ttl && stale_headers(f, &stored) == 0) {
+        time_t date = http_date(http_header_find(&stored, "Date"));
+        http_response_freshness(&stored, date >= 0 ? date : time(NULL), config.default_ttl, &freshness);
+    }
+    freshness.validators = 1; // Объект только что успешно проверен по своим валидаторам
+    fetch_set_times(f, &freshness);
+}
+
+// Политика кэширования ответа: некэшируемый ответ отдаётся только уже присоединившимся читателям
+static void response_policy(fetch *f) {
+    http_freshness freshness;
+    http_response_freshness(&f->response, time(NULL), config.default_ttl, &freshness);
+    if (!freshness.storable) {
+        if (f->caching) logger(INFO, "Response for %s is not cacheable (status %d)", f->url, f->response.status);
+        f->caching = 0;
+        table_remove(f);
+        return;
+    }
+    fetch_set_times(f, &freshness);
+}
+
+// Разбор статуса и заголовков: как найти конец ответа и можно ли потом переиспользовать соединение
+static void parse_headers(fetch *f) {
+    http_message *response = &f->response;
+    size_t length = 0;
+    int has_length = http_content_length(response, &length);
+    int chunked = http_header_token(response, "Transfer-Encoding", "chunked");
+    f->header_len = response->head_len;
+    f->keep_alive = http_keep_alive(response);
+    if (response->status == 204 || response->status == 304) { // Ответы без тела
+        f->framing = FRAME_LENGTH;
+        f->response_len = f->header_len;
+    } else if (chunked) {
+        f->framing = FRAME_CHUNKED;
+        f->chunk = CHUNK_SIZE;
+        f->chunk_left = 0;
+    } else if (has_length > 0) {
+        f->framing = FRAME_LENGTH;
+        f->response_len = f->header_len + length;
+    } else {
+        f->framing = FRAME_CLOSE; // Конец ответа узнаем только по закрытию соединения
+        f->keep_alive = 0;
+    }
+    if (f->stale && response->status == 304) { // Устаревший объект подтверждён, тело 304 читателям не нужно
+        f->not_modified = 1;
+        f->caching = 0;
+        revalidated_times(f);
+    } else {
+        response_policy(f);
+    }
+}
+
+static void chunk_size_done(fetch *f) {
+    f->chunk = f->chunk_left ? CHUNK_DATA : CHUNK_TRAILER; // Кусок нулевого размера - последний
+}
+
+// Разбор тела chunked, возвращает число разобранных байт или -1 при ошибке формата
+static ssize_t chunked_feed(fetch *f, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && f->chunk != CHUNK_DONE) {
+        char c = data[i];
+        switch (f->chunk) {
+            case CHUNK_SIZE:
+                if (isxdigit((unsigned char)c)) {
+                    if (f->chunk_left > (SIZE_MAX >> 4)) return -1;
+                    f->chunk_left = f->chunk_left * 16 + (isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10);
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    f->chunk = CHUNK_EXT;
+                } else if (c == '\r') {
+                    f->chunk = CHUNK_SIZE_LF;
+                } else if (c == '\n') {
+                    chunk_size_done(f);
+                } else {
+                    return -1;
+                }
+                i++;
+                break;
+            case CHUNK_EXT:
+                if (c == '\r') f->chunk = CHUNK_SIZE_LF;
+                else if (c == '\n') chunk_size_done(f);
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') return -1;
+                chunk_size_done(f);
+                i++;
+                break;
+            case CHUNK_DATA: { // Данные пропускаем целиком, они уже лежат в кольце
+                size_t take = len - i < f->chunk_left ? len - i : f->chunk_left;
+                i += take;
+                f->chunk_left -= take;
+                if (!f->chunk_left) f->chunk = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (c == '\r') f->chunk = CHUNK_DATA_LF;
+                else if (c == '\n') f->chunk = CHUNK_SIZE;
+                else return -1;
+                i++;
+                break;
+            case CHUNK_DATA_LF:
+                if (c != '\n') return -1;
+                f->chunk = CHUNK_SIZE;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\r') f->chunk = CHUNK_TRAILER_LF;
+                else if (c == '\n') f->chunk = CHUNK_DONE;
+                else f->chunk = CHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') f->chunk = CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_TRAILER_LF:
+                if (c != '\n') return -1;
+                f->chunk = CHUNK_DONE;
+                i++;
+                break;
+            default:
+                break;
+        }
+    }
+    return i;
+}
+
+// Учёт принятых байт: 1 - ответ завершён (len урезается до его конца), 0 - ждём ещё, -1 - ошибка формата
+static int fetch_parse(fetch *f, const char *data, size_t *len) {
+    size_t start = f->size;
+    size_t end = start + *len;
+    if (f->framing == FRAME_UNKNOWN) { // Заголовки лежат в первом куске, разбор продолжается с прошлого места
+        int parsed = http_parse_response(&f->response, f->ring[0], end);
+        if (parsed > 0) {
+            parse_headers(f);
+        } else if (parsed < 0 || end >= CACHE_CHUNK_SIZE) {
+            logger(WARNING, "Unparsable response headers from %s, relaying until close", f->host);
+            f->framing = FRAME_CLOSE;
+            f->keep_alive = 0;
+            f->caching = 0; // Ответ без понятных заголовков не кэшируем
+            table_remove(f);
+            return 0;
+        } else {
+            return 0;
+        }
+    }
+    if (f->framing == FRAME_LENGTH) {
+        if (end < f->response_len) return 0;
+        if (end > f->response_len) { // Лишние байты после ответа - соединению доверять нельзя
+            f->keep_alive = 0;
+            *len = f->response_len - start;
+        }
+        return 1;
+    }
+    if (f->framing == FRAME_CHUNKED) {
+        size_t body = start > f->header_len ? start : f->header_len; // Начало тела в этой порции
+        if (body >= end) return 0;
+        ssize_t used = chunked_feed(f, data + (body - start), end - body);
+        if (used < 0) {
+            logger(ERROR, "Malformed chunked response from %s", f->host);
+            return -1;
+        }
+        if (f->chunk != CHUNK_DONE) return 0;
+        if (body + used < end) {
+            f->keep_alive = 0;
+            *len = body + used - start;
+        }
+        return 1;
+    }
+    return 0; // FRAME_CLOSE: ждём закрытия соединения
+}
+
+// Соединение из пула оказалось закрытым сервером до ответа: повторяем запрос через новое
+static int fetch_retry(fetch *f) {
+    if (!f->reused || f->size) return 0;
+    logger(INFO, "Pooled connection to %s:%d went stale, reconnecting", f->host, f->port);
+    event_watcher_close(f->loop, &f->upstream);
+    f->reused = 0;
+    f->request_sent = 0;
+    fetch_connect(f);
+    return 1;
+}
+
+// Ошибка до первого байта ответа узла-владельца: запрос повторяется у сервера-источника.
+// unreachable - узел не отвечает вовсе, и его ключи на время уходят соседям по кольцу
+static void fetch_fail(fetch *f, int unreachable) {
+    if (!f->peer || f->size) {
+        fetch_finish(f, -1);
+        return;
+    }
+    logger(WARNING, "Peer %s:%d failed to serve %s, fetching from origin", f->host, f->port, f->url);
+    metrics_add(METRIC_PEER_FAILURES, 1);
+    if (unreachable) peer_failed(f->peer);
+    f->peer = NULL;
+    event_watcher_close(f->loop, &f->upstream);
+    f->reused = 0;
+    fetch_begin(f);
+}
+
+// Некэшируемый ответ единственному читателю из этого же цикла дальше идёт через splice, минуя кольцо.
+// 1 - сокет передан читателю, -1 - ждём, пока читатель заберёт уже полученное, 0 - читаем как обычно
+static int fetch_try_relay(fetch *f) {
+    if (f->caching || f->not_modified || (f->framing != FRAME_LENGTH && f->framing != FRAME_CLOSE)) return 0;
+    if (f->framing == FRAME_LENGTH && f->response_len - f->size < FETCH_RELAY_MIN) return 0; // Короткий остаток проще дочитать
+    int ready = 0;
+    pthread_mutex_lock(&f->lock); // Залочить мьютекс загрузки
+    fetch_reader *reader = f->readers;
+    if (reader && !reader->next && reader->loop == f->loop) {
+        ready = __atomic_load_n(&reader->offset, __ATOMIC_SEQ_CST) == f->size ? 1 : -1;
+        if (ready < 0) { // Ставим паузу и перепроверяем, как в fetch_trim
+            __atomic_store_n(&f->paused, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&reader->offset, __ATOMIC_SEQ_CST) == f->size) {
+                __atomic_store_n(&f->paused, 0, __ATOMIC_SEQ_CST);
+                ready = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&f->lock); // Разлочить мьютекс
+    if (ready < 0) {
+        event_watcher_set(f->loop, &f->upstream, 0); // Продолжим, когда читатель догонит
+        return -1;
+    }
+    if (!ready) return 0;
+    f->relay_left = f->framing == FRAME_LENGTH ? f->response_len - f->size : FETCH_RELAY_UNTIL_CLOSE;
+    f->relay_fd = event_watcher_detach(f->loop, &f->upstream);
+    logger(INFO, "Relaying rest of %s with splice", f->url);
+    fetch_finish(f, 1); // Для загрузки ответ завершён, остальное читатель берёт из сокета сам
+    return 1;
+}
+
+static void fetch_read(fetch *f) {
+    size_t received = 0;
+    for (int reads = 0; reads < FETCH_READS_PER_EVENT; reads++) {
+        int relay = f->framing != FRAME_UNKNOWN ? fetch_try_relay(f) : 0;
+        if (relay > 0) return;
+        if (relay < 0) break;
+        if (f->size == f->nchunks * CACHE_CHUNK_SIZE) { // Последний кусок заполнен, нужен новый
+            if (f->caching && f->size >= f->limit) stop_caching(f);
+            if (!f->caching) {
+                int room = fetch_trim(f);
+                if (room < 0) {
+                    logger(INFO, "No readers left, aborting fetch of %s", f->url);
+                    fetch_finish(f, -1);
+                    return;
+                }
+                if (!room) { // Ждём, пока самый медленный читатель продвинется
+                    event_watcher_set(f->loop, &f->upstream, 0);
+                    break;
+                }
+            }
+            char *chunk = slab_alloc(CACHE_CHUNK_SIZE);
+            if (!chunk) {
+                logger(ERROR, "Failed to allocate response chunk");
+                fetch_finish(f, -1);
+                return;
+            }
+            f->ring[f->nchunks % f->ring_size] = chunk;
+            f->nchunks++;
+        }
+        size_t used = f->size - (f->nchunks - 1) * CACHE_CHUNK_SIZE;
+        char *dst = f->ring[(f->nchunks - 1) % f->ring_size] + used;
+        size_t want = CACHE_CHUNK_SIZE - used;
+        if (f->framing == FRAME_LENGTH && f->response_len - f->size < want) want = f->response_len - f->size; // Не читаем дальше ответа
+        ssize_t bytes_received = recv(f->upstream.fd, dst, want, 0);
+        if (bytes_received > 0) {
+            metrics_add(METRIC_BYTES_FETCHED, bytes_received);
+            size_t len = bytes_received;
+            int done = fetch_parse(f, dst, &len);
+            if (done < 0) {
+                fetch_finish(f, -1);
+                return;
+            }
+            f->size += len;
+            if (f->framing != FRAME_UNKNOWN && !f->not_modified) {
+                __atomic_store_n(&f->visible, f->size, __ATOMIC_RELEASE); // Публикуем данные читателям
+            }
+            received += len;
+            if (done) {
+                fetch_finish(f, 1);
+                return;
+            }
+            continue;
+        }
+        if (bytes_received == 0) {
+            if (f->framing == FRAME_CLOSE) { // Ответ без длины закончился вместе с соединением
+                fetch_finish(f, 1);
+                return;
+            }
+            if (fetch_retry(f)) return;
+            logger(ERROR, "Server %s closed connection before end of response", f->host);
+            fetch_fail(f, 0);
+            return;
+        }
+        if (errno == EAGAIN) break; // Данных от сервера пока нет
+        if (fetch_retry(f)) return;
+        logger(ERROR, "Error receiving data from server: %s", f->host);
+        fetch_fail(f, 0);
+        return;
+    }
+    if (received) notify_readers(f);
+}
+
+static void fetch_resume_task(void *arg) {
+    fetch *f = (fetch *)arg;
+    if (f->state == FETCH_READ) {
+        event_watcher_set(f->loop, &f->upstream, EPOLLIN);
+        fetch_read(f);
+    }
+    fetch_release(f);
+}
+
+static void fetch_write(fetch *f) {
+    while (f->request_sent < f->request_len) {
+        ssize_t sent = send(f->upstream.fd, f->request + f->request_sent, f->request_len - f->request_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EAGAIN) {
+            event_watcher_set(f->loop, &f->upstream, EPOLLOUT);
+            return;
+        }
+        if (sent <= 0) {
+            if (fetch_retry(f)) return;
+            logger(ERROR, "Failed to send request to server: %s", f->host);
+            fetch_fail(f, 0);
+            return;
+        }
+        f->request_sent += sent;
+    }
+    f->state = FETCH_READ; // Запрос отправлен, дальше читаем ответ
+    event_watcher_set(f->loop, &f->upstream, EPOLLIN);
+}
+
+// Ошибки подключения, после которых стоит попробовать следующий адрес сервера
+static int connect_retriable(int error) {
+    return error == ECONNREFUSED || error == ENETUNREACH || error == EHOSTUNREACH;
+}
+
+// Подключение к очередному адресу сервера; недоступные адреса пропускаются, пока они есть
+static void fetch_connect_next(fetch *f) {
+    while (f->address < f->addresses.count) {
+        const resolver_address *address = &f->addresses.addresses[f->address++];
+        int server_socket = socket(address->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (server_socket < 0) {
+            logger(ERROR, "Failed to create server socket");
+            fetch_finish(f, -1);
+            return;
+        }
+        event_watcher_init(&f->upstream, server_socket, on_upstream_event, f);
+        logger(INFO, "Connecting to server %s:%d", f->host, f->port);
+        // Неблокирующее подключение завершится событием готовности к записи
+        if (connect(server_socket, (const struct sockaddr *)&address->addr, address->len) < 0) {
+            if (errno == EINPROGRESS) {
+                f->state = FETCH_CONNECT;
+                event_watcher_set(f->loop, &f->upstream, EPOLLOUT);
+                return;
+            }
+            int error = errno;
+            event_watcher_close(f->loop, &f->upstream);
+            if (connect_retriable(error)) continue;
+            break;
+        }
+        metrics_observe(STAGE_CONNECT, metrics_now() - f->stage_start);
+        f->state = FETCH_WRITE;
+        fetch_write(f);
+        return;
+    }
+    logger(ERROR, "Failed to connect to server: %s", f->host);
+    fetch_fail(f, 1);
+}
+
+// Имя сервера разрешено, вызывается в цикле загрузки
+static void on_resolved(void *arg, const resolver_result *result) {
+    fetch *f = (fetch *)arg;
+    long long now = metrics_now();
+    metrics_observe(STAGE_DNS, now - f->stage_start);
+    if (!result) {
+        fetch_fail(f, 1);
+        return;
+    }
+    f->stage_start = now;
+    f->addresses = *result;
+    f->address = 0;
+    fetch_connect_next(f);
+}
+
+static void fetch_connect(fetch *f) {
+    logger(INFO, "Resolving host: %s", f->host);
+    f->state = FETCH_RESOLVE;
+    f->stage_start = metrics_now();
+    resolve_async(f->loop, f->host, f->port, on_resolved, f); // Из кэша имён сразу, иначе без блокировки цикла
+}
+
+// Условные заголовки по валидаторам устаревшего объекта
+static size_t conditional_headers(fetch *f, char *out, size_t size) {
+    http_message stored;
+    if (!f->stale || stale_headers(f, &stored) < 0) return 0;
+    size_t len = 0;
+    const http_slice *etag = http_header_find(&stored, "ETag");
+    const http_slice *modified = http_header_find(&stored, "Last-Modified");
+    if (etag && etag->len < FETCH_VALIDATOR_SIZE) {
+        len += snprintf(out + len, size - len, "If-None-Match: %.*s\r\n", (int)etag->len, etag->data);
+    }
+    if (modified && modified->len < FETCH_VALIDATOR_SIZE) {
+        len += snprintf(out + len, size - len, "If-Modified-Since: %.*s\r\n", (int)modified->len, modified->data);
+    }
+    return len;
+}
+
+static void fetch_begin(fetch *f) {
+    // Запрос к серверу если данных нет в кеше: URL делится на хост с портом и путь без копирования во временные буферы
+    if (strncasecmp(f->url, "http://", 7) != 0) {
+        logger(INFO, "Unsupported URL: %s", f->url);
+        fetch_finish(f, -1);
+        return;
+    }
+    const char *host_start = f->url + 7;
+    const char *path = strchr(host_start, '/');
+    size_t authority_len = path ? (size_t)(path - host_start) : strlen(host_start);
+    if (!path) path = "/"; // Путь по умолчанию, если в URL его нет
+    if (!authority_len || authority_len >= HOST_SIZE) {
+        logger(INFO, "Unsupported URL: %s", f->url);
+        fetch_finish(f, -1);
+        return;
+    }
+    char authority[HOST_SIZE]; // Хост с необязательным портом
+    memcpy(authority, host_start, authority_len);
+    authority[authority_len] = '\0';
+    f->port = 80; // Порт по умолчанию
+    char *port = NULL;
+    if (authority[0] == '[') { // IPv6 адрес в квадратных скобках
+        char *close = strchr(authority, ']');
+        if (!close) {
+            logger(INFO, "Unsupported URL: %s", f->url);
+            fetch_finish(f, -1);
+            return;
+        }
+        *close = '\0';
+        strcpy(f->host, authority + 1);
+        *close = ']';
+        if (close[1] == ':') port = close + 2;
+    } else {
+        strcpy(f->host, authority);
+        char *colon = strchr(f->host, ':');
+        if (colon) {
+            *colon = '\0';
+            port = colon + 1;
+        }
+    }
+    if (port) {
+        f->port = atoi(port);
+        if (f->port <= 0 || f->port > 65535) {
+            logger(INFO, "Unsupported URL: %s", f->url);
+            fetch_finish(f, -1);
+            return;
+        }
+    }
+    // Формируем запрос к серверу, соединение остаётся открытым для следующих запросов
+    if (f->peer) { // Владельцу URL - запрос в форме прокси, ответ он отдаст из своего кэша
+        strcpy(f->host, f->peer->host);
+        f->port = f->peer->port;
+        f->request_len = snprintf(f->request, FETCH_REQUEST_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n" PEER_HEADER ": 1\r\n",
+                                  f->url, authority);
+    } else {
+        f->request_len = snprintf(f->request, FETCH_REQUEST_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n", path, authority);
+    }
+    f->request_len += conditional_headers(f, f->request + f->request_len, FETCH_REQUEST_SIZE - f->request_len);
+    f->request_len += snprintf(f->request + f->request_len, FETCH_REQUEST_SIZE - f->request_len, "%s", f->headers);
+    f->request_len += snprintf(f->request + f->request_len, FETCH_REQUEST_SIZE - f->request_len, "\r\n");
+    f->request_sent = 0;
+    int pooled = upstream_acquire(f->host, f->port);
+    if (pooled >= 0) {
+        logger(INFO, "Reusing pooled connection to %s:%d", f->host, f->port);
+        f->reused = 1;
+        metrics_add(METRIC_UPSTREAM_REUSED, 1);
+        event_watcher_init(&f->upstream, pooled, on_upstream_event, f);
+        f->state = FETCH_WRITE;
+        fetch_write(f);
+        return;
+    }
+    fetch_connect(f);
+}
+
+static void on_upstream_event(event_watcher *watcher, uint32_t events) {
+    fetch *f = (fetch *)watcher->data;
+    switch (f->state) {
+        case FETCH_CONNECT: {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error || (events & EPOLLERR)) {
+                event_watcher_close(f->loop, &f->upstream);
+                if (connect_retriable(error)) { // Этот адрес недоступен - пробуем следующий
+                    fetch_connect_next(f);
+                    return;
+                }
+                logger(ERROR, "Failed to connect to server: %s", f->host);
+                fetch_fail(f, 1);
+                return;
+            }
+            metrics_observe(STAGE_CONNECT, metrics_now() - f->stage_start);
+            logger(INFO, "Connected to server, sending GET request");
+            f->state = FETCH_WRITE;
+            fetch_write(f);
+            break;
+        }
+        case FETCH_WRITE:
+            fetch_write(f);
+            break;
+        case FETCH_READ:
+            fetch_read(f);
+            break;
+        default:
+            break;
+    }
+}
+
+static void attach_reader(fetch *f, fetch_reader *reader) {
+    reader->offset = 0;
+    reader->notify_pending = 0;
+    pthread_mutex_lock(&f->lock); // Залочить мьютекс загрузки
+    reader->next = f->readers;
+    f->readers = reader;
+    pthread_mutex_unlock(&f->lock); // Разлочить мьютекс
+}
+
+// Присоединение к загрузке URL или запуск новой в цикле loop.
+// stale - устаревший объект для условного запроса; без читателя загрузка фоновая и не возвращается.
+// headers - строки заголовков клиента для сервера, только вместе с FETCH_PRIVATE
+fetch *fetch_start(cache *cache_ptr, event_loop *loop, const char *url, fetch_reader *reader, cache_object *stale, int flags, const char *headers) {
+    pthread_once(&table_once, table_setup);
+    uint64_t hash = cache_hash(url);
+    const peer_node *owner = flags & FETCH_ORIGIN ? NULL : peer_owner(hash);
+    if (owner) { // Копию хранит владелец: здесь ответ только передаётся клиенту
+        if (!reader) return NULL; // Фоновая загрузка в чужой кэш бессмысленна
+        flags |= FETCH_PRIVATE;
+        stale = NULL;
+    }
+    fetch_table_shard *shard = table_shard_for(hash);
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    for (fetch *f = shard->head; f && !(flags & FETCH_PRIVATE); f = f->next) {
+        if (f->hash == hash && strcmp(f->url, url) == 0) { // Такой URL уже загружается
+            if (!reader) { // Фоновое обновление уже идёт
+                pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+                return NULL;
+            }
+            __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+            attach_reader(f, reader);
+            pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+            logger(INFO, "Joined in-flight fetch for URL: %s", url);
+            metrics_add(METRIC_COALESCED, 1);
+            return f;
+        }
+    }
+    fetch *f = (fetch *)calloc(1, sizeof(fetch));
+    size_t limit = cache_max_object(cache_ptr);
+    size_t ring_size = limit / CACHE_CHUNK_SIZE + 2; // Кэшируемый ответ целиком помещается в кольцо
+    if (f) f->ring = (char **)calloc(ring_size, sizeof(char *));
+    if (!f || !f->ring) {
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        logger(ERROR, "Failed to allocate fetch");
+        free(f);
+        return NULL;
+    }
+    strncpy(f->url, url, URL_SIZE - 1);
+    if (headers && strlen(headers) < FETCH_HEADERS_SIZE) strcpy(f->headers, headers);
+    f->hash = hash;
+    f->refcount = reader ? 2 : 1; // Сторона сервера и первый читатель
+    f->cache = cache_ptr;
+    f->loop = loop;
+    f->ring_size = ring_size;
+    f->limit = limit;
+    f->caching = !(flags & FETCH_PRIVATE);
+    f->joinable = f->caching;
+    f->stale = stale ? cache_object_retain(stale) : NULL;
+    f->relay_fd = -1;
+    f->peer = owner;
+    http_reset(&f->response);
+    event_watcher_init(&f->upstream, -1, on_upstream_event, f);
+    pthread_mutex_init(&f->lock, NULL); // Инициализация мьютекса
+    if (reader) attach_reader(f, reader);
+    if (f->joinable) {
+        f->next = shard->head;
+        shard->head = f;
+    }
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+    if (!reader) logger(INFO, "Fetching in background: %s", url);
+    if (owner) {
+        logger(INFO, "Fetching %s from peer %s:%d", url, owner->host, owner->port);
+        metrics_add(METRIC_PEER_FETCHES, 1);
+    }
+    fetch_begin(f);
+    return reader ? f : NULL; // На фоновую загрузку вызывающий ссылки не держит
+}
+
+void fetch_detach(fetch *f, fetch_reader *reader) {
+    pthread_mutex_lock(&f->lock); // Залочить мьютекс загрузки
+    for (fetch_reader **link = &f->readers; *link; link = &(*link)->next) {
+        if (*link == reader) {
+            *link = reader->next;
+            break;
+        }
+    }
+    int last = f->readers == NULL;
+    pthread_mutex_unlock(&f->lock); // Разлочить мьютекс
+    if (last && !__atomic_load_n(&f->status, __ATOMIC_ACQUIRE)) { // Некэшируемую загрузку без читателей нужно прервать
+        __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+        if (event_loop_post(f->loop, fetch_resume_task, f) < 0) fetch_release(f);
+    }
+    fetch_release(f);
+}
+
+int fetch_status(fetch *f) {
+    return __atomic_load_n(&f->status, __ATOMIC_ACQUIRE);
+}
+
+// Знает ли клиент длину ответа; проверяется после завершения загрузки
+int fetch_delimited(fetch *f) {
+    return f->framing != FRAME_CLOSE;
+}
+
+// Длина заголовков ответа, 0 пока они не разобраны; проверяется после того, как читателю видны данные
+size_t fetch_head_len(fetch *f) {
+    return f->header_len;
+}
+
+// Устаревший объект, подтверждённый сервером; проверяется после завершения загрузки
+cache_object *fetch_stale(fetch *f) {
+    return f->not_modified ? f->stale : NULL;
+}
+
+// Сокет сервера с остатком ответа для splice, владение переходит читателю; проверяется после завершения загрузки
+int fetch_relay(fetch *f, size_t *left) {
+    int fd = f->relay_fd;
+    f->relay_fd = -1;
+    *left = f->relay_left;
+    return fd;
+}
+
+// Читатель закончил передачу: целиком прочитанный ответ оставляет соединение пригодным для пула
+void fetch_relay_done(fetch *f, int fd, int complete) {
+    if (fd < 0) return;
+    if (complete && f->keep_alive) upstream_release(f->host, f->port, fd);
+    else close(fd);
+}
+
+// Данные, доступные читателю начиная со смещения
+int fetch_iov(fetch *f, size_t offset, struct iovec *iov, int max) {
+    size_t size = __atomic_load_n(&f->visible, __ATOMIC_ACQUIRE);
+    int count = 0;
+    while (count < max && offset < size) {
+        size_t skip = offset % CACHE_CHUNK_SIZE;
+        size_t len = CACHE_CHUNK_SIZE - skip;
+        if (len > size - offset) len = size - offset;
+        iov[count].iov_base = f->ring[(offset / CACHE_CHUNK_SIZE) % f->ring_size] + skip;
+        iov[count].iov_len = len;
+        offset += len;
+        count++;
+    }
+    return count;
+}
+
+void fetch_consumed(fetch *f, fetch_reader *reader, size_t offset) {
+    __atomic_store_n(&reader->offset, offset, __ATOMIC_SEQ_CST);
+    // Загрузка стоит из-за окна - будим её, если никто не сделал этого раньше
+    if (__atomic_load_n(&f->paused, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&f->paused, 0, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+        if (event_loop_post(f->loop, fetch_resume_task, f) < 0) fetch_release(f);
+    }
+}
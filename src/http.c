@@ -0,0 +1,344 @@
+#include "http.h"
+
+void http_reset(http_message *message) {
+    message->state = HTTP_START_LINE;
+    message->scanned = 0;
+    message->line = 0;
+    message->head_len = 0;
+    message->version = 0;
+    message->status = 0;
+    message->nheaders = 0;
+}
+
+// Поиск конца строки блоками по 32 или 16 байт, хвост - через memchr
+static const char *find_eol(const char *p, const char *end) {
+#ifdef __AVX2__
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), lf32));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), lf));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    return end > p ? (const char *)memchr(p, '\n', end - p) : NULL;
+}
+
+// "HTTP/x.y" в версию 10 или 11, -1 если это не HTTP/1.x
+static int parse_version(const char *text, size_t len) {
+    if (len != 8 || memcmp(text, "HTTP/1.", 7) != 0) return -1;
+    if (text[7] == '0') return 10;
+    if (text[7] == '1') return 11;
+    return -1;
+}
+
+// Строка запроса: метод, цель и версия через одиночные пробелы
+static int request_line(http_message *message, const char *line, size_t len) {
+    const char *end = line + len;
+    const char *space = (const char *)memchr(line, ' ', len);
+    if (!space || space == line) return -1;
+    const char *target = space + 1;
+    const char *space2 = (const char *)memchr(target, ' ', end - target);
+    if (!space2 || space2 == target) return -1;
+    message->method = (http_slice){ line, (size_t)(space - line) };
+    message->target = (http_slice){ target, (size_t)(space2 - target) };
+    message->version = parse_version(space2 + 1, end - space2 - 1);
+    return message->version < 0 ? -1 : 0;
+}
+
+// Строка статуса: версия, трёхзначный код и необязательное пояснение
+static int status_line(http_message *message, const char *line, size_t len) {
+    if (len < 12 || line[8] != ' ') return -1;
+    message->version = parse_version(line, 8);
+    if (message->version < 0) return -1;
+    int status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9') return -1;
+        status = status * 10 + line[i] - '0';
+    }
+    if (len > 12 && line[12] != ' ') return -1;
+    message->status = status;
+    message->reason = len > 13 ? (http_slice){ line + 13, len - 13 } : (http_slice){ line + len, 0 };
+    return 0;
+}
+
+static int header_line(http_message *message, const char *line, size_t len) {
+    if (line[0] == ' ' || line[0] == '\t') return -1; // Перенос заголовков на новую строку устарел и опасен
+    const char *colon = (const char *)memchr(line, ':', len);
+    if (!colon || colon == line || message->nheaders == HTTP_MAX_HEADERS) return -1;
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    http_header *header = &message->headers[message->nheaders++];
+    header->name = (http_slice){ line, (size_t)(colon - line) };
+    header->value = (http_slice){ value, (size_t)(end - value) };
+    return 0;
+}
+
+// Разбор по целым строкам, начиная с места остановки: 1 - заголовки готовы, 0 - нужны данные, -1 - ошибка
+static int http_parse(http_message *message, const char *buffer, size_t len, int (*start)(http_message *, const char *, size_t)) {
+    while (message->state != HTTP_DONE) {
+        const char *eol = find_eol(buffer + message->scanned, buffer + len);
+        if (!eol) {
+            message->scanned = len;
+            return 0;
+        }
+        size_t end = eol - buffer;
+        const char *line = buffer + message->line;
+        size_t line_len = end - message->line;
+        if (line_len && line[line_len - 1] == '\r') line_len--;
+        message->scanned = message->line = end + 1;
+        if (message->state == HTTP_START_LINE) {
+            if (!line_len) continue; // Пустые строки перед запросом допускаются
+            if (start(message, line, line_len) < 0) return -1;
+            message->state = HTTP_HEADERS;
+        } else if (!line_len) {
+            message->head_len = end + 1;
+            message->state = HTTP_DONE;
+        } else if (header_line(message, line, line_len) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int http_parse_request(http_message *message, const char *buffer, size_t len) {
+    return http_parse(message, buffer, len, request_line);
+}
+
+int http_parse_response(http_message *message, const char *buffer, size_t len) {
+    return http_parse(message, buffer, len, status_line);
+}
+
+// Совпадает ли часть буфера со строкой, без учёта регистра
+int http_slice_is(const http_slice *slice, const char *text) {
+    size_t len = strlen(text);
+    return slice->len == len && strncasecmp(slice->data, text, len) == 0;
+}
+
+// Первое значение заголовка name или NULL
+const http_slice *http_header_find(const http_message *message, const char *name) {
+    for (int i = 0; i < message->nheaders; i++) {
+        if (http_slice_is(&message->headers[i].name, name)) return &message->headers[i].value;
+    }
+    return NULL;
+}
+
+// Есть ли token в списках через запятую во всех заголовках name
+int http_header_token(const http_message *message, const char *name, const char *token) {
+    size_t token_len = strlen(token);
+    for (int i = 0; i < message->nheaders; i++) {
+        if (!http_slice_is(&message->headers[i].name, name)) continue;
+        const char *p = message->headers[i].value.data;
+        const char *end = p + message->headers[i].value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+            const char *item = p;
+            while (p < end && *p != ',' && *p != ';') p++; // Параметры после ';' не важны
+            const char *item_end = p;
+            while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) item_end--;
+            if ((size_t)(item_end - item) == token_len && strncasecmp(item, token, token_len) == 0) return 1;
+            while (p < end && *p != ',') p++;
+        }
+    }
+    return 0;
+}
+
+// Content-Length: 1 - найден, 0 - отсутствует, -1 - неверный или противоречивый
+int http_content_length(const http_message *message, size_t *length) {
+    int found = 0;
+    for (int i = 0; i < message->nheaders; i++) {
+        if (!http_slice_is(&message->headers[i].name, "Content-Length")) continue;
+        const http_slice *value = &message->headers[i].value;
+        if (!value->len) return -1;
+        size_t parsed = 0;
+        for (size_t j = 0; j < value->len; j++) {
+            char c = value->data[j];
+            if (c < '0' || c > '9' || parsed > (SIZE_MAX - 9) / 10) return -1;
+            parsed = parsed * 10 + (size_t)(c - '0');
+        }
+        if (found && parsed != *length) return -1;
+        *length = parsed;
+        found = 1;
+    }
+    return found;
+}
+
+// HTTP/1.1 держит соединение, пока не сказано close, HTTP/1.0 - только с keep-alive
+int http_keep_alive(const http_message *message) {
+    if (http_header_token(message, "Connection", "close")) return 0;
+    return message->version >= 11 || http_header_token(message, "Connection", "keep-alive");
+}
+
+// Директива Cache-Control: 1 - есть (value получает число после '=', если оно указано), 0 - нет
+int http_cache_directive(const http_message *message, const char *directive, long *value) {
+    size_t len = strlen(directive);
+    for (int i = 0; i < message->nheaders; i++) {
+        if (!http_slice_is(&message->headers[i].name, "Cache-Control")) continue;
+        const char *p = message->headers[i].value.data;
+        const char *end = p + message->headers[i].value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+            const char *name = p;
+            while (p < end && *p != ',' && *p != '=' && *p != ' ') p++;
+            int match = (size_t)(p - name) == len && strncasecmp(name, directive, len) == 0;
+            long number = -1;
+            if (p < end && *p == '=') {
+                p++;
+                if (p < end && *p == '"') p++; // Значение в кавычках
+                if (p < end && *p >= '0' && *p <= '9') {
+                    number = 0;
+                    while (p < end && *p >= '0' && *p <= '9') {
+                        if (number < 1000000000L) number = number * 10 + (*p - '0');
+                        p++;
+                    }
+                }
+            }
+            while (p < end && *p != ',') p++;
+            if (match) {
+                if (value) *value = number;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int month_of(const char *name) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    for (int i = 0; i < 12; i++) {
+        if (strncmp(months + i * 3, name, 3) == 0) return i;
+    }
+    return -1;
+}
+
+// Дата HTTP в форматах IMF-fixdate, RFC 850 и asctime; -1 если не разобрана
+time_t http_date(const http_slice *value) {
+    char text[64];
+    if (!value || value->len >= sizeof(text)) return -1;
+    memcpy(text, value->data, value->len);
+    text[value->len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char month[4];
+    int year;
+    if (sscanf(text, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, month, &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6 ||
+        sscanf(text, "%*[A-Za-z], %d-%3s-%d %d:%d:%d GMT", &tm.tm_mday, month, &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6 ||
+        sscanf(text, "%*3s %3s %d %d:%d:%d %d", month, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &year) == 6) {
+        month[3] = '\0';
+        tm.tm_mon = month_of(month);
+        if (year < 100) year += year < 70 ? 2000 : 1900; // Двузначный год RFC 850
+        tm.tm_year = year - 1900;
+        if (tm.tm_mon < 0) return -1;
+        return timegm(&tm);
+    }
+    return -1;
+}
+
+// Коды, которые можно кэшировать без явного срока (RFC 9110, 15.1)
+static int heuristic_status(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return status != 206; // Частичные ответы не храним
+        default:
+            return 0;
+    }
+}
+
+// Срок свежести ответа: s-maxage, max-age, Expires, затем 10% от возраста Last-Modified или default_ttl
+void http_response_freshness(const http_message *response, time_t now, long default_ttl, http_freshness *out) {
+    long value = -1;
+    memset(out, 0, sizeof(*out));
+    out->validators = http_header_find(response, "ETag") || http_header_find(response, "Last-Modified");
+    if (http_cache_directive(response, "no-store", NULL) || http_cache_directive(response, "private", NULL)) return;
+    time_t date = http_date(http_header_find(response, "Date"));
+    time_t base = date >= 0 ? date : now;
+    const http_slice *expires = http_header_find(response, "Expires");
+    if ((http_cache_directive(response, "s-maxage", &value) || http_cache_directive(response, "max-age", &value)) && value >= 0) {
+        out->lifetime = value;
+        out->explicit_ttl = 1;
+    } else if (expires) {
+        time_t when = http_date(expires);
+        out->lifetime = when >= 0 && when > base ? (long)(when - base) : 0; // Неверная дата означает «уже устарел»
+        out->explicit_ttl = 1;
+    } else if (heuristic_status(response->status)) {
+        time_t modified = http_date(http_header_find(response, "Last-Modified"));
+        if (modified >= 0 && modified < base) {
+            out->lifetime = (long)(base - modified) / 10;
+            if (out->lifetime > HTTP_HEURISTIC_MAX) out->lifetime = HTTP_HEURISTIC_MAX;
+        } else {
+            out->lifetime = default_ttl;
+        }
+    }
+    if (!out->explicit_ttl && !heuristic_status(response->status)) return;
+    if (out->explicit_ttl && !heuristic_status(response->status) && response->status != 302 && response->status != 307) return;
+    if (http_cache_directive(response, "no-cache", NULL)) out->lifetime = 0; // Хранить можно, отдавать только после проверки
+    // Возраст ответа: по заголовку Age или по расхождению Date с нашими часами
+    long age = 0;
+    const http_slice *age_header = http_header_find(response, "Age");
+    if (age_header) age = strtol(age_header->data, NULL, 10);
+    if (date >= 0 && now - date > age) age = (long)(now - date);
+    out->lifetime = out->lifetime > age ? out->lifetime - age : 0;
+    if (!http_cache_directive(response, "must-revalidate", NULL) && !http_cache_directive(response, "proxy-revalidate", NULL) &&
+        http_cache_directive(response, "stale-while-revalidate", &value) && value > 0) {
+        out->stale_while_revalidate = value;
+    }
+    // Без срока, фонового обновления и способа проверить ответ хранить его бесполезно
+    out->storable = out->lifetime > 0 || out->stale_while_revalidate > 0 || out->validators;
+}
+
+// Десятичное число без знака: количество цифр или -1 при переполнении
+static int parse_number(const char **p, const char *end, size_t *value) {
+    int digits = 0;
+    *value = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (*value > (SIZE_MAX - 9) / 10) return -1;
+        *value = *value * 10 + (size_t)(**p - '0');
+        (*p)++;
+        digits++;
+    }
+    return digits;
+}
+
+// Range: bytes=... для тела длины length (RFC 9110, 14.1.2). Возвращает число выполнимых диапазонов:
+// 0 - ни одного, ответ 416; -1 - заголовок не разобран или диапазонов больше max, тогда отдаётся весь ответ
+int http_parse_ranges(const http_slice *value, size_t length, http_range *ranges, int max) {
+    const char *p = value->data;
+    const char *end = p + value->len;
+    if (value->len < 6 || strncasecmp(p, "bytes=", 6) != 0) return -1;
+    p += 6;
+    int count = 0, specs = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        size_t first, last;
+        int has_first = parse_number(&p, end, &first);
+        if (has_first < 0 || p == end || *p != '-') return -1;
+        p++;
+        int has_last = parse_number(&p, end, &last);
+        if (has_last < 0) return -1;
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if ((p < end && *p != ',') || (!has_first && !has_last) || (has_first && has_last && last < first)) return -1;
+        specs++;
+        if (!has_first) { // Суффикс: последние last байт
+            if (!last || !length) continue;
+            first = last >= length ? 0 : length - last;
+            last = length - 1;
+        } else {
+            if (first >= length) continue; // Диапазон за концом тела невыполним
+            if (!has_last || last >= length) last = length - 1;
+        }
+        if (count == max) return -1;
+        ranges[count].first = first;
+        ranges[count].last = last;
+        count++;
+    }
+    return specs ? count : -1;
+}
@@ -1,27 +1,165 @@
-#include "logging.h"
-
-// Имена уровней логов
-const char *log_level_names[] = { "INFO", "DEBUG", "WARNING", "ERROR", "RESET" };
-
-// Цвета для уровней логов
-const char *log_level_colors[] = { COLOR_INFO, COLOR_DEBUG, COLOR_WARNING, COLOR_ERROR, COLOR_RESET };
-
-void logger(log_level_t level, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    time_t now = time(NULL); // Получение текущего времени
-    struct tm *local_time = localtime(&now);
-
-    // Вывод логов с временной меткой, уровнем и идентификатором потока
-    fprintf(stdout, "%s[%02d:%02d:%02d] [%s] [Thread %lu] ",
-        log_level_colors[level], // цвет
-        local_time->tm_hour, // часы
-        local_time->tm_min, // минуты
-        local_time->tm_sec, // секунды
-        log_level_names[level], // уровень
-        pthread_self()
-    );
-    vfprintf(stdout, format, args); // Вывод сообщения
-    fprintf(stdout, "%s\n", COLOR_RESET); // Перенос строки и возврат цвета в исходный
-    va_end(args);
-}
+#include "logging.h"
+
+// Имена уровней логов
+const char *log_level_names[] = { "DEBUG", "INFO", "WARNING", "ERROR", "RESET" };
+
+// Цвета для уровней логов
+const char *log_level_colors[] = { COLOR_DEBUG, COLOR_INFO, COLOR_WARNING, COLOR_ERROR, COLOR_RESET };
+
+log_level_t log_min_level = INFO;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER; // Мьютекс регистрации колец
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER; // Мьютекс вывода
+static log_ring *rings; // Кольца всех писавших потоков
+static __thread log_ring *thread_ring; // Кольцо текущего потока
+static time_t log_now; // Время, обновляемое писателем, вместо time() на каждый вызов
+static FILE *output; // Куда пишутся логи
+static int colors = 1; // Цвета ANSI только для вывода в терминал
+static int stopping; // Писатель дочищает кольца и завершается
+static pthread_t writer;
+
+static void *log_writer(void *);
+
+static void log_shutdown() {
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL); // Писатель выводит всё накопленное
+}
+
+static void log_setup() {
+    output = stdout;
+    log_now = time(NULL);
+    if (pthread_create(&writer, NULL, log_writer, NULL) != 0) {
+        fprintf(stderr, "Failed to create log writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    atexit(log_shutdown);
+}
+
+static log_ring *ring_register() {
+    log_ring *ring;
+    if (posix_memalign((void **)&ring, 64, sizeof(log_ring)) != 0) return NULL;
+    ring->head = ring->tail = 0;
+    ring->dropped = 0;
+    pthread_mutex_lock(&rings_lock); // Залочить мьютекс
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE); // Писатель обходит список без блокировки
+    pthread_mutex_unlock(&rings_lock); // Разлочить мьютекс
+    thread_ring = ring;
+    return ring;
+}
+
+void log_write(log_level_t level, const char *format, ...) {
+    pthread_once(&log_once, log_setup);
+    log_ring *ring = thread_ring ? thread_ring : ring_register();
+    if (!ring) return;
+    size_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS) { // Кольцо полно - не ждём писателя
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_record *record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+    record->level = level;
+    record->time = __atomic_load_n(&log_now, __ATOMIC_RELAXED);
+    record->thread = (unsigned long)pthread_self();
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE); // Публикуем запись писателю
+}
+
+// Буфер писателя, сбрасывается в output целиком
+static char out_buffer[LOG_OUTPUT_BUFFER];
+static size_t out_len;
+
+static void out_flush() {
+    if (out_len) fwrite(out_buffer, 1, out_len, output);
+    out_len = 0;
+}
+
+static void out_line(log_level_t level, time_t when, unsigned long thread, const char *text) {
+    static time_t clock_second = -1; // Время форматируется раз в секунду
+    static char clock_text[16];
+    if (when != clock_second) {
+        struct tm local_time;
+        localtime_r(&when, &local_time);
+        snprintf(clock_text, sizeof(clock_text), "%02d:%02d:%02d", local_time.tm_hour, local_time.tm_min, local_time.tm_sec);
+        clock_second = when;
+    }
+    if (LOG_OUTPUT_BUFFER - out_len < LOG_MESSAGE_SIZE + 128) out_flush();
+    // Вывод логов с временной меткой, уровнем и идентификатором потока
+    int written = snprintf(out_buffer + out_len, LOG_OUTPUT_BUFFER - out_len, "%s[%s] [%s] [Thread %lu] %s%s\n",
+        colors ? log_level_colors[level] : "", // цвет
+        clock_text, // время
+        log_level_names[level], // уровень
+        thread,
+        text, // сообщение
+        colors ? COLOR_RESET : "" // возврат цвета в исходный
+    );
+    if (written > 0) {
+        out_len += (size_t)written < LOG_OUTPUT_BUFFER - out_len ? (size_t)written : LOG_OUTPUT_BUFFER - out_len - 1;
+    }
+}
+
+// Вывод всех накопленных записей, возвращает их количество
+static size_t log_drain() {
+    size_t drained = 0;
+    pthread_mutex_lock(&output_lock); // Залочить мьютекс вывода
+    for (log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            log_record *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+            out_line(record->level, record->time, record->thread, record->text);
+        }
+        drained += tail - ring->head;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE); // Освобождаем записи владельцу
+        size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            char text[64];
+            snprintf(text, sizeof(text), "Dropped %zu log messages", dropped);
+            out_line(WARNING, log_now, 0, text);
+        }
+    }
+    out_flush();
+    if (drained) fflush(output);
+    pthread_mutex_unlock(&output_lock); // Разлочить мьютекс
+    return drained;
+}
+
+static void *log_writer(void *arg) {
+    (void)arg;
+    while (1) {
+        __atomic_store_n(&log_now, time(NULL), __ATOMIC_RELAXED);
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE); // Читаем до обхода, чтобы не потерять последние записи
+        if (log_drain()) continue;
+        if (stop) break;
+        usleep(LOG_IDLE_SLEEP_US);
+    }
+    return NULL;
+}
+
+// Уровень по имени: debug, info, warning или error; -1 для неизвестного
+int log_level_parse(const char *name) {
+    for (int level = DEBUG; level < RESET; level++) {
+        if (strcasecmp(name, log_level_names[level]) == 0) return level;
+    }
+    return -1;
+}
+
+// Вывод в файл: буферизованный, без цветов
+int log_set_file(const char *path) {
+    FILE *file = fopen(path, "a");
+    if (!file) {
+        logger(ERROR, "Failed to open log file: %s", path);
+        return -1;
+    }
+    pthread_once(&log_once, log_setup);
+    setvbuf(file, NULL, _IOFBF, LOG_OUTPUT_BUFFER);
+    pthread_mutex_lock(&output_lock); // Залочить мьютекс вывода
+    output = file;
+    colors = 0;
+    pthread_mutex_unlock(&output_lock); // Разлочить мьютекс
+    return 0;
+}
@@ -1,9 +1,11 @@
-#include "proxy.h"
-
-#define PORT 8080
-
-int main() {
-    int socket = proxy_init(PORT);
-    proxy_start(PORT, socket);
-    return 0;
-}
+#include "proxy.h"
+
+int main(int argc, char **argv) {
+    proxy_block_signals(); // До создания любых потоков, включая поток логов
+    config_parse(argc, argv); // Разбор параметров командной строки
+    log_min_level = config.log_level;
+    if (config.log_file && log_set_file(config.log_file) < 0) exit(EXIT_FAILURE);
+    int socket = proxy_init(config.port);
+    proxy_start(config.port, socket);
+    return 0;
+}
@@ -0,0 +1,283 @@
+#include "metrics.h"
+
+// Имена и описания счётчиков в порядке metric_counter
+static const char *counter_names[METRIC_COUNTERS][2] = {
+    { "proxy_connections_total", "Accepted client connections" },
+    { "proxy_requests_total", "Parsed client requests" },
+    { "proxy_cache_hits_total", "Requests served from the cache" },
+    { "proxy_cache_misses_total", "Requests not found in the cache" },
+    { "proxy_coalesced_total", "Misses that joined an in-flight fetch" },
+    { "proxy_cache_evictions_total", "Entries evicted to fit the cache budget" },
+    { "proxy_cache_expired_total", "Entries removed after expiry" },
+    { "proxy_bytes_served_total", "Response bytes sent to clients" },
+    { "proxy_bytes_fetched_total", "Bytes received from origin servers" },
+    { "proxy_upstream_reused_total", "Fetches sent over a pooled origin connection" },
+    { "proxy_queue_full_total", "Clients rejected because the handoff queue was full" },
+    { "proxy_revalidated_total", "Stale responses confirmed by the origin with 304 Not Modified" },
+    { "proxy_stale_served_total", "Stale responses served while revalidating in the background" },
+    { "proxy_disk_hits_total", "Responses served from the disk cache" },
+    { "proxy_disk_writes_total", "Evicted objects written to the disk cache" },
+    { "proxy_disk_promoted_total", "Objects promoted from the disk cache back to memory" },
+    { "proxy_cache_admission_rejected_total", "New entries the eviction policy refused to admit" },
+    { "proxy_relayed_bytes_total", "Response bytes relayed from origin to client with splice" },
+    { "proxy_range_served_total", "Partial (206) and unsatisfiable (416) responses built from the cache" },
+    { "proxy_client_limited_total", "Clients rejected with 503 for exceeding the per-address connection limit" },
+    { "proxy_accept_paused_total", "Times accepting paused at the connection limit" },
+    { "proxy_client_timeouts_total", "Clients closed for sending a request or accepting a response too slowly" },
+    { "proxy_peer_fetches_total", "Misses fetched from the peer that owns the URL" },
+    { "proxy_peer_failures_total", "Peer fetches that failed and went to the origin instead" },
+};
+
+// Метки этапов в порядке metric_stage
+static const char *stage_names[METRIC_STAGES] = {
+    "queue_wait", "cache_lookup", "dns", "connect", "first_byte", "total",
+};
+
+// Границы ячеек le в микросекундах для вывода в формате Prometheus
+static const long long le_bounds[] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER; // Мьютекс регистрации блоков и показателей
+static metrics_block *blocks; // Блоки всех потоков, писавших метрики
+static __thread metrics_block *thread_block; // Блок текущего потока
+static metrics_gauge gauges[METRICS_MAX_GAUGES];
+static int gauge_count;
+
+// Микросекунды монотонных часов
+long long metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static metrics_block *block_register() {
+    metrics_block *block;
+    if (posix_memalign((void **)&block, 64, sizeof(metrics_block)) != 0) return NULL;
+    memset(block, 0, sizeof(metrics_block));
+    pthread_mutex_lock(&blocks_lock); // Залочить мьютекс
+    block->next = blocks;
+    __atomic_store_n(&blocks, block, __ATOMIC_RELEASE); // Читатель обходит список без блокировки
+    pthread_mutex_unlock(&blocks_lock); // Разлочить мьютекс
+    thread_block = block;
+    return block;
+}
+
+// Увеличение без атомарного сложения: у каждой копии один писатель
+static void bump(uint64_t *value, uint64_t delta) {
+    __atomic_store_n(value, *value + delta, __ATOMIC_RELAXED);
+}
+
+void metrics_add(metric_counter counter, uint64_t delta) {
+    metrics_block *block = thread_block ? thread_block : block_register();
+    if (!block) return;
+    bump(&block->counters[counter], delta);
+}
+
+// Ячейка значения: точно до 16 мкс, дальше 16 ячеек на каждую степень двойки
+static int bucket_of(long long value) {
+    if (value < METRICS_SUB_BUCKETS) return value < 0 ? 0 : (int)value;
+    int shift = 63 - __builtin_clzll((unsigned long long)value);
+    if (shift > METRICS_MAX_SHIFT) return METRICS_BUCKETS - 1;
+    int sub = (int)(value >> (shift - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (shift - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+// Нижняя граница ячейки
+static long long bucket_low(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) return bucket;
+    int shift = bucket / METRICS_SUB_BUCKETS - 1 + METRICS_SUB_BITS;
+    long long sub = bucket % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub) << (shift - METRICS_SUB_BITS);
+}
+
+// Верхняя граница ячейки (не включительно)
+static long long bucket_high(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) return bucket + 1;
+    int shift = bucket / METRICS_SUB_BUCKETS - 1 + METRICS_SUB_BITS;
+    return bucket_low(bucket) + (1LL << (shift - METRICS_SUB_BITS));
+}
+
+void metrics_observe(metric_stage stage, long long usec) {
+    metrics_block *block = thread_block ? thread_block : block_register();
+    if (!block) return;
+    metrics_histogram *histogram = &block->stages[stage];
+    if (usec < 0) usec = 0;
+    bump(&histogram->buckets[bucket_of(usec)], 1);
+    bump(&histogram->sum, (uint64_t)usec);
+    bump(&histogram->count, 1); // Последним, чтобы счётчик не обгонял ячейки
+}
+
+void metrics_gauge_register(const char *name, const char *help, long long (*read)()) {
+    pthread_mutex_lock(&blocks_lock); // Залочить мьютекс
+    if (gauge_count < METRICS_MAX_GAUGES) {
+        gauges[gauge_count].name = name;
+        gauges[gauge_count].help = help;
+        gauges[gauge_count].read = read;
+        gauge_count++;
+    } else {
+        logger(WARNING, "Too many gauges, %s is not exported", name);
+    }
+    pthread_mutex_unlock(&blocks_lock); // Разлочить мьютекс
+}
+
+// Дописывает форматированную строку в буфер, не выходя за его размер
+static void render_append(char *buffer, size_t size, size_t *len, const char *format, ...) {
+    if (*len + 1 >= size) return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + *len, size - *len, format, args);
+    va_end(args);
+    if (written > 0) *len += (size_t)written < size - *len ? (size_t)written : size - *len - 1;
+}
+
+// Текст всех метрик в формате Prometheus, возвращает его длину
+size_t metrics_render(char *buffer, size_t size) {
+    static metrics_histogram merged[METRIC_STAGES]; // Сумма гистограмм всех потоков, вызывается только из потока администрирования
+    uint64_t counters[METRIC_COUNTERS] = { 0 };
+    memset(merged, 0, sizeof(merged));
+    for (metrics_block *block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+        for (int i = 0; i < METRIC_COUNTERS; i++) counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+        for (int s = 0; s < METRIC_STAGES; s++) {
+            metrics_histogram *histogram = &block->stages[s];
+            merged[s].count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+            merged[s].sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+            for (int b = 0; b < METRICS_BUCKETS; b++) merged[s].buckets[b] += __atomic_load_n(&histogram->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    size_t len = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        render_append(buffer, size, &len, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            counter_names[i][0], counter_names[i][1], counter_names[i][0], counter_names[i][0], (unsigned long long)counters[i]);
+    }
+    pthread_mutex_lock(&blocks_lock); // Залочить мьютекс
+    int count = gauge_count;
+    pthread_mutex_unlock(&blocks_lock); // Разлочить мьютекс
+    for (int i = 0; i < count; i++) {
+        int base = (int)strcspn(gauges[i].name, "{"); // Метки в имени не входят в HELP и TYPE
+        render_append(buffer, size, &len, "# HELP %.*s %s\n# TYPE %.*s gauge\n%s %lld\n",
+            base, gauges[i].name, gauges[i].help, base, gauges[i].name, gauges[i].name, gauges[i].read());
+    }
+
+    render_append(buffer, size, &len, "# HELP proxy_stage_seconds Time spent in each request stage\n# TYPE proxy_stage_seconds histogram\n");
+    for (int s = 0; s < METRIC_STAGES; s++) {
+        metrics_histogram *histogram = &merged[s];
+        // Ячейки le собираются из мелких с точностью их разрешения
+        int bucket = 0;
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < sizeof(le_bounds) / sizeof(le_bounds[0]); i++) {
+            while (bucket < METRICS_BUCKETS && bucket_high(bucket) <= le_bounds[i]) cumulative += histogram->buckets[bucket++];
+            render_append(buffer, size, &len, "proxy_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                stage_names[s], le_bounds[i] / 1e6, (unsigned long long)cumulative);
+        }
+        render_append(buffer, size, &len, "proxy_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+            stage_names[s], (unsigned long long)histogram->count);
+        render_append(buffer, size, &len, "proxy_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage_names[s], histogram->sum / 1e6);
+        render_append(buffer, size, &len, "proxy_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s], (unsigned long long)histogram->count);
+    }
+
+    render_append(buffer, size, &len, "# HELP proxy_stage_quantile_seconds Stage latency quantiles\n# TYPE proxy_stage_quantile_seconds gauge\n");
+    for (int s = 0; s < METRIC_STAGES; s++) {
+        metrics_histogram *histogram = &merged[s];
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            long long value = 0;
+            if (histogram->count) { // Верхняя граница ячейки, в которую попадает квантиль
+                uint64_t rank = (uint64_t)(quantiles[q] * histogram->count);
+                if (rank >= histogram->count) rank = histogram->count - 1;
+                uint64_t cumulative = 0;
+                for (int b = 0; b < METRICS_BUCKETS; b++) {
+                    cumulative += histogram->buckets[b];
+                    if (cumulative > rank) {
+                        value = bucket_high(b);
+                        break;
+                    }
+                }
+            }
+            render_append(buffer, size, &len, "proxy_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+                stage_names[s], quantiles[q], value / 1e6);
+        }
+    }
+    return len;
+}
+
+// Отвечает на один запрос к порту администрирования и закрывает соединение
+static void admin_respond(int client_socket, char *body) {
+    char request[METRICS_REQUEST_SIZE];
+    ssize_t received = recv(client_socket, request, sizeof(request) - 1, 0);
+    if (received <= 0) return;
+    request[received] = '\0';
+    char header[256];
+    size_t body_len;
+    const char *status;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        body_len = metrics_render(body, METRICS_RENDER_SIZE);
+        status = "200 OK";
+    } else {
+        body_len = (size_t)snprintf(body, METRICS_RENDER_SIZE, "Not found\n");
+        status = "404 Not Found";
+    }
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+    if (send(client_socket, header, header_len, MSG_NOSIGNAL) < 0) return;
+    size_t sent = 0;
+    while (sent < body_len) {
+        ssize_t written = send(client_socket, body + sent, body_len - sent, MSG_NOSIGNAL);
+        if (written <= 0) return;
+        sent += written;
+    }
+}
+
+// Поток администрирования: запросы редкие, поэтому обслуживаются по одному вне циклов событий
+static void *admin_thread(void *arg) {
+    int server_socket = (int)(intptr_t)arg;
+    char *body = (char *)malloc(METRICS_RENDER_SIZE);
+    if (!body) {
+        logger(ERROR, "Failed to allocate metrics buffer");
+        close(server_socket);
+        return NULL;
+    }
+    while (1) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno != EINTR) logger(ERROR, "Admin accept failed");
+            continue;
+        }
+        struct timeval timeout = { 1, 0 }; // Медленный клиент не задерживает следующие запросы надолго
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        admin_respond(client_socket, body);
+        close(client_socket);
+    }
+    return NULL;
+}
+
+// Запуск порта администрирования на 127.0.0.1, метрики отдаются по GET /metrics
+void metrics_serve(int port) {
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0) {
+        logger(ERROR, "Failed to create admin socket");
+        exit(EXIT_FAILURE);
+    }
+    int on = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in admin_addr;
+    memset(&admin_addr, 0, sizeof(admin_addr));
+    admin_addr.sin_family = AF_INET;
+    admin_addr.sin_port = htons(port);
+    admin_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Метрики доступны только локально
+    if (bind(server_socket, (struct sockaddr *)&admin_addr, sizeof(admin_addr)) < 0 || listen(server_socket, 16) < 0) {
+        logger(ERROR, "Admin port %d bind failed", port);
+        exit(EXIT_FAILURE);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_thread, (void *)(intptr_t)server_socket) != 0) {
+        logger(ERROR, "Failed to create admin thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    logger(INFO, "Metrics available on http://127.0.0.1:%d/metrics", port);
+}
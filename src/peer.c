@@ -0,0 +1,155 @@
+#include "peer.h"
+
+static peer_node nodes[PEER_MAX];
+static int node_count; // Узлов в кольце (0 - режим узлов выключен)
+static peer_point *ring; // Точки всех узлов по возрастанию
+static size_t ring_size;
+
+// Перемешивание битов: хэш FNV у похожих строк отличается в основном старшими битами
+static uint64_t mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Хэш точки по хосту, порту и номеру реплики без промежуточной строки
+static uint64_t point_hash(const peer_node *node, int replica) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)node->host; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    hash = (hash ^ (uint64_t)node->port) * 1099511628211ULL;
+    hash = (hash ^ (uint64_t)replica) * 1099511628211ULL;
+    return mix(hash);
+}
+
+// IPv4 адрес узла: запросы с заголовком PEER_HEADER принимаются только с адресов узлов
+static in_addr_t node_address(const char *host) {
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result) {
+        logger(WARNING, "Failed to resolve peer %s, its requests will not be trusted", host);
+        return INADDR_NONE;
+    }
+    in_addr_t addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(result);
+    return addr;
+}
+
+static int point_compare(const void *a, const void *b) {
+    const peer_point *left = (const peer_point *)a, *right = (const peer_point *)b;
+    if (left->hash != right->hash) return left->hash < right->hash ? -1 : 1;
+    return left->node - right->node; // Совпавшие точки упорядочены одинаково на всех узлах
+}
+
+// Разбор HOST:PORT, -1 при ошибке
+static int parse_node(const char *text, size_t len, peer_node *node) {
+    const char *colon = text + len;
+    while (colon > text && *colon != ':') colon--; // Порт после последнего двоеточия
+    if (colon == text || (size_t)(colon - text) >= HOST_SIZE) return -1;
+    char port[8];
+    size_t port_len = len - (colon - text) - 1;
+    if (!port_len || port_len >= sizeof(port)) return -1;
+    memcpy(port, colon + 1, port_len);
+    port[port_len] = '\0';
+    char *end;
+    long value = strtol(port, &end, 10);
+    if (*end || value <= 0 || value > 65535) return -1;
+    memcpy(node->host, text, colon - text);
+    node->host[colon - text] = '\0';
+    node->port = (int)value;
+    node->self = 0;
+    node->down_until = 0;
+    return 0;
+}
+
+// Кольцо по списку узлов через запятую; self - адрес этого процесса в том же виде.
+// У всех узлов список должен совпадать, тогда каждый URL на всех узлах принадлежит одному владельцу
+int peer_init(const char *list, const char *self) {
+    peer_node me;
+    if (parse_node(self, strlen(self), &me) < 0) {
+        logger(ERROR, "Invalid peer address: %s", self);
+        return -1;
+    }
+    node_count = 0;
+    for (const char *start = list; *start; ) {
+        const char *end = strchr(start, ',');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if (node_count == PEER_MAX || parse_node(start, len, &nodes[node_count]) < 0) {
+            logger(ERROR, "Invalid peer list: %s", list);
+            node_count = 0;
+            return -1;
+        }
+        peer_node *node = &nodes[node_count++];
+        node->self = node->port == me.port && strcmp(node->host, me.host) == 0;
+        node->addr = node_address(node->host);
+        start = end ? end + 1 : start + len;
+    }
+    int listed = 0;
+    for (int i = 0; i < node_count; i++) listed |= nodes[i].self;
+    if (!listed) { // Иначе узел ходил бы сам к себе и не владел бы ни одним ключом
+        logger(ERROR, "Peer address %s is not in the peer list %s (use --peer-self with the same spelling)", self, list);
+        node_count = 0;
+        return -1;
+    }
+    free(ring);
+    ring_size = (size_t)node_count * PEER_VNODES;
+    ring = (peer_point *)malloc(ring_size * sizeof(peer_point));
+    if (!ring) {
+        logger(ERROR, "Failed to allocate peer ring");
+        node_count = 0;
+        return -1;
+    }
+    for (int i = 0; i < node_count; i++) {
+        for (int replica = 0; replica < PEER_VNODES; replica++) {
+            ring[i * PEER_VNODES + replica] = (peer_point){ point_hash(&nodes[i], replica), i };
+        }
+    }
+    qsort(ring, ring_size, sizeof(peer_point), point_compare);
+    logger(INFO, "Peer ring: %d nodes, %zu points, this node is %s", node_count, ring_size, self);
+    return 0;
+}
+
+// Владелец ключа - первый доступный узел по часовой стрелке от хэша URL.
+// Недоступный узел уступает свои дуги соседям, остальные ключи остаются на местах.
+// NULL - ключ принадлежит этому процессу или режим узлов выключен
+const peer_node *peer_owner(uint64_t url_hash) {
+    if (!node_count) return NULL;
+    uint64_t hash = mix(url_hash);
+    size_t low = 0, high = ring_size;
+    while (low < high) { // Первая точка не меньше хэша
+        size_t middle = (low + high) / 2;
+        if (ring[middle].hash < hash) low = middle + 1;
+        else high = middle;
+    }
+    time_t now = time(NULL);
+    for (size_t i = 0; i < ring_size; i++) {
+        peer_node *node = &nodes[ring[(low + i) % ring_size].node];
+        if (node->self) return NULL;
+        if (__atomic_load_n(&node->down_until, __ATOMIC_RELAXED) <= now) return node;
+    }
+    return NULL; // Все остальные узлы недоступны - идём к серверу сами
+}
+
+// Узел не ответил: на PEER_RETRY секунд его ключи переходят к соседям по кольцу
+void peer_failed(const peer_node *node) {
+    peer_node *failed = (peer_node *)node;
+    time_t until = time(NULL) + PEER_RETRY;
+    if (__atomic_exchange_n(&failed->down_until, until, __ATOMIC_RELAXED) <= until - PEER_RETRY) {
+        logger(WARNING, "Peer %s:%d is unreachable, routing around it for %d seconds", node->host, node->port, PEER_RETRY);
+    }
+}
+
+// Запрос пришёл от одного из узлов кольца: только таким доверяем заголовок PEER_HEADER,
+// иначе любой клиент заставил бы узел-не-владельца хранить свою копию ответа
+int peer_trusted(in_addr_t addr) {
+    for (int i = 0; i < node_count; i++) {
+        if (nodes[i].addr != INADDR_NONE && nodes[i].addr == addr) return 1;
+    }
+    return 0;
+}
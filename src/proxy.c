@@ -1,139 +1,865 @@
-#include "proxy.h"
-
-pthread_mutex_t lock;  // Мьютекс для синхронизации доступа
-cache *cache_ptr;
-
-int proxy_init(int port) {
-  init_thread_pool(); // Инициализация пула потоков
-  // Инициализация кэша
-  cache_ptr = cache_init(); // Добавление вызова функции инициализации кэша
-  if (cache_ptr == NULL) {
-      logger(ERROR, "Cache initialization failed");
-      exit(EXIT_FAILURE);
-  }
-  int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-  struct sockaddr_in server_addr; // Структура для хранения адреса сервера
-
-  // Настройка адреса сервера
-  server_addr.sin_family = AF_INET;  // Используем IPv4
-  server_addr.sin_port = htons(port); // Устанавливаем порт
-  server_addr.sin_addr.s_addr = INADDR_ANY; // Привязываем сервер ко всем доступным интерфейсам
-
-  if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) { // Биндим сервер
-      logger(ERROR, "Server bind failed");
-      exit(EXIT_FAILURE);
-  }
-  logger(INFO, "Proxy server initialized");
-  return server_socket;
-}
-
-void proxy_start(int port, int server_socket) {
-    listen(server_socket, 10); // Слушаем на сокете подключение с бэклогом 10
-    logger(INFO, "Proxy server listening on port %d...", port);
-    start_thread_pool();  // Запуск пула потоков
-    while (1) {
-        struct sockaddr_in client_addr; // Структура для хранения адреса клиента
-        socklen_t client_len = sizeof(client_addr); // Размер структуры клиента
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            logger(ERROR, "Client accept failed");
-            continue;
-        }
-        logger(INFO, "Client send to queue");
-        enqueue(client_socket); // Добавляем клиента в очередь для обработки
-    }
-    cache_destroy(cache_ptr); // Дестроем кэш
-    stop_thread_pool(); // Останавливаем пул потоков
-    close(server_socket); // Закрываем сокет
-    logger(INFO, "Proxy server closed");
-}
-
-char *extract_url(char *buffer) {
-    static char url[256];
-    char method[8], protocol[16]; // Переменные для хранения метода, URL и протокола
-    sscanf(buffer, "%s %s %s", method, url, protocol); // Извлекаем метод, URL и протокол
-
-    if (strcmp(method, "GET") != 0) { // Обрабатываем только GET
-        logger(INFO, "Non-GET request received, ignoring...");
-        return NULL;
-    }
-    logger(INFO, "GET request received for URL: %s", url);
-    return (void*)url; // Возвращаем URL из запроса
-}
-
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE]; // Буфер для хранения полученных данных
-    memset(buffer, 0, BUFFER_SIZE); // Обнуляем буфер
-    int bytes_received = recv(client_socket, buffer, sizeof(buffer), 0); // Получаем данные от клиента
-    if (bytes_received < 0) {
-        logger(ERROR, "Error receiving data from client");
-        close(client_socket);
-        return;
-    }
-    logger(INFO, "Received %d bytes from client", bytes_received);
-    // Проверка в кэше
-    char *url = extract_url(buffer);
-    if (url == NULL) { // Функция для извлечения URL из запроса
-      logger(INFO, "URL extraction failed, closing connection...");
-      close(client_socket);
-      return;
-    }
-    cache_entry *found_cache = cache_find(cache_ptr, url);  // Ищем URL в кэше
-    if (found_cache != NULL) { // Если URL найден в кэше
-        logger(INFO, "Cache hit for URL: %s", url);
-        cache_print(cache_ptr);
-        pthread_mutex_lock(&lock); // Лочим мьютекс
-        send(client_socket, found_cache->data, found_cache->size, 0); // Отправляем данные из кэша клиенту
-        pthread_mutex_unlock(&lock); // Освобождаем мьютекс
-        logger(INFO, "Sent cached data to client");
-        close(client_socket); // Закрываем соединение с клиентом
-        return;
-    }
-
-    // Запрос к серверу если данных нет в кеше
-    char host[128], path[128]; // Переменные для хранения хоста и пути
-    sscanf(url, "http://%[^/]%s", host, path); // Извлекаем хост и путь из URL
-    logger(INFO, "Resolving host: %s", host);
-    struct hostent *server = gethostbyname(host); // Получаем IP-адрес сервера по имени хоста
-    if (!server) {
-        logger(ERROR, "Failed to resolve host: %s", host);
-        close(client_socket); // Закрываем сокет клиента, если сервер не найден
-        return; // Завершаем обработку клиента
-    }
-
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;  // Используем IPv4
-    server_addr.sin_port = htons(80); // Устанавливаем порт 80
-    server_addr.sin_addr = *(struct in_addr *)server->h_addr; // Устанавливаем IP-адрес сервера
-    logger(INFO, "Connecting to server %s:%d", host, 80);
-    // Подключаемся к серверу
-    if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        logger(ERROR, "Failed to connect to server: %s", host);
-        close(client_socket); // Закрываем сокет клиента в случае ошибки
-        close(server_socket); // Закрываем сокет сервера в случае ошибки
-        return;
-    }
-    logger(INFO, "Connected to server, sending GET request");
-    // Формируем запрос к серверу
-    snprintf(buffer, BUFFER_SIZE, "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host);
-    send(server_socket, buffer, strlen(buffer), 0); // Отправляем запрос на сервер
-
-    // Получение ответа и кэширование
-    char *response = malloc(BUFFER_SIZE); // Выделяем память для хранения ответа
-    size_t size = 0; // Общий размер ответа
-    time_t expiry = time(NULL) + 3600;
-    while ((bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        response = realloc(response, size + bytes_received); // Увеличиваем память для ответа
-        memcpy(response + size, buffer, bytes_received); // Копируем полученные данные в ответ
-        size += bytes_received; // Увеличиваем общий размер данных
-        send(client_socket, buffer, bytes_received, 0); // Отправляем полученные данные клиенту
-    }
-    logger(INFO, "Received %d bytes from server, caching response", size);
-    // Кэшируем полученные данные
-    cache_add(cache_ptr, url, response, size, expiry); // Добавляем ответ в кэш
-    free(response); // Освобождаем память выделенную для ответа
-    logger(INFO, "Closing connections");
-    close(client_socket); // Закрываем сокет клиента в случае ошибки
-    close(server_socket); // Закрываем сокет сервера в случае ошибки
-}
+#include "proxy.h"
+
+cache *cache_ptr;
+static loop_connections *loop_states; // Соединения каждого цикла событий
+static int draining; // Идёт остановка: новых запросов на открытых соединениях не ждём
+static sigset_t stop_signals; // Сигналы остановки, их принимает только главный поток
+
+// Слушающий сокет на порту прокси; в режиме SO_REUSEPORT таких сокетов по одному на цикл
+static int open_listener(int port) {
+  int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_socket < 0) {
+      logger(ERROR, "Failed to create server socket");
+      exit(EXIT_FAILURE);
+  }
+  int on = 1;
+  setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)); // Перезапуск не ждёт TIME_WAIT
+  if (config.reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+      logger(ERROR, "SO_REUSEPORT is not supported");
+      exit(EXIT_FAILURE);
+  }
+  struct sockaddr_in server_addr; // Структура для хранения адреса сервера
+  memset(&server_addr, 0, sizeof(server_addr));
+
+  // Настройка адреса сервера
+  server_addr.sin_family = AF_INET;  // Используем IPv4
+  server_addr.sin_port = htons(port); // Устанавливаем порт
+  server_addr.sin_addr.s_addr = INADDR_ANY; // Привязываем сервер ко всем доступным интерфейсам
+
+  if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) { // Биндим сервер
+      logger(ERROR, "Server bind failed");
+      exit(EXIT_FAILURE);
+  }
+  return server_socket;
+}
+
+// Показатели кэша для метрик
+static long long cache_entries() {
+  size_t entries, bytes;
+  cache_stats(cache_ptr, &entries, &bytes);
+  return (long long)entries;
+}
+
+static long long cache_bytes() {
+  size_t entries, bytes;
+  cache_stats(cache_ptr, &entries, &bytes);
+  return (long long)bytes;
+}
+
+static long long policy_enabled() {
+  return 1;
+}
+
+static long long slab_bytes() {
+  return (long long)slab_mapped_bytes();
+}
+
+static long long disk_entries() {
+  size_t entries, bytes;
+  disk_stats(&entries, &bytes);
+  return (long long)entries;
+}
+
+static long long disk_bytes() {
+  size_t entries, bytes;
+  disk_stats(&entries, &bytes);
+  return (long long)bytes;
+}
+
+int proxy_init(int port) {
+  admission_init(); // Пределы соединений
+  init_thread_pool(); // Инициализация пула потоков
+  loop_states = (loop_connections *)calloc(config.threads, sizeof(loop_connections));
+  if (loop_states == NULL) {
+      logger(ERROR, "Failed to allocate connection lists");
+      exit(EXIT_FAILURE);
+  }
+  // Инициализация кэша
+  cache_ptr = cache_init(config.cache_bytes, config.max_object_bytes, config.cache_policy); // Кэш с бюджетом в байтах
+  if (cache_ptr == NULL) {
+      logger(ERROR, "Cache initialization failed");
+      exit(EXIT_FAILURE);
+  }
+  if (config.disk_path) { // Вытесненные из памяти ответы переживают перезапуск в дисковом журнале
+      if (disk_open(config.disk_path, config.disk_bytes) < 0) exit(EXIT_FAILURE);
+      cache_set_demote(cache_ptr, disk_demote);
+      metrics_gauge_register("proxy_disk_entries", "Entries in the disk cache", disk_entries);
+      metrics_gauge_register("proxy_disk_bytes", "Response bytes in the disk cache", disk_bytes);
+  }
+  if (config.peers) { // Промахи идут к узлу-владельцу URL, а не сразу к серверу
+      char self[HOST_SIZE + 8];
+      if (!config.peer_self) snprintf(self, sizeof(self), "127.0.0.1:%d", port);
+      if (peer_init(config.peers, config.peer_self ? config.peer_self : self) < 0) exit(EXIT_FAILURE);
+  }
+  int server_socket = open_listener(port);
+  metrics_gauge_register("proxy_queue_depth", "Client sockets waiting in the handoff queue", thread_pool_depth);
+  metrics_gauge_register("proxy_client_connections", "Live client connections, queued ones included", admission_active);
+  metrics_gauge_register("proxy_event_loops", "Event loops taking new connections", thread_pool_loops);
+  metrics_gauge_register("proxy_cache_entries", "Entries in the cache", cache_entries);
+  metrics_gauge_register("proxy_cache_bytes", "Memory used by cache entries", cache_bytes);
+  metrics_gauge_register("proxy_slab_mapped_bytes", "Memory mapped by the slab allocator", slab_bytes);
+  static char policy_info[64]; // Имя метрики живёт всё время работы
+  snprintf(policy_info, sizeof(policy_info), "proxy_cache_policy_info{policy=\"%s\"}", cache_policy_name(cache_ptr));
+  metrics_gauge_register(policy_info, "Cache eviction policy in use", policy_enabled);
+  if (config.admin_port) metrics_serve(config.admin_port);
+  logger(INFO, "Proxy server initialized");
+  return server_socket;
+}
+
+// До запуска потоков: SIGINT и SIGTERM ждёт главный поток, остальные их не получают
+void proxy_block_signals() {
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL); // Маску наследуют все потоки процесса
+    signal(SIGPIPE, SIG_IGN); // splice в закрытый клиентом сокет не должен завершать процесс
+}
+
+// Общий слушающий сокет: принятые подключения уходят циклам через очередь
+static void *accept_thread(void *arg) {
+    int server_socket = *(int *)arg;
+    while (!__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+        admission_wait(); // На пределе соединений не принимаем новых
+        struct sockaddr_in client_addr; // Структура для хранения адреса клиента
+        socklen_t client_len = sizeof(client_addr); // Размер структуры клиента
+        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0) {
+            if (!__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) logger(ERROR, "Client accept failed");
+            continue;
+        }
+        in_addr_t addr = client_addr.sin_addr.s_addr;
+        if (admission_acquire(addr) < 0) { // Клиент превысил свою долю соединений
+            admission_reject(client_socket);
+            continue;
+        }
+        logger(INFO, "Client send to queue");
+        if (enqueue(client_socket, addr) < 0) { // Циклы не справляются - сразу отказываем клиенту
+            admission_reject(client_socket);
+            admission_release(addr);
+        }
+    }
+    return NULL;
+}
+
+void proxy_start(int port, int server_socket) {
+    listen(server_socket, config.backlog); // Пока приём приостановлен, подключения ждут в бэклоге
+    pthread_t acceptor;
+    if (config.reuseport) { // Ядро само распределяет подключения между сокетами циклов
+        add_acceptor(0, server_socket);
+        for (int i = 1; i < config.threads; i++) {
+            int loop_socket = open_listener(port);
+            listen(loop_socket, config.backlog);
+            add_acceptor(i, loop_socket);
+        }
+        logger(INFO, "Proxy server listening on port %d with %d SO_REUSEPORT sockets...", port, config.threads);
+        start_thread_pool();  // Запуск пула потоков
+    } else {
+        logger(INFO, "Proxy server listening on port %d...", port);
+        start_thread_pool();  // Запуск пула потоков
+        if (pthread_create(&acceptor, NULL, accept_thread, &server_socket) != 0) {
+            logger(ERROR, "Failed to create accept thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int signal_number;
+    sigwait(&stop_signals, &signal_number); // Работают потоки, главный ждёт команды остановиться
+    logger(INFO, "Received %s, draining connections for up to %d seconds", signal_number == SIGINT ? "SIGINT" : "SIGTERM",
+           config.drain_timeout);
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    admission_shutdown();
+    if (!config.reuseport) {
+        shutdown(server_socket, SHUT_RDWR); // Прерывает accept в потоке приёма
+        pthread_join(acceptor, NULL);
+        close(server_socket); // Закрываем сокет
+    }
+    drain_thread_pool(); // Сокеты SO_REUSEPORT закрывают сами циклы
+    time_t deadline = time(NULL) + config.drain_timeout;
+    while (admission_active() > 0 && time(NULL) < deadline) usleep(DRAIN_POLL_MS * 1000);
+    if (admission_active() > 0) logger(WARNING, "Drain timed out, dropping %lld connections", admission_active());
+    stop_thread_pool(); // Останавливаем пул потоков
+    if (config.disk_path) disk_close(); // Индекс журнала переживёт перезапуск
+    cache_destroy(cache_ptr); // Дестроем кэш
+    logger(INFO, "Proxy server closed");
+}
+
+static void connection_free(void *arg) {
+    connection *conn = (connection *)arg;
+    free(conn->buffer);
+    free(conn);
+}
+
+static void wait_stop(connection *conn) {
+    if (conn->waiting == WAIT_KINDS) return;
+    connection_list *list = &loop_states[conn->loop->id].waits[conn->waiting];
+    if (conn->wait_prev) conn->wait_prev->wait_next = conn->wait_next;
+    else list->head = conn->wait_next;
+    if (conn->wait_next) conn->wait_next->wait_prev = conn->wait_prev;
+    else list->tail = conn->wait_prev;
+    conn->wait_prev = conn->wait_next = NULL;
+    conn->waiting = WAIT_KINDS;
+}
+
+// Соединение начинает ждать клиента: в конец списка своего цикла; уже ждущее того же сохраняет срок
+static void wait_start(connection *conn, connection_wait kind) {
+    if (conn->waiting == kind) return;
+    wait_stop(conn);
+    connection_list *list = &loop_states[conn->loop->id].waits[kind];
+    conn->waiting = kind;
+    conn->wait_since = time(NULL);
+    conn->wait_prev = list->tail;
+    conn->wait_next = NULL;
+    if (list->tail) list->tail->wait_next = conn;
+    else list->head = conn;
+    list->tail = conn;
+}
+
+static void connection_close(connection *conn) {
+    if (conn->state == CONN_CLOSED) return;
+    conn->state = CONN_CLOSED;
+    wait_stop(conn);
+    event_watcher_close(conn->loop, &conn->client); // Закрываем сокет клиента
+    loop_states[conn->loop->id].count--;
+    admission_release(conn->addr);
+    resume_acceptor(conn->loop); // Освободилось место - приём цикла мог ждать именно его
+    cache_object_release(conn->object); // Отпускаем объект кэша
+    conn->object = NULL;
+    free(conn->reply_text);
+    if (conn->disk) disk_release(conn->disk);
+    conn->disk = NULL;
+    event_watcher_close(conn->loop, &conn->upstream); // Прерванная передача: соединение с сервером в пул не вернуть
+    if (conn->relay_pipe[0] >= 0) {
+        close(conn->relay_pipe[0]);
+        close(conn->relay_pipe[1]);
+    }
+    if (conn->fetch) fetch_detach(conn->fetch, &conn->reader); // Отсоединяемся от загрузки
+    conn->fetch = NULL;
+    // В этой же пачке могут быть события соединения, поэтому память освобождаем после неё
+    if (event_loop_post(conn->loop, connection_free, conn) < 0) {
+        logger(WARNING, "Connection memory leaked");
+    }
+}
+
+static ssize_t send_iov(int socket, struct iovec *iov, int count) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    return sendmsg(socket, &message, MSG_NOSIGNAL);
+}
+
+static void read_request(connection *);
+static void start_relay(connection *, int);
+static void on_client_event(event_watcher *, uint32_t);
+
+// Клиент не принимает ответ: ждём готовности сокета к записи, но не дольше --send-timeout
+static void client_blocked(connection *conn) {
+    event_watcher_set(conn->loop, &conn->client, EPOLLOUT);
+    wait_start(conn, WAIT_SEND);
+}
+
+// Учёт отправленных байт ответа и времени до первого из них
+static void connection_sent(connection *conn, ssize_t sent) {
+    if (conn->waiting == WAIT_SEND) wait_stop(conn); // Клиент снова принимает данные
+    conn->sent += sent;
+    metrics_add(METRIC_BYTES_SERVED, sent);
+    if (!conn->first_byte) {
+        conn->first_byte = 1;
+        metrics_observe(STAGE_FIRST_BYTE, metrics_now() - conn->request_start);
+    }
+}
+
+// Соединение между запросами уходит в общую очередь вместе с сокетом и учётом у admission.
+// Передача - лишь перераспределение нагрузки: при полной очереди соединение остаётся в этом цикле, -1
+static int connection_handoff(connection *conn) {
+    loop_connections *state = &loop_states[conn->loop->id];
+    int client_socket = event_watcher_detach(conn->loop, &conn->client);
+    if (enqueue(client_socket, conn->addr) < 0) {
+        state->shed = 0; // До следующего такта соединения больше не отдаём
+        event_watcher_init(&conn->client, client_socket, on_client_event, conn);
+        return -1;
+    }
+    state->shed--;
+    state->count--;
+    conn->state = CONN_CLOSED;
+    wait_stop(conn);
+    if (conn->relay_pipe[0] >= 0) {
+        close(conn->relay_pipe[0]);
+        close(conn->relay_pipe[1]);
+    }
+    if (event_loop_post(conn->loop, connection_free, conn) < 0) {
+        logger(WARNING, "Connection memory leaked");
+    }
+    return 0;
+}
+
+// Ответ отправлен целиком: ждём следующий запрос, если клиент и длина ответа это позволяют
+static void connection_done(connection *conn, int delimited) {
+    metrics_observe(STAGE_TOTAL, metrics_now() - conn->request_start);
+    if (!conn->keep_alive || !delimited) {
+        connection_close(conn);
+        return;
+    }
+    cache_object_release(conn->object);
+    conn->object = NULL;
+    free(conn->reply_text);
+    conn->reply_text = NULL;
+    conn->npieces = 0;
+    conn->reply_size = 0;
+    if (conn->disk) disk_release(conn->disk);
+    conn->disk = NULL;
+    if (conn->fetch) fetch_detach(conn->fetch, &conn->reader);
+    conn->fetch = NULL;
+    conn->sent = 0;
+    // Следующий запрос мог прийти вместе с текущим
+    size_t rest = conn->buffer_len - conn->request_len;
+    memmove(conn->buffer, conn->buffer + conn->request_len, rest);
+    conn->buffer_len = rest;
+    http_reset(&conn->request);
+    if (!rest && loop_states[conn->loop->id].shed > 0 && connection_handoff(conn) == 0) {
+        return; // Цикл перегружен или отключён: следующий запрос обслужит другой
+    }
+    conn->state = CONN_READ_REQUEST;
+    wait_start(conn, WAIT_IDLE);
+    event_watcher_set(conn->loop, &conn->client, EPOLLIN);
+    read_request(conn);
+}
+
+// Обрезка векторов до limit байт, возвращает их новое количество
+static int iov_clamp(struct iovec *iov, int count, size_t limit) {
+    for (int i = 0; i < count; i++) {
+        if (iov[i].iov_len >= limit) {
+            iov[i].iov_len = limit;
+            return limit ? i + 1 : i;
+        }
+        limit -= iov[i].iov_len;
+    }
+    return count;
+}
+
+// Векторы ответа из частей, начиная с уже отправленного
+static int reply_iov(connection *conn, struct iovec *iov, int max) {
+    size_t start = 0;
+    int count = 0;
+    for (int i = 0; i < conn->npieces && count < max; i++) {
+        reply_piece *piece = &conn->pieces[i];
+        if (conn->sent < start + piece->len) {
+            size_t skip = conn->sent > start ? conn->sent - start : 0;
+            if (piece->text) {
+                iov[count].iov_base = (char *)piece->text + skip;
+                iov[count].iov_len = piece->len - skip;
+                count++;
+            } else {
+                int n = cache_object_iov(conn->object, piece->offset + skip, iov + count, max - count);
+                count += iov_clamp(iov + count, n, piece->len - skip);
+            }
+        }
+        start += piece->len;
+    }
+    return count;
+}
+
+static void reply_add(connection *conn, const char *text, size_t offset, size_t len) {
+    conn->pieces[conn->npieces].text = text;
+    conn->pieces[conn->npieces].offset = offset;
+    conn->pieces[conn->npieces].len = len;
+    conn->npieces++;
+    conn->reply_size += len;
+}
+
+// If-Range совпадает с сильным ETag или с Last-Modified сохранённого ответа
+static int if_range_matches(const http_message *stored, const http_slice *value) {
+    const http_slice *validator = http_header_find(stored, value->len && value->data[0] == '"' ? "ETag" : "Last-Modified");
+    return validator && validator->len == value->len && memcmp(validator->data, value->data, value->len) == 0;
+}
+
+// Ответ 206 или 416 на Range: заголовки сохранённого ответа с новой длиной, тело - отрезки объекта
+static void reply_ranges(connection *conn, const http_message *stored, const http_slice *range, size_t length) {
+    const http_slice *if_range = http_header_find(&conn->request, "If-Range");
+    if (if_range && !if_range_matches(stored, if_range)) return; // Объект изменился - клиенту нужен весь ответ
+    http_range ranges[RANGE_MAX];
+    int count = http_parse_ranges(range, length, ranges, RANGE_MAX);
+    if (count < 0) return; // Непонятный Range не мешает отдать весь ответ
+    const http_slice *type = http_header_find(stored, "Content-Type");
+    size_t type_len = type ? type->len : 0;
+    size_t head_capacity = stored->head_len + 512; // Строка статуса и новые заголовки длиннее заменённых
+    conn->reply_text = (char *)malloc(head_capacity + (size_t)count * (128 + type_len) + 64);
+    if (!conn->reply_text) return;
+    char *text = conn->reply_text;
+    metrics_add(METRIC_RANGES, 1);
+    if (count == 0) {
+        int len = snprintf(text, head_capacity, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n", length);
+        reply_add(conn, text, 0, len);
+        return;
+    }
+    // Заголовки зависят от длины частей, поэтому пишутся последними в начало буфера
+    conn->npieces = 1;
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)((uintptr_t)conn->object ^ (uintptr_t)conn->request_start));
+    char *part = text + head_capacity;
+    for (int i = 0; i < count; i++) {
+        size_t span = ranges[i].last - ranges[i].first + 1;
+        if (count > 1) {
+            int len = sprintf(part, "\r\n--%s\r\n", boundary);
+            if (type) len += sprintf(part + len, "Content-Type: %.*s\r\n", (int)type->len, type->data);
+            len += sprintf(part + len, "Content-Range: bytes %zu-%zu/%zu\r\n\r\n", ranges[i].first, ranges[i].last, length);
+            reply_add(conn, part, 0, len);
+            part += len;
+        }
+        reply_add(conn, NULL, stored->head_len + ranges[i].first, span);
+    }
+    if (count > 1) reply_add(conn, part, 0, sprintf(part, "\r\n--%s--\r\n", boundary));
+    size_t len = snprintf(text, head_capacity, "HTTP/1.1 206 Partial Content\r\n");
+    for (int i = 0; i < stored->nheaders; i++) {
+        const http_header *header = &stored->headers[i];
+        if (http_slice_is(&header->name, "Content-Length") || http_slice_is(&header->name, "Content-Range") ||
+            (count > 1 && http_slice_is(&header->name, "Content-Type"))) continue;
+        len += snprintf(text + len, head_capacity - len, "%.*s: %.*s\r\n",
+            (int)header->name.len, header->name.data, (int)header->value.len, header->value.data);
+    }
+    if (count == 1) {
+        len += snprintf(text + len, head_capacity - len, "Content-Range: bytes %zu-%zu/%zu\r\n", ranges[0].first, ranges[0].last, length);
+    } else {
+        len += snprintf(text + len, head_capacity - len, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+    }
+    len += snprintf(text + len, head_capacity - len, "Content-Length: %zu\r\n\r\n", conn->reply_size);
+    conn->pieces[0].text = text;
+    conn->pieces[0].offset = 0;
+    conn->pieces[0].len = len;
+    conn->reply_size += len;
+}
+
+// Части ответа для HEAD и Range; если частей нет, объект отдаётся целиком
+static void reply_build(connection *conn) {
+    cache_object *object = conn->object;
+    http_message stored;
+    http_reset(&stored);
+    size_t available = object->size < CACHE_CHUNK_SIZE ? object->size : CACHE_CHUNK_SIZE;
+    if (http_parse_response(&stored, object->chunks[0], available) <= 0) return;
+    if (conn->head_only) {
+        reply_add(conn, NULL, 0, stored.head_len);
+        return;
+    }
+    const http_slice *range = http_header_find(&conn->request, "Range");
+    size_t length = 0;
+    // Диапазоны считаются только по телу полного ответа с известной длиной
+    if (range && stored.status == 200 && http_content_length(&stored, &length) > 0 &&
+        length == object->size - stored.head_len && !http_header_find(&stored, "Transfer-Encoding")) {
+        reply_ranges(conn, &stored, range, length);
+    }
+}
+
+static void send_cached(connection *conn) {
+    // Объект неизменяем и закреплён, поэтому отправляем без блокировок и копий
+    size_t total = conn->npieces ? conn->reply_size : conn->object->size;
+    while (conn->sent < total) {
+        struct iovec iov[16];
+        int count = conn->npieces ? reply_iov(conn, iov, 16) : cache_object_iov(conn->object, conn->sent, iov, 16);
+        ssize_t sent = send_iov(conn->client.fd, iov, count);
+        if (sent < 0 && errno == EAGAIN) { // Сокет заполнен - ждём готовности к записи
+            client_blocked(conn);
+            return;
+        }
+        if (sent <= 0) {
+            logger(ERROR, "Error sending cached data to client");
+            connection_close(conn);
+            return;
+        }
+        connection_sent(conn, sent);
+    }
+    logger(INFO, "Sent cached data to client");
+    connection_done(conn, conn->npieces || conn->object->delimited); // У ответа из частей длина всегда указана
+}
+
+// Ответ из закреплённого объекта кэша, ссылка переходит соединению
+static void serve_object(connection *conn, cache_object *object) {
+    conn->object = object;
+    conn->sent = 0;
+    conn->state = CONN_SEND_CACHED;
+    reply_build(conn);
+    send_cached(conn);
+}
+
+static void send_disk(connection *conn) {
+    // Запись закреплена, журнал не перезапишет её до disk_release
+    while (conn->sent < conn->disk->size) {
+        ssize_t sent = disk_send(conn->client.fd, conn->disk, conn->sent);
+        if (sent < 0 && errno == EAGAIN) {
+            client_blocked(conn);
+            return;
+        }
+        if (sent <= 0) {
+            logger(ERROR, "Error sending disk cached data to client");
+            connection_close(conn);
+            return;
+        }
+        connection_sent(conn, sent);
+    }
+    logger(INFO, "Sent disk cached data to client");
+    connection_done(conn, conn->disk->delimited);
+}
+
+static void send_fetched(connection *conn) {
+    while (1) {
+        // Статус читаем до данных: если загрузка завершена, всё опубликованное уже видно
+        int status = fetch_status(conn->fetch);
+        struct iovec iov[16];
+        int count = fetch_iov(conn->fetch, conn->sent, iov, 16);
+        if (conn->head_only && (count || conn->sent)) { // Заголовки уже видны: на HEAD отдаём только их
+            size_t head = fetch_head_len(conn->fetch);
+            if (!head) {
+                logger(INFO, "Unparsable response to HEAD request, closing connection");
+                connection_close(conn);
+                return;
+            }
+            if (conn->sent >= head) {
+                logger(INFO, "Sent fetched headers to client");
+                connection_done(conn, 1);
+                return;
+            }
+            count = iov_clamp(iov, count, head - conn->sent);
+        }
+        if (!count) {
+            cache_object *stale = status > 0 ? fetch_stale(conn->fetch) : NULL;
+            int relay = status > 0 && !stale ? fetch_relay(conn->fetch, &conn->relay_left) : -1;
+            if (stale) { // Сервер подтвердил устаревший объект - отдаём его как попадание
+                fetch_detach(conn->fetch, &conn->reader);
+                conn->fetch = NULL;
+                serve_object(conn, cache_object_retain(stale));
+            } else if (relay >= 0) { // Остаток ответа ещё у сервера - передаём его через splice
+                start_relay(conn, relay);
+            } else if (status > 0) {
+                logger(INFO, "Sent fetched data to client");
+                connection_done(conn, fetch_delimited(conn->fetch));
+            } else if (status < 0) {
+                logger(INFO, "Fetch failed, closing connection");
+                connection_close(conn);
+            } else { // Ждём новых данных от загрузки
+                event_watcher_set(conn->loop, &conn->client, 0);
+            }
+            return;
+        }
+        ssize_t sent = send_iov(conn->client.fd, iov, count);
+        if (sent < 0 && errno == EAGAIN) {
+            client_blocked(conn);
+            return;
+        }
+        if (sent <= 0) {
+            logger(ERROR, "Error sending data to client");
+            connection_close(conn);
+            return;
+        }
+        connection_sent(conn, sent);
+        fetch_consumed(conn->fetch, &conn->reader, conn->sent);
+    }
+}
+
+// Остаток ответа идёт из сокета сервера в канал и из канала в сокет клиента, не копируясь в память процесса
+static void send_relay(connection *conn) {
+    while (1) {
+        if (conn->relay_buffered) {
+            unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (conn->relay_left ? SPLICE_F_MORE : 0);
+            ssize_t sent = splice(conn->relay_pipe[0], NULL, conn->client.fd, NULL, conn->relay_buffered, flags);
+            if (sent < 0 && errno == EAGAIN) { // Клиент не успевает: сервер ждёт, пока канал не опустеет
+                event_watcher_set(conn->loop, &conn->upstream, 0);
+                client_blocked(conn);
+                return;
+            }
+            if (sent <= 0) {
+                logger(ERROR, "Error relaying data to client");
+                connection_close(conn);
+                return;
+            }
+            conn->relay_buffered -= sent;
+            connection_sent(conn, sent);
+            metrics_add(METRIC_RELAYED, sent);
+            continue;
+        }
+        if (!conn->relay_left) break;
+        size_t want = conn->relay_left < RELAY_PIPE_SIZE ? conn->relay_left : RELAY_PIPE_SIZE;
+        ssize_t received = splice(conn->upstream.fd, NULL, conn->relay_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (received > 0) {
+            conn->relay_buffered += received;
+            if (conn->relay_left != FETCH_RELAY_UNTIL_CLOSE) conn->relay_left -= received;
+            metrics_add(METRIC_BYTES_FETCHED, received);
+            continue;
+        }
+        if (received == 0 && conn->relay_left == FETCH_RELAY_UNTIL_CLOSE) { // Ответ без длины закончился вместе с соединением
+            conn->relay_left = 0;
+            break;
+        }
+        if (received < 0 && errno == EAGAIN) { // Канал пуст, ждём данных от сервера
+            event_watcher_set(conn->loop, &conn->client, 0);
+            event_watcher_set(conn->loop, &conn->upstream, EPOLLIN);
+            return;
+        }
+        logger(ERROR, "Server closed connection before end of relayed response");
+        connection_close(conn);
+        return;
+    }
+    fetch_relay_done(conn->fetch, event_watcher_detach(conn->loop, &conn->upstream), 1);
+    logger(INFO, "Relayed fetched data to client");
+    connection_done(conn, fetch_delimited(conn->fetch));
+}
+
+static void on_relay_event(event_watcher *watcher, uint32_t events) {
+    connection *conn = (connection *)watcher->data;
+    (void)events; // Ошибку и закрытие сервера покажет splice
+    if (conn->state == CONN_RELAY) send_relay(conn);
+}
+
+// Загрузка отдала сокет сервера: дальше соединение передаёт ответ само
+static void start_relay(connection *conn, int upstream_socket) {
+    if (conn->relay_pipe[0] < 0) {
+        if (pipe2(conn->relay_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            logger(ERROR, "Failed to create relay pipe");
+            conn->relay_pipe[0] = conn->relay_pipe[1] = -1;
+            close(upstream_socket);
+            connection_close(conn);
+            return;
+        }
+        fcntl(conn->relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE); // Больше за один splice; при отказе остаётся размер по умолчанию
+    }
+    event_watcher_init(&conn->upstream, upstream_socket, on_relay_event, conn);
+    conn->relay_buffered = 0;
+    conn->state = CONN_RELAY;
+    send_relay(conn);
+}
+
+// Уведомление от загрузки, вызывается в цикле соединения
+static void on_fetch_progress(fetch_reader *reader) {
+    connection *conn = (connection *)((char *)reader - offsetof(connection, reader));
+    if (conn->state == CONN_SEND_FETCHED) send_fetched(conn);
+}
+
+static void process_request(connection *conn) {
+    http_message *request = &conn->request;
+    logger(INFO, "Received %zu bytes from client", conn->buffer_len);
+    conn->request_start = metrics_now();
+    conn->first_byte = 0;
+    metrics_add(METRIC_REQUESTS, 1);
+    conn->request_len = request->head_len;
+    conn->keep_alive = http_keep_alive(request) && !__atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+    size_t body = 0;
+    if (http_content_length(request, &body) != 0 || body || http_header_find(request, "Transfer-Encoding")) {
+        conn->keep_alive = 0; // Тело запроса не читаем, поэтому границу следующего запроса не знаем
+    }
+    conn->head_only = http_slice_is(&request->method, "HEAD");
+    if (!conn->head_only && !http_slice_is(&request->method, "GET")) { // Обрабатываем только GET и HEAD
+        logger(INFO, "Unsupported method received, closing connection...");
+        connection_close(conn);
+        return;
+    }
+    if (request->target.len >= URL_SIZE) {
+        logger(INFO, "URL too long, closing connection...");
+        connection_close(conn);
+        return;
+    }
+    // Пробел после цели запроса больше не нужен: завершаем URL нулём прямо в буфере вместо копии
+    char *url = (char *)request->target.data;
+    url[request->target.len] = '\0';
+    logger(INFO, "%s request received for URL: %s", conn->head_only ? "HEAD" : "GET", url);
+    // Запрос с авторизацией или no-store идёт мимо кэша, no-cache требует проверки у сервера
+    long max_age = -1;
+    int bypass = http_header_find(request, "Authorization") || http_cache_directive(request, "no-store", NULL);
+    int revalidate = http_cache_directive(request, "no-cache", NULL) || http_header_token(request, "Pragma", "no-cache") ||
+                     (http_cache_directive(request, "max-age", &max_age) && max_age == 0);
+    const http_slice *range = conn->head_only ? NULL : http_header_find(request, "Range"); // На HEAD Range не действует
+    // Запрос другого узла или мимо кэша идёт прямо к серверу, иначе промах берётся у владельца URL.
+    // Заголовок узла от клиентов не с адресов кольца не учитывается
+    int peer = http_header_find(request, PEER_HEADER) && peer_trusted(conn->addr);
+    int origin = bypass || peer ? FETCH_ORIGIN : 0;
+    cache_times times;
+    cache_object *found_cache = NULL;
+    long long lookup_start = metrics_now();
+    if (!bypass) found_cache = cache_find(cache_ptr, url, &times);  // Ищем URL в кэше, объект закреплён
+    int disk_hits = 0;
+    disk_entry *disk = !bypass && !found_cache ? disk_find(url, &times, &disk_hits) : NULL;
+    metrics_observe(STAGE_CACHE_LOOKUP, metrics_now() - lookup_start);
+    time_t now = time(NULL);
+    if (disk && !revalidate && !range && !conn->head_only && now < times.expiry && disk_hits < DISK_PROMOTE_HITS) { // Первое попадание отдаём прямо из файла
+        logger(INFO, "Disk cache hit for URL: %s", url);
+        metrics_add(METRIC_HITS, 1);
+        metrics_add(METRIC_DISK_HITS, 1);
+        conn->disk = disk;
+        conn->sent = 0;
+        conn->state = CONN_SEND_DISK;
+        send_disk(conn);
+        return;
+    }
+    if (disk) { // Повторно востребованный или требующий проверки объект поднимаем в память
+        found_cache = disk_load(disk);
+        disk_release(disk);
+        if (found_cache) {
+            metrics_add(METRIC_DISK_PROMOTED, 1);
+            cache_add(cache_ptr, url, found_cache, &times);
+        }
+    }
+    if (found_cache != NULL && !revalidate && (now < times.expiry || now < times.stale_until)) { // Если URL найден в кэше
+        logger(INFO, "Cache hit for URL: %s", url);
+        metrics_add(METRIC_HITS, 1);
+        if (now >= times.expiry) { // Устарел, но можно отдать, пока обновление идёт в фоне
+            metrics_add(METRIC_STALE_SERVED, 1);
+            fetch_start(cache_ptr, conn->loop, url, NULL, found_cache, origin, NULL);
+        }
+        serve_object(conn, found_cache);
+        return;
+    }
+    // Промах или устаревший объект: присоединяемся к загрузке этого URL или запускаем новую, условную при наличии объекта
+    metrics_add(METRIC_MISSES, 1);
+    conn->reader.loop = conn->loop;
+    conn->reader.notify = on_fetch_progress;
+    char forward[RANGE_HEADERS_SIZE]; // Заголовки Range для сервера
+    const http_slice *if_range = range ? http_header_find(request, "If-Range") : NULL;
+    if (range && range->len + (if_range ? if_range->len : 0) + 32 < sizeof(forward)) {
+        // Частичный ответ отдаёт сервер, а весь объект загружается в кэш в фоне
+        int len = snprintf(forward, sizeof(forward), "Range: %.*s\r\n", (int)range->len, range->data);
+        if (if_range) snprintf(forward + len, sizeof(forward) - len, "If-Range: %.*s\r\n", (int)if_range->len, if_range->data);
+        if (!bypass && config.range_fill) fetch_start(cache_ptr, conn->loop, url, NULL, found_cache, origin, NULL);
+        conn->fetch = fetch_start(cache_ptr, conn->loop, url, &conn->reader, NULL, FETCH_PRIVATE | origin, forward);
+    } else { // Без Range, а слишком длинный не передаём: сервер отдаст ответ целиком
+        conn->fetch = fetch_start(cache_ptr, conn->loop, url, &conn->reader, found_cache, (bypass ? FETCH_PRIVATE : 0) | origin, NULL);
+    }
+    cache_object_release(found_cache); // Загрузка держит свою ссылку
+    if (!conn->fetch) {
+        connection_close(conn);
+        return;
+    }
+    conn->sent = 0;
+    conn->state = CONN_SEND_FETCHED;
+    event_watcher_set(conn->loop, &conn->client, 0); // От клиента ждём только разрыва соединения
+    send_fetched(conn);
+}
+
+// Буфер заполнен, а заголовки не кончились: удваиваем его до HTTP_MAX_HEAD_SIZE
+static int request_grow(connection *conn) {
+    if (conn->buffer_size >= HTTP_MAX_HEAD_SIZE) return -1;
+    char *buffer = (char *)realloc(conn->buffer, conn->buffer_size * 2);
+    if (!buffer) return -1;
+    conn->buffer = buffer;
+    conn->buffer_size *= 2;
+    http_reset(&conn->request); // Разобранные части ссылались на старый буфер
+    return 0;
+}
+
+static void read_request(connection *conn) {
+    // Разбор продолжается с места остановки, начало запроса может уже лежать в буфере
+    while (1) {
+        int parsed = http_parse_request(&conn->request, conn->buffer, conn->buffer_len);
+        if (parsed > 0) break;
+        if (parsed < 0) {
+            logger(INFO, "Malformed request, closing connection");
+            connection_close(conn);
+            return;
+        }
+        if (conn->buffer_len) wait_start(conn, WAIT_REQUEST); // Запрос начат: на остальное отведено --request-timeout
+        if (conn->buffer_len == conn->buffer_size && request_grow(conn) < 0) {
+            logger(INFO, "Request headers too large, closing connection");
+            connection_close(conn);
+            return;
+        }
+        ssize_t bytes_received = recv(conn->client.fd, conn->buffer + conn->buffer_len, conn->buffer_size - conn->buffer_len, 0);
+        if (bytes_received > 0) {
+            conn->buffer_len += bytes_received;
+            continue;
+        }
+        if (bytes_received < 0 && errno == EAGAIN) return; // Запрос пришёл не целиком, ждём ещё
+        if (bytes_received < 0) logger(ERROR, "Error receiving data from client");
+        connection_close(conn);
+        return;
+    }
+    wait_stop(conn);
+    process_request(conn);
+}
+
+static void on_client_event(event_watcher *watcher, uint32_t events) {
+    connection *conn = (connection *)watcher->data;
+    if (events & (EPOLLERR | EPOLLHUP)) { // Клиент отключился
+        logger(INFO, "Client disconnected");
+        connection_close(conn);
+        return;
+    }
+    switch (conn->state) {
+        case CONN_READ_REQUEST:
+            read_request(conn);
+            break;
+        case CONN_SEND_CACHED:
+            send_cached(conn);
+            break;
+        case CONN_SEND_DISK:
+            send_disk(conn);
+            break;
+        case CONN_SEND_FETCHED:
+            send_fetched(conn);
+            break;
+        case CONN_RELAY:
+            send_relay(conn);
+            break;
+        default:
+            break;
+    }
+}
+
+void handle_client(event_loop *loop, int client_socket, in_addr_t addr) {
+    connection *conn = (connection *)calloc(1, sizeof(connection));
+    if (conn) conn->buffer = (char *)malloc(BUFFER_SIZE);
+    if (!conn || !conn->buffer || set_nonblocking(client_socket) < 0) {
+        logger(ERROR, "Failed to set up connection for socket %d", client_socket);
+        if (conn) free(conn->buffer);
+        free(conn);
+        close(client_socket);
+        admission_release(addr);
+        return;
+    }
+    conn->loop = loop;
+    conn->addr = addr;
+    conn->waiting = WAIT_KINDS;
+    conn->state = CONN_READ_REQUEST;
+    conn->buffer_size = BUFFER_SIZE;
+    conn->relay_pipe[0] = conn->relay_pipe[1] = -1;
+    event_watcher_init(&conn->upstream, -1, on_relay_event, conn);
+    http_reset(&conn->request);
+    metrics_add(METRIC_CONNECTIONS, 1);
+    event_watcher_init(&conn->client, client_socket, on_client_event, conn);
+    if (event_watcher_set(loop, &conn->client, EPOLLIN) < 0) {
+        close(client_socket);
+        free(conn->buffer);
+        free(conn);
+        admission_release(addr);
+        return;
+    }
+    loop_states[loop->id].count++;
+    wait_start(conn, WAIT_IDLE);
+    read_request(conn); // Запрос часто уже пришёл вместе с подключением
+}
+
+// Раз в тик: закрываем клиентов, пропустивших свой срок, и протухшие соединения с серверами
+void proxy_tick(event_loop *loop) {
+    int stopping = __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+    const int timeouts[WAIT_KINDS] = { stopping ? 0 : config.client_idle_timeout, config.request_timeout, config.send_timeout };
+    time_t now = time(NULL);
+    for (int kind = 0; kind < WAIT_KINDS; kind++) {
+        connection_list *list = &loop_states[loop->id].waits[kind];
+        while (list->head && now - list->head->wait_since >= timeouts[kind]) {
+            if (kind == WAIT_IDLE) {
+                logger(INFO, "Closing idle client connection");
+            } else {
+                logger(INFO, "Closing client connection after %s timeout", kind == WAIT_REQUEST ? "request" : "send");
+                metrics_add(METRIC_CLIENT_TIMEOUTS, 1);
+            }
+            connection_close(list->head);
+        }
+    }
+    resume_acceptor(loop);
+    upstream_sweep();
+    // Соединения сверх доли цикла переходят к другим: после роста пула к новым циклам, после сокращения - от отключённого
+    loop_connections *state = &loop_states[loop->id];
+    int active = thread_pool_active();
+    long long share = loop->id < active ? admission_active() / active : 0;
+    state->shed = !stopping && !config.reuseport && state->count > share + share / SHED_SLACK ? state->count - (int)share : 0;
+}
+
+// Остановка: соединения, ждущие следующего запроса, закрываются сразу, остальные - после текущего ответа
+void proxy_drain(event_loop *loop) {
+    connection_list *list = &loop_states[loop->id].waits[WAIT_IDLE];
+    while (list->head) connection_close(list->head);
+}
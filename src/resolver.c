@@ -0,0 +1,179 @@
+#include "resolver.h"
+
+static resolver_shard shards[RESOLVER_SHARDS];
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER; // Мьютекс очереди разрешения
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER; // Появилась работа для потоков
+static resolver_entry *jobs_head; // Очередь записей, ждущих getaddrinfo
+static resolver_entry *jobs_tail;
+static pthread_once_t resolver_once = PTHREAD_ONCE_INIT;
+
+static void *resolver_thread(void *);
+
+static void resolver_setup() {
+    for (int i = 0; i < RESOLVER_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL); // Инициализация мьютекса
+        shards[i].head = NULL;
+        shards[i].count = 0;
+    }
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_thread, NULL) != 0) {
+            logger(ERROR, "Failed to create resolver thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+static resolver_shard *shard_for(const char *host) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)host; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return &shards[hash & (RESOLVER_SHARDS - 1)];
+}
+
+static void set_port(struct sockaddr_storage *addr, int port) {
+    if (addr->ss_family == AF_INET6) ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    else ((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+// Результат из записи в ожидающего, вызывается под мьютексом шарда
+static void fill_waiter(resolver_waiter *waiter, const resolver_entry *entry) {
+    waiter->ok = entry->ok;
+    if (!entry->ok) return;
+    for (int i = 0; i < entry->count; i++) {
+        waiter->result.addresses[i] = entry->addresses[i];
+        set_port(&waiter->result.addresses[i].addr, waiter->port);
+    }
+    waiter->result.count = entry->count;
+}
+
+static void deliver_task(void *arg) {
+    resolver_waiter *waiter = (resolver_waiter *)arg;
+    waiter->callback(waiter->arg, waiter->ok ? &waiter->result : NULL);
+    free(waiter);
+}
+
+// Удаление протухших готовых записей, когда шард разросся; вызывается под мьютексом шарда
+static void shard_prune(resolver_shard *shard, time_t now) {
+    resolver_entry **link = &shard->head;
+    while (*link) {
+        resolver_entry *entry = *link;
+        if (entry->state == RESOLVER_READY && entry->expiry <= now) {
+            *link = entry->next;
+            free(entry);
+            shard->count--;
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+static void *resolver_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&jobs_lock); // Залочить мьютекс очереди
+        while (!jobs_head) pthread_cond_wait(&jobs_cond, &jobs_lock);
+        resolver_entry *entry = jobs_head;
+        jobs_head = entry->job_next;
+        if (!jobs_head) jobs_tail = NULL;
+        pthread_mutex_unlock(&jobs_lock); // Разлочить мьютекс
+
+        // Запись в состоянии PENDING не удаляется, поэтому имя читаем без блокировки
+        struct addrinfo hints, *result = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC; // IPv4 и IPv6
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        int error = getaddrinfo(entry->host, NULL, &hints, &result);
+        if (error) logger(ERROR, "Failed to resolve host %s: %s", entry->host, gai_strerror(error));
+        else logger(INFO, "Resolved host %s", entry->host);
+
+        resolver_shard *shard = shard_for(entry->host);
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        // Адреса сохраняются в порядке предпочтения getaddrinfo: если первый недоступен
+        // (например, ::1 у localhost при сервере только на 127.0.0.1), подключение пробует следующий
+        entry->count = 0;
+        for (struct addrinfo *info = error ? NULL : result; info && entry->count < RESOLVER_ADDRESSES; info = info->ai_next) {
+            if (info->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+            memcpy(&entry->addresses[entry->count].addr, info->ai_addr, info->ai_addrlen);
+            entry->addresses[entry->count++].len = info->ai_addrlen;
+        }
+        entry->ok = entry->count > 0;
+        entry->expiry = time(NULL) + (entry->ok ? config.dns_ttl : config.dns_negative_ttl);
+        entry->state = RESOLVER_READY;
+        resolver_waiter *waiters = entry->waiters;
+        entry->waiters = NULL;
+        for (resolver_waiter *waiter = waiters; waiter; waiter = waiter->next) fill_waiter(waiter, entry);
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        if (result) freeaddrinfo(result);
+
+        while (waiters) { // Результат возвращается в циклы запросивших
+            resolver_waiter *next = waiters->next;
+            if (event_loop_post(waiters->loop, deliver_task, waiters) < 0) free(waiters);
+            waiters = next;
+        }
+    }
+    return NULL;
+}
+
+// Разрешение имени: из кэша сразу, иначе в потоке резолвера с доставкой результата в цикл loop
+void resolve_async(event_loop *loop, const char *host, int port, resolve_callback callback, void *arg) {
+    pthread_once(&resolver_once, resolver_setup);
+    resolver_waiter *waiter = (resolver_waiter *)calloc(1, sizeof(resolver_waiter));
+    if (!waiter) {
+        logger(ERROR, "Failed to allocate resolver request");
+        callback(arg, NULL);
+        return;
+    }
+    waiter->loop = loop;
+    waiter->callback = callback;
+    waiter->arg = arg;
+    waiter->port = port;
+
+    resolver_shard *shard = shard_for(host);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    resolver_entry *entry = shard->head;
+    while (entry && strcmp(entry->host, host) != 0) entry = entry->next;
+    if (entry && entry->state == RESOLVER_READY && entry->expiry > now) { // Попадание в кэш
+        fill_waiter(waiter, entry);
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        callback(arg, waiter->ok ? &waiter->result : NULL);
+        free(waiter);
+        return;
+    }
+    if (entry && entry->state == RESOLVER_PENDING) { // Имя уже разрешается - ждём тот же ответ
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        return;
+    }
+    if (!entry) {
+        if (shard->count >= RESOLVER_MAX_ENTRIES) shard_prune(shard, now);
+        entry = (resolver_entry *)calloc(1, sizeof(resolver_entry));
+        if (!entry) {
+            pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+            logger(ERROR, "Failed to allocate resolver entry");
+            free(waiter);
+            callback(arg, NULL);
+            return;
+        }
+        strncpy(entry->host, host, HOST_SIZE - 1);
+        entry->next = shard->head;
+        shard->head = entry;
+        shard->count++;
+    }
+    entry->state = RESOLVER_PENDING; // Новая или протухшая запись уходит в очередь
+    entry->waiters = waiter;
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+
+    pthread_mutex_lock(&jobs_lock); // Залочить мьютекс очереди
+    entry->job_next = NULL;
+    if (jobs_tail) jobs_tail->job_next = entry;
+    else jobs_head = entry;
+    jobs_tail = entry;
+    pthread_cond_signal(&jobs_cond); // Будим поток резолвера
+    pthread_mutex_unlock(&jobs_lock); // Разлочить мьютекс
+}
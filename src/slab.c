@@ -0,0 +1,125 @@
+#include "slab.h"
+
+static slab_class classes[SLAB_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static size_t mapped_bytes; // Байт, полученных у ОС под страницы и крупные блоки
+
+static void slab_setup() {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_init(&classes[i].lock, NULL); // Инициализация мьютекса класса
+        classes[i].partial = NULL;
+        classes[i].partial_count = 0;
+        classes[i].block_size = (size_t)1 << (SLAB_MIN_SHIFT + i);
+    }
+}
+
+void slab_init() {
+    pthread_once(&slab_once, slab_setup);
+}
+
+// Номер класса для размера: наименьшая степень двойки, вмещающая запрос
+static int slab_class_of(size_t size) {
+    int shift = SLAB_MIN_SHIFT;
+    while (((size_t)1 << shift) < size) shift++;
+    return shift - SLAB_MIN_SHIFT;
+}
+
+size_t slab_block_size(size_t size) {
+    if (size > SLAB_MAX_SIZE) return size; // Крупные блоки выделяются точно по размеру
+    return (size_t)1 << (SLAB_MIN_SHIFT + slab_class_of(size));
+}
+
+size_t slab_mapped_bytes() {
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+}
+
+// Выделение страницы, выровненной по SLAB_PAGE_SIZE, чтобы находить её заголовок по адресу блока
+static slab_page *slab_page_map(int cls) {
+    char *raw = mmap(NULL, SLAB_PAGE_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + SLAB_PAGE_SIZE - 1) & ~((uintptr_t)SLAB_PAGE_SIZE - 1));
+    if (aligned > raw) munmap(raw, aligned - raw); // Отрезаем лишнее спереди
+    munmap(aligned + SLAB_PAGE_SIZE, raw + SLAB_PAGE_SIZE * 2 - (aligned + SLAB_PAGE_SIZE)); // И сзади
+
+    size_t block_size = classes[cls].block_size;
+    size_t header = (sizeof(slab_page) + block_size - 1) / block_size * block_size; // Заголовок занимает целые блоки
+    slab_page *page = (slab_page *)aligned;
+    page->prev = page->next = NULL;
+    page->free_list = NULL;
+    page->bump = aligned + header; // Блоки размечаются лениво, не трогая память раньше времени
+    page->used = 0;
+    page->total = (SLAB_PAGE_SIZE - header) / block_size;
+    page->cls = cls;
+    __atomic_add_fetch(&mapped_bytes, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    return page;
+}
+
+static void partial_push(slab_class *class, slab_page *page) {
+    page->prev = NULL;
+    page->next = class->partial;
+    if (class->partial) class->partial->prev = page;
+    class->partial = page;
+    class->partial_count++;
+}
+
+static void partial_unlink(slab_class *class, slab_page *page) {
+    if (page->prev) page->prev->next = page->next;
+    if (page->next) page->next->prev = page->prev;
+    if (class->partial == page) class->partial = page->next;
+    page->prev = page->next = NULL;
+    class->partial_count--;
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) { // Крупный блок - напрямую у аллокатора
+        void *ptr = malloc(size);
+        if (ptr) __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+        return ptr;
+    }
+    slab_init();
+    int cls = slab_class_of(size);
+    slab_class *class = &classes[cls];
+    pthread_mutex_lock(&class->lock); // Залочить мьютекс класса
+    slab_page *page = class->partial;
+    if (!page) {
+        page = slab_page_map(cls);
+        if (!page) {
+            pthread_mutex_unlock(&class->lock); // Разлочить мьютекс
+            logger(ERROR, "Failed to map slab page for class %zu", class->block_size);
+            return NULL;
+        }
+        partial_push(class, page);
+    }
+    void *block;
+    if (page->free_list) { // Сначала переиспользуем освобождённые блоки
+        block = page->free_list;
+        page->free_list = *(void **)block;
+    } else { // Иначе размечаем следующий блок страницы
+        block = page->bump;
+        page->bump += class->block_size;
+    }
+    if (++page->used == page->total) partial_unlink(class, page); // Страница заполнена
+    pthread_mutex_unlock(&class->lock); // Разлочить мьютекс
+    return block;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) return;
+    if (size > SLAB_MAX_SIZE) {
+        free(ptr);
+        __atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+        return;
+    }
+    slab_page *page = (slab_page *)((uintptr_t)ptr & ~((uintptr_t)SLAB_PAGE_SIZE - 1));
+    slab_class *class = &classes[page->cls];
+    pthread_mutex_lock(&class->lock); // Залочить мьютекс класса
+    *(void **)ptr = page->free_list; // Возвращаем блок в список свободных страницы
+    page->free_list = ptr;
+    if (page->used-- == page->total) partial_push(class, page); // Страница снова имеет свободные блоки
+    if (page->used == 0 && class->partial_count > 1) { // Пустую страницу отдаём ОС, одну оставляем про запас
+        partial_unlink(class, page);
+        munmap(page, SLAB_PAGE_SIZE);
+        __atomic_sub_fetch(&mapped_bytes, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&class->lock); // Разлочить мьютекс
+}
@@ -1,107 +1,357 @@
-#include "thread_pool.h"
-
-thread_pool pool;
-pthread_t threads[THREAD_POOL_SIZE];
-
-void init_thread_pool() {
-    pool.capacity = QUEUE_INITIAL_CAPACITY; // Задаём размер очереди
-    pool.queue = (int *)malloc(pool.capacity * sizeof(int)); // Выделяем под очередь память
-    if (!pool.queue) {
-        logger(ERROR, "Failed to allocate memory for the queue");
-        exit(EXIT_FAILURE);
-    }
-    pool.front = pool.rear = 0; // Очередь пуста
-    pool.stop = 0; // Пул активен
-    pthread_mutex_init(&pool.lock, NULL); // Инициализация мьютекса
-    pthread_cond_init(&pool.cond, NULL); // Инициализация условной переменной
-    logger(INFO, "Thread pool initialized");
-}
-
-void resize_queue() {
-    size_t new_capacity = pool.capacity * 2; // Удваиваем размер очереди
-    int *new_queue = (int *)realloc(pool.queue, new_capacity * sizeof(int)); // Выделяем память для нового размера
-    if (!new_queue) {
-        logger(ERROR, "Failed to resize queue");
-        exit(EXIT_FAILURE);
-    }
-    if (pool.front > pool.rear) {
-        for (size_t i = 0; i < pool.rear; i++) {
-            new_queue[pool.capacity + i] = pool.queue[i];
-        }
-        pool.rear += pool.capacity;
-    }
-    pool.capacity = new_capacity; // Обновляем объем
-    pool.queue = new_queue; // Обновляем указатель на очередь
-    logger(DEBUG, "Queue resized to %lu", pool.capacity);
-}
-
-void enqueue(int client_socket) {
-    pthread_mutex_lock(&pool.lock); // Залочить мьютекс
-    // В случае достижения лимита увеличиваем размер очереди в два раза
-    if (pool.size == pool.capacity) resize_queue();
-    pool.queue[pool.rear] = client_socket; // Добавляет сокет в очередь
-    pool.rear = (pool.rear + 1) % pool.capacity;
-    pool.size++; // Увеличение размера
-    pthread_cond_signal(&pool.cond); // Отправка сигнала появления нового сокета в очереди
-    pthread_mutex_unlock(&pool.lock); // Разлочить мьютекс
-    logger(DEBUG, "Client socket %d added to queue", client_socket);
-}
-
-int dequeue() {
-    pthread_mutex_lock(&pool.lock); // Залочить мьютекс
-    while (!pool.size && !pool.stop) {
-        pthread_cond_wait(&pool.cond, &pool.lock); // Если очередь пуста засыпаем в ожидании пока задача появится
-    }
-    if (pool.stop) { // Если активирован стоп флаг
-        pthread_mutex_unlock(&pool.lock); // Разлочить мьютекс
-        logger(DEBUG, "Thread pool caught stop flag");
-        return -1;
-    }
-    int client_socket = pool.queue[pool.front]; // Достаём соккет из очереди
-    pool.front = (pool.front + 1) % pool.capacity;
-    pool.size--; // Уменьшение размера
-    pthread_mutex_unlock(&pool.lock); // Разлочить мьютекс
-    logger(DEBUG, "Client socket %d dequeued", client_socket);
-    return client_socket;
-}
-
-void *thread_function(void *arg) {
-    logger(INFO, "Thread started to work");
-    while (1) {
-        int client_socket = dequeue();  // Извлечь сокет из очереди
-        if (client_socket == -1) break;  // Завершить поток, если `dequeue` вернул -1
-        handle_client(client_socket);    // Выполнить задание
-        logger(INFO, "Handled client with socket: %d", client_socket);
-    }
-    logger(INFO, "Thread exiting");
-    return NULL;
-}
-
-
-void start_thread_pool() {
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-      // Создает потоки и запускает функцию thread_function для каждого потока
-      if (pthread_create(&threads[i], NULL, thread_function, NULL) != 0) {
-          logger(ERROR, "Failed to create thread %d", i);
-          exit(EXIT_FAILURE);
-      }
-    }
-    logger(INFO, "All threads started");
-}
-
-void stop_thread_pool() {
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        if (pthread_join(threads[i], NULL) != 0) {  // Дождаться завершения каждого потока
-            logger(WARNING, "Failed to join thread %d", i);
-        }
-    }
-    pthread_mutex_lock(&pool.lock); // Залочить мьютекс
-    pool.stop = 1;                  // Установить флаг завершения
-    pthread_cond_broadcast(&pool.cond);  // Разбудить все потоки
-    pthread_mutex_unlock(&pool.lock); // Разлочить мьютекс
-
-    pthread_mutex_destroy(&pool.lock); // Дестрой мютекса
-    pthread_cond_destroy(&pool.cond); // Дестрой кондишена
-    free(pool.queue); // Очистка очереди
-    logger(INFO, "Thread pool stopped and all resources freed");
-}
+#include "thread_pool.h"
+
+thread_pool pool;
+
+static void pool_tick(event_loop *);
+
+// Пробуждённый цикл забирает из очереди все ожидающие сокеты
+static void drain_queue(event_loop *loop) {
+    if (loop->id >= __atomic_load_n(&pool.active, __ATOMIC_RELAXED)) return; // Отключённый цикл новых соединений не берёт
+    int client_socket;
+    in_addr_t addr;
+    while ((client_socket = dequeue(&addr)) != -1) {
+        handle_client(loop, client_socket, addr); // Соединение переходит во владение цикла
+    }
+}
+
+void init_thread_pool() {
+    pool.threads = config.threads; // Один цикл событий на ядро
+    pool.next = 0;
+    pool.queue = (handoff_cell *)malloc(QUEUE_CAPACITY * sizeof(handoff_cell)); // Очередь фиксированного размера
+    pool.loops = (event_loop *)calloc(pool.threads, sizeof(event_loop));
+    pool.acceptors = (event_watcher *)calloc(pool.threads, sizeof(event_watcher));
+    pool.paused = (int *)calloc(pool.threads, sizeof(int));
+    pool.busy_seen = (long long *)calloc(pool.threads, sizeof(long long));
+    if (!pool.queue || !pool.loops || !pool.acceptors || !pool.paused || !pool.busy_seen) {
+        logger(ERROR, "Failed to allocate memory for the queue");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < pool.threads; i++) {
+        if (event_loop_init(&pool.loops[i], i) < 0) {
+            logger(ERROR, "Failed to initialize event loop %d", i);
+            exit(EXIT_FAILURE);
+        }
+        pool.loops[i].on_wake = drain_queue;
+        pool.loops[i].on_tick = pool_tick; // Тайм-ауты соединений и размер пула
+        pool.acceptors[i].fd = -1; // Слушающий сокет появится только в режиме SO_REUSEPORT
+    }
+    pool.mask = QUEUE_CAPACITY - 1;
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        pool.queue[i].sequence = i; // Ячейка i свободна для записи на ходу i
+    }
+    pool.enqueue_pos = pool.dequeue_pos = 0; // Очередь пуста
+    pool.stop = 0; // Пул активен
+    pool.active = config.min_threads;
+    pool.started = 0;
+    pool.calm_ticks = 0;
+    pool.draining = 0;
+    logger(INFO, "Thread pool initialized with %d to %d event loops", config.min_threads, pool.threads);
+}
+
+// Запись в очередь без блокировок: писатель занимает позицию CAS-ом и публикует ячейку номером хода
+static int handoff_push(int client_socket, in_addr_t addr) {
+    size_t pos = __atomic_load_n(&pool.enqueue_pos, __ATOMIC_RELAXED);
+    handoff_cell *cell;
+    for (;;) {
+        cell = &pool.queue[pos & pool.mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) { // Ячейка свободна: пробуем занять позицию
+            if (__atomic_compare_exchange_n(&pool.enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) { // Читатель ещё не освободил ячейку круг назад - очередь полна
+            return -1;
+        } else { // Другой писатель успел раньше
+            pos = __atomic_load_n(&pool.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->client_socket = client_socket;
+    cell->addr = addr;
+    cell->enqueued = metrics_now();
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE); // Ячейка готова для читателя
+    return 0;
+}
+
+// Чтение из очереди без блокировок, -1 если очередь пуста
+static int handoff_pop(in_addr_t *addr, long long *enqueued) {
+    size_t pos = __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED);
+    handoff_cell *cell;
+    for (;;) {
+        cell = &pool.queue[pos & pool.mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) { // Ячейка заполнена: пробуем забрать позицию
+            if (__atomic_compare_exchange_n(&pool.dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) { // Писатель ещё не дошёл до ячейки - очередь пуста
+            return -1;
+        } else { // Другой читатель успел раньше
+            pos = __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    int client_socket = cell->client_socket;
+    *addr = cell->addr;
+    *enqueued = cell->enqueued;
+    __atomic_store_n(&cell->sequence, pos + pool.mask + 1, __ATOMIC_RELEASE); // Ячейка свободна для следующего круга
+    return client_socket;
+}
+
+// Передача сокета циклам событий, -1 если очередь переполнена
+int enqueue(int client_socket, in_addr_t addr) {
+    if (handoff_push(client_socket, addr) < 0) {
+        logger(WARNING, "Handoff queue is full, rejecting client socket %d", client_socket);
+        metrics_add(METRIC_QUEUE_FULL, 1);
+        return -1;
+    }
+    unsigned next = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+    event_loop_wake(&pool.loops[next % __atomic_load_n(&pool.active, __ATOMIC_RELAXED)]); // Работающие циклы будятся по кругу
+    logger(DEBUG, "Client socket %d added to queue", client_socket);
+    return 0;
+}
+
+// Неблокирующее извлечение: -1, если очередь пуста или пул остановлен
+int dequeue(in_addr_t *addr) {
+    if (__atomic_load_n(&pool.stop, __ATOMIC_ACQUIRE)) return -1;
+    long long enqueued;
+    int client_socket = handoff_pop(addr, &enqueued);
+    if (client_socket == -1) return -1;
+    metrics_observe(STAGE_QUEUE_WAIT, metrics_now() - enqueued);
+    logger(DEBUG, "Client socket %d dequeued", client_socket);
+    return client_socket;
+}
+
+// Сокетов в очереди сейчас, оценка без блокировок
+long long thread_pool_depth() {
+    size_t dequeued = __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED);
+    size_t enqueued = __atomic_load_n(&pool.enqueue_pos, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? (long long)(enqueued - dequeued) : 0;
+}
+
+// Цикл сам принимает подключения со своего сокета SO_REUSEPORT, минуя общую очередь
+static void on_accept(event_watcher *watcher, uint32_t events) {
+    (void)events;
+    event_loop *loop = (event_loop *)watcher->data;
+    for (int i = 0; i < ACCEPT_BATCH; i++) { // Не даём одному сокету занять цикл целиком
+        if (admission_full()) { // На пределе соединений новые клиенты ждут в бэклоге ядра
+            event_watcher_set(loop, watcher, 0);
+            pool.paused[loop->id] = 1;
+            metrics_add(METRIC_ACCEPT_PAUSED, 1);
+            logger(WARNING, "Connection limit reached, pausing accept on loop %d", loop->id);
+            return;
+        }
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept(watcher->fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                logger(ERROR, "Client accept failed on loop %d", loop->id);
+            }
+            return;
+        }
+        if (admission_acquire(client_addr.sin_addr.s_addr) < 0) { // Клиент превысил свою долю соединений
+            admission_reject(client_socket);
+            continue;
+        }
+        handle_client(loop, client_socket, client_addr.sin_addr.s_addr);
+    }
+}
+
+// Приостановленный приём цикла продолжается, когда соединений стало меньше предела
+void resume_acceptor(event_loop *loop) {
+    if (!pool.paused[loop->id] || pool.acceptors[loop->id].fd < 0 || admission_full()) return;
+    pool.paused[loop->id] = 0;
+    event_watcher_set(loop, &pool.acceptors[loop->id], EPOLLIN);
+}
+
+// Отдаёт циклу index собственный слушающий сокет
+void add_acceptor(int index, int server_socket) {
+    event_loop *loop = &pool.loops[index];
+    event_watcher *watcher = &pool.acceptors[index];
+    if (set_nonblocking(server_socket) < 0) {
+        logger(ERROR, "Failed to make listening socket non-blocking");
+        exit(EXIT_FAILURE);
+    }
+    event_watcher_init(watcher, server_socket, on_accept, loop);
+    if (event_watcher_set(loop, watcher, EPOLLIN) < 0) {
+        logger(ERROR, "Failed to register listening socket on loop %d", index);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int thread_pool_active() {
+    return __atomic_load_n(&pool.active, __ATOMIC_RELAXED);
+}
+
+long long thread_pool_loops() {
+    return thread_pool_active();
+}
+
+// Процессоры узла NUMA по списку вида 0-3,8-11 из sysfs, -1 если узла нет
+static int numa_node_cpus(int node, cpu_set_t *set) {
+    char path[64], list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    int ok = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if (!ok) return -1;
+    CPU_ZERO(set);
+    for (char *p = list; *p >= '0' && *p <= '9'; ) {
+        long first = strtol(p, &p, 10), last = first;
+        if (*p == '-') last = strtol(p + 1, &p, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+        if (*p == ',') p++;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+// Привязка потока цикла: по процессору из разрешённых процессу или по узлу NUMA, циклы раскладываются по кругу
+static void pin_thread(event_loop *loop) {
+    cpu_set_t allowed, set;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || !CPU_COUNT(&allowed)) return;
+    CPU_ZERO(&set);
+    if (config.pin_threads == PIN_NUMA) {
+        int nodes = 0;
+        cpu_set_t node_sets[POOL_NUMA_NODES];
+        for (int node = 0; node < POOL_NUMA_NODES; node++) {
+            if (numa_node_cpus(node, &node_sets[nodes]) < 0) continue;
+            CPU_AND(&node_sets[nodes], &node_sets[nodes], &allowed);
+            if (CPU_COUNT(&node_sets[nodes])) nodes++;
+        }
+        if (nodes) set = node_sets[loop->id % nodes];
+        else logger(WARNING, "No NUMA nodes found, pinning loop %d to a single CPU", loop->id);
+    }
+    if (!CPU_COUNT(&set)) {
+        int index = loop->id % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+                CPU_SET(cpu, &set);
+                break;
+            }
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        logger(WARNING, "Failed to pin event loop %d", loop->id);
+    }
+}
+
+void *thread_function(void *arg) {
+    event_loop *loop = (event_loop *)arg;
+    if (config.pin_threads != PIN_NONE) pin_thread(loop);
+    logger(INFO, "Thread started to work");
+    event_loop_run(loop); // Поток обслуживает все соединения своего цикла
+    logger(INFO, "Thread exiting");
+    return NULL;
+}
+
+// Запуск потоков циклов с номерами до count; уже запущенные не трогаются
+static int start_loops(int count) {
+    while (pool.started < count) {
+        int i = pool.started;
+        if (pthread_create(&pool.loops[i].thread, NULL, thread_function, &pool.loops[i]) != 0) {
+            logger(ERROR, "Failed to create thread %d", i);
+            return -1;
+        }
+        __atomic_store_n(&pool.started, i + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Раз в тик в цикле 0: циклов вдвое больше, если работающие заняты или очередь растёт,
+// и на один меньше после POOL_SHRINK_TICKS спокойных тиков. Загрузки с сервера циклы не блокируют,
+// поэтому медленный сервер занятость не поднимает и лишних потоков не требует
+static void pool_adjust() {
+    if (__atomic_load_n(&pool.draining, __ATOMIC_ACQUIRE)) return;
+    long long now = metrics_now();
+    long long elapsed = now - pool.adjusted_at;
+    pool.adjusted_at = now;
+    int active = pool.active;
+    long long busy = 0;
+    for (int i = 0; i < pool.started; i++) {
+        long long total = __atomic_load_n(&pool.loops[i].busy_us, __ATOMIC_RELAXED);
+        if (i < active) busy += total - pool.busy_seen[i];
+        pool.busy_seen[i] = total;
+    }
+    if (elapsed <= 0 || pool.threads == config.min_threads) return;
+    double load = (double)busy / ((double)elapsed * active);
+    long long depth = thread_pool_depth();
+    if ((load > POOL_GROW_LOAD || depth >= (long long)active * POOL_GROW_DEPTH) && active < pool.threads) {
+        int grown = active * 2 < pool.threads ? active * 2 : pool.threads;
+        if (start_loops(grown) < 0) grown = pool.started;
+        if (grown <= active) return;
+        logger(INFO, "Event loops busy %.0f%%, queue %lld: growing pool to %d loops", load * 100, depth, grown);
+        __atomic_store_n(&pool.active, grown, __ATOMIC_RELAXED);
+        pool.calm_ticks = 0;
+    } else if (load < POOL_SHRINK_LOAD && !depth && active > config.min_threads) {
+        if (++pool.calm_ticks < POOL_SHRINK_TICKS) return;
+        logger(INFO, "Event loops busy %.0f%%: shrinking pool to %d loops", load * 100, active - 1);
+        __atomic_store_n(&pool.active, active - 1, __ATOMIC_RELAXED); // Его соединения перейдут к остальным
+        pool.calm_ticks = 0;
+    } else {
+        pool.calm_ticks = 0;
+    }
+}
+
+static void pool_tick(event_loop *loop) {
+    if (loop->id == 0) pool_adjust();
+    proxy_tick(loop);
+}
+
+void start_thread_pool() {
+    pool.adjusted_at = metrics_now();
+    if (start_loops(pool.active) < 0) exit(EXIT_FAILURE); // Остальные циклы запустятся под нагрузкой
+    logger(INFO, "All threads started");
+}
+
+// Остановка приёма: циклы закрывают свои слушающие сокеты и соединения, ждущие следующего запроса
+static void drain_loop(void *arg) {
+    event_loop *loop = (event_loop *)arg;
+    event_watcher_close(loop, &pool.acceptors[loop->id]);
+    pool.paused[loop->id] = 0; // Закрытый приём больше не возобновляется
+    proxy_drain(loop);
+}
+
+// Выполняется в цикле 0, где идёт и подстройка пула: после флага draining новых циклов не появится,
+// поэтому сюда попадают все запущенные циклы
+static void drain_pool(void *arg) {
+    (void)arg;
+    for (int i = 0; i < pool.started; i++) {
+        if (event_loop_post(&pool.loops[i], drain_loop, &pool.loops[i]) < 0) {
+            logger(WARNING, "Failed to drain event loop %d", i);
+        }
+    }
+}
+
+void drain_thread_pool() {
+    __atomic_store_n(&pool.draining, 1, __ATOMIC_RELEASE);
+    if (event_loop_post(&pool.loops[0], drain_pool, NULL) < 0) {
+        logger(WARNING, "Failed to drain event loops");
+    }
+}
+
+void stop_thread_pool() {
+    __atomic_store_n(&pool.stop, 1, __ATOMIC_RELEASE); // Установить флаг завершения
+    int started = __atomic_load_n(&pool.started, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < started; i++) {
+        event_loop_stop(&pool.loops[i]); // Разбудить и остановить каждый цикл
+    }
+    for (int i = 0; i < pool.threads; i++) {
+        if (i < started && pthread_join(pool.loops[i].thread, NULL) != 0) {  // Дождаться завершения каждого потока
+            logger(WARNING, "Failed to join thread %d", i);
+        }
+        event_watcher_close(&pool.loops[i], &pool.acceptors[i]); // Слушающий сокет цикла, если был
+        event_loop_destroy(&pool.loops[i]);
+    }
+    int client_socket;
+    in_addr_t addr;
+    long long enqueued;
+    while ((client_socket = handoff_pop(&addr, &enqueued)) != -1) { // Закрываем сокеты, которые так и не были обработаны
+        close(client_socket);
+        admission_release(addr);
+    }
+
+    free(pool.queue); // Очистка очереди
+    free(pool.acceptors); // Очистка слушающих сокетов циклов
+    free(pool.paused);
+    free(pool.busy_seen);
+    free(pool.loops); // Очистка циклов
+    logger(INFO, "Thread pool stopped and all resources freed");
+}
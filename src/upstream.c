@@ -0,0 +1,116 @@
+#include "upstream.h"
+
+static upstream_shard pool[UPSTREAM_POOL_SHARDS];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_setup() {
+    for (int i = 0; i < UPSTREAM_POOL_SHARDS; i++) {
+        pthread_mutex_init(&pool[i].lock, NULL); // Инициализация мьютекса
+        pool[i].head = NULL;
+    }
+}
+
+// Шард по хосту и порту: все соединения одного сервера лежат вместе
+static upstream_shard *shard_for(const char *host, int port) {
+    pthread_once(&pool_once, pool_setup);
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)host; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    hash = (hash ^ (uint64_t)port) * 1099511628211ULL;
+    return &pool[hash & (UPSTREAM_POOL_SHARDS - 1)];
+}
+
+static int idle_matches(const upstream_idle *idle, const char *host, int port) {
+    return idle->port == port && strcmp(idle->host, host) == 0;
+}
+
+// Сервер мог закрыть соединение, пока оно простаивало: тогда в сокете EOF или мусор
+static int idle_alive(int fd) {
+    char byte;
+    ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Свежайшее живое соединение с сервером или -1, если придётся подключаться заново
+int upstream_acquire(const char *host, int port) {
+    upstream_shard *shard = shard_for(host, port);
+    time_t now = time(NULL);
+    while (1) {
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        upstream_idle *found = NULL;
+        for (upstream_idle **link = &shard->head; *link; link = &(*link)->next) {
+            if (idle_matches(*link, host, port)) {
+                found = *link;
+                *link = found->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        if (!found) return -1;
+        int fd = found->fd;
+        int expired = now - found->since >= config.upstream_idle_timeout;
+        free(found);
+        if (!expired && idle_alive(fd)) return fd;
+        close(fd); // Протухшее соединение, пробуем следующее
+    }
+}
+
+// Возврат соединения после полного ответа; сверх лимита на сервер соединение закрывается
+void upstream_release(const char *host, int port, int fd) {
+    upstream_shard *shard = shard_for(host, port);
+    upstream_idle *idle = (upstream_idle *)malloc(sizeof(upstream_idle));
+    if (!idle) {
+        close(fd);
+        return;
+    }
+    idle->fd = fd;
+    idle->port = port;
+    idle->since = time(NULL);
+    strncpy(idle->host, host, HOST_SIZE - 1);
+    idle->host[HOST_SIZE - 1] = '\0';
+    pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+    int count = 0;
+    for (upstream_idle *it = shard->head; it; it = it->next) {
+        if (idle_matches(it, host, port)) count++;
+    }
+    if (count >= config.upstream_max_idle) {
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        logger(DEBUG, "Idle pool for %s:%d is full, closing connection", host, port);
+        close(fd);
+        free(idle);
+        return;
+    }
+    idle->next = shard->head;
+    shard->head = idle;
+    pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+}
+
+// Закрытие соединений, простаивающих дольше тайм-аута
+void upstream_sweep() {
+    pthread_once(&pool_once, pool_setup);
+    time_t now = time(NULL);
+    for (int i = 0; i < UPSTREAM_POOL_SHARDS; i++) {
+        upstream_shard *shard = &pool[i];
+        upstream_idle *expired = NULL;
+        pthread_mutex_lock(&shard->lock); // Залочить мьютекс шарда
+        upstream_idle **link = &shard->head;
+        while (*link) {
+            upstream_idle *idle = *link;
+            if (now - idle->since >= config.upstream_idle_timeout) {
+                *link = idle->next;
+                idle->next = expired;
+                expired = idle;
+            } else {
+                link = &idle->next;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock); // Разлочить мьютекс
+        while (expired) { // Закрываем вне блокировки
+            upstream_idle *next = expired->next;
+            close(expired->fd);
+            free(expired);
+            expired = next;
+        }
+    }
+}